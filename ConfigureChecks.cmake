@@ -48,6 +48,7 @@ endif (SOLARIS)
 
 # HEADER FILES
 check_include_file(assert.h HAVE_ASSERT_H)
+check_include_file(execinfo.h HAVE_EXECINFO_H)
 check_include_file(inttypes.h HAVE_INTTYPES_H)
 check_include_file(io.h HAVE_IO_H)
 check_include_file(malloc.h HAVE_MALLOC_H)
@@ -61,8 +62,10 @@ check_include_file(stdio.h HAVE_STDIO_H)
 check_include_file(stdlib.h HAVE_STDLIB_H)
 check_include_file(string.h HAVE_STRING_H)
 check_include_file(strings.h HAVE_STRINGS_H)
+check_include_file(sys/mman.h HAVE_SYS_MMAN_H)
 check_include_file(sys/stat.h HAVE_SYS_STAT_H)
 check_include_file(sys/types.h HAVE_SYS_TYPES_H)
+check_include_file(sys/wait.h HAVE_SYS_WAIT_H)
 check_include_file(time.h HAVE_TIME_H)
 check_include_file(unistd.h HAVE_UNISTD_H)
 
@@ -71,8 +74,10 @@ if (HAVE_TIME_H)
 endif (HAVE_TIME_H)
 
 # FUNCTIONS
+check_function_exists(backtrace HAVE_BACKTRACE)
 check_function_exists(calloc HAVE_CALLOC)
 check_function_exists(exit HAVE_EXIT)
+check_function_exists(fork HAVE_FORK)
 check_function_exists(fprintf HAVE_FPRINTF)
 check_function_exists(free HAVE_FREE)
 check_function_exists(longjmp HAVE_LONGJMP)
@@ -80,8 +85,10 @@ check_function_exists(siglongjmp HAVE_SIGLONGJMP)
 check_function_exists(malloc HAVE_MALLOC)
 check_function_exists(memcpy HAVE_MEMCPY)
 check_function_exists(memset HAVE_MEMSET)
+check_function_exists(mprotect HAVE_MPROTECT)
 check_function_exists(printf HAVE_PRINTF)
 check_function_exists(setjmp HAVE_SETJMP)
+check_function_exists(sigaction HAVE_SIGACTION)
 check_function_exists(signal HAVE_SIGNAL)
 check_function_exists(strsignal HAVE_STRSIGNAL)
 check_function_exists(strcmp HAVE_STRCMP)
@@ -112,6 +119,19 @@ int main(void) {
     return 0;
 }" HAVE_GCC_THREAD_LOCAL_STORAGE)
 
+check_c_source_compiles("
+#include <stddef.h>
+
+int main(void) {
+    volatile long lock = 0;
+    volatile size_t counter = 0;
+
+    if (__sync_lock_test_and_set(&lock, 1) == 0) {
+        __sync_lock_release(&lock);
+    }
+    return (int)__sync_add_and_fetch(&counter, 1) - 1;
+}" HAVE_GCC_SYNC_BUILTINS)
+
 if (WIN32)
 check_c_source_compiles("
 __declspec(thread) int tls;
@@ -20,6 +20,9 @@
 /* Define to 1 if you have the <dlfcn.h> header file. */
 #cmakedefine HAVE_DLFCN_H 1
 
+/* Define to 1 if you have the <execinfo.h> header file. */
+#cmakedefine HAVE_EXECINFO_H 1
+
 /* Define to 1 if you have the <inttypes.h> header file. */
 #cmakedefine HAVE_INTTYPES_H 1
 
@@ -59,12 +62,18 @@
 /* Define to 1 if you have the <string.h> header file. */
 #cmakedefine HAVE_STRING_H 1
 
+/* Define to 1 if you have the <sys/mman.h> header file. */
+#cmakedefine HAVE_SYS_MMAN_H 1
+
 /* Define to 1 if you have the <sys/stat.h> header file. */
 #cmakedefine HAVE_SYS_STAT_H 1
 
 /* Define to 1 if you have the <sys/types.h> header file. */
 #cmakedefine HAVE_SYS_TYPES_H 1
 
+/* Define to 1 if you have the <sys/wait.h> header file. */
+#cmakedefine HAVE_SYS_WAIT_H 1
+
 /* Define to 1 if you have the <time.h> header file. */
 #cmakedefine HAVE_TIME_H 1
 
@@ -77,12 +86,18 @@
 
 /*************************** FUNCTIONS ***************************/
 
+/* Define to 1 if you have the `backtrace' function. */
+#cmakedefine HAVE_BACKTRACE 1
+
 /* Define to 1 if you have the `calloc' function. */
 #cmakedefine HAVE_CALLOC 1
 
 /* Define to 1 if you have the `exit' function. */
 #cmakedefine HAVE_EXIT 1
 
+/* Define to 1 if you have the `fork' function. */
+#cmakedefine HAVE_FORK 1
+
 /* Define to 1 if you have the `fprintf' function. */
 #cmakedefine HAVE_FPRINTF 1
 
@@ -143,6 +158,12 @@
 /* Define to 1 if you have the `vsnprintf' function. */
 #cmakedefine HAVE_VSNPRINTF 1
 
+/* Define to 1 if you have the `mprotect' function. */
+#cmakedefine HAVE_MPROTECT 1
+
+/* Define to 1 if you have the `sigaction' function. */
+#cmakedefine HAVE_SIGACTION 1
+
 /* Define to 1 if you have the `strsignal' function. */
 #cmakedefine HAVE_STRSIGNAL 1
 
@@ -157,6 +178,9 @@
 /* Check if we have TLS support with MSVC */
 #cmakedefine HAVE_MSVC_THREAD_LOCAL_STORAGE 1
 
+/* Check if we have the __sync atomic builtins of GCC */
+#cmakedefine HAVE_GCC_SYNC_BUILTINS 1
+
 /* Check if we have CLOCK_REALTIME for clock_gettime() */
 #cmakedefine HAVE_CLOCK_REALTIME 1
 
@@ -390,6 +390,47 @@ void will_return_maybe(#function, LargestIntegralType value);
 #define will_return_maybe(function, value) \
     will_return_count(function, (value), WILL_RETURN_ONCE)
 #endif
+
+#ifdef DOXYGEN
+/**
+ * @brief Store an array of values to be returned by mock() later.
+ *
+ * Each call to mock() returns the next value of the array. This is
+ * equivalent to calling will_return() for every element of the array, but
+ * the values are queued as a single block, so feeding a mock a long stream of
+ * values is cheap.
+ *
+ * @param[in]  #function  The function which should return the given values.
+ *
+ * @param[in]  values[]  The array of values to be returned by mock(). The
+ *                       values are copied.
+ *
+ * @param[in]  count  The number of values in the array.
+ *
+ * @code
+ * ssize_t __wrap_read(int fd, void *buf, size_t count)
+ * {
+ *      return (ssize_t)mock();
+ * }
+ *
+ * static void test_read_stream(void **state)
+ * {
+ *      LargestIntegralType sizes[] = { 512, 512, 17, 0 };
+ *
+ *      will_return_array(__wrap_read, sizes, 4);
+ *
+ *      assert_int_equal(read_all(fd), 1041);
+ * }
+ * @endcode
+ *
+ * @see mock()
+ * @see will_return()
+ */
+void will_return_array(#function, const LargestIntegralType values[], size_t count);
+#else
+#define will_return_array(function, values, count) \
+    _will_return_array(#function, __FILE__, __LINE__, values, count)
+#endif
 /** @} */
 
 /**
@@ -755,6 +796,31 @@ void expect_not_value_count(#function, #parameter, LargestIntegralType value, si
                       cast_to_largest_integral_type(value), count)
 #endif
 
+#ifdef DOXYGEN
+/**
+ * @brief Add an event to check a parameter against an array of values.
+ *
+ * Each call to check_expected() checks the parameter against the next value
+ * of the array. This is equivalent to calling expect_value() for every
+ * element of the array, but the values are queued as a single block.
+ *
+ * @param[in]  #function  The function to add the check for.
+ *
+ * @param[in]  #parameter The name of the parameter passed to the function.
+ *
+ * @param[in]  values[]  The array of expected values. The values are copied.
+ *
+ * @param[in]  count  The number of values in the array.
+ *
+ * @see check_expected().
+ */
+void expect_value_array(#function, #parameter, const LargestIntegralType values[], size_t count);
+#else
+#define expect_value_array(function, parameter, values, count) \
+    _expect_value_array(#function, #parameter, __FILE__, __LINE__, \
+                        values, count)
+#endif
+
 #ifdef DOXYGEN
 /**
  * @brief Add an event to check if the parameter value is equal to the
@@ -1921,6 +1987,20 @@ int cmocka_run_group_tests_name(const char *group_name,
  * completes if any allocated blocks (memory leaks) remain they are reported
  * and a test failure is signalled.
  *
+ * Code which isn't compiled with the redefinitions of malloc() and friends,
+ * like prebuilt libraries linked statically, can be tracked by linking the
+ * test application with GNU ld's symbol wrapping:
+ *
+ * @code
+ * cc -o my_test my_test.c libfoo.a -lcmocka \
+ *     -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free,--wrap=strdup
+ * @endcode
+ *
+ * The blocks allocated while a test, setup or teardown function runs are then
+ * tracked like the ones of test_malloc(), everything else is passed on to the
+ * C library.  Only the calls of the objects linked into the test application
+ * are wrapped, not the ones of shared libraries.
+ *
  * For simplicity cmocka currently executes all tests in one process. Therefore
  * all test cases in a test application share a single address space which
  * means memory corruption from a single test case could potentially cause the
@@ -1976,11 +2056,82 @@ void *test_calloc(size_t nmemb, size_t size);
 #define test_calloc(num, size) _test_calloc(num, size, __FILE__, __LINE__)
 #endif
 
+#ifdef DOXYGEN
+/**
+ * @brief Test function overriding aligned_alloc.
+ *
+ * The block is checked for leaks and overruns like one allocated with
+ * test_malloc(), and is freed with test_free().
+ *
+ * @param[in]  alignment  The alignment of the block, a power of two.
+ *
+ * @param[in]  size       The bytes which should be allocated.
+ *
+ * @return A pointer to the allocated memory, NULL with errno set to EINVAL if
+ *         the alignment isn't a power of two.
+ *
+ * @see aligned_alloc(3)
+ */
+void *test_aligned_alloc(size_t alignment, size_t size);
+#else
+#define test_aligned_alloc(alignment, size) \
+    _test_aligned_alloc(alignment, size, __FILE__, __LINE__)
+#endif
+
+#ifdef DOXYGEN
+/**
+ * @brief Test function overriding posix_memalign.
+ *
+ * The block is checked for leaks and overruns like one allocated with
+ * test_malloc(), and is freed with test_free().
+ *
+ * @param[out] memptr     The pointer to set to the allocated memory.
+ *
+ * @param[in]  alignment  The alignment of the block, a power of two multiple
+ *                        of sizeof(void *).
+ *
+ * @param[in]  size       The bytes which should be allocated.
+ *
+ * @return 0 on success, EINVAL if the alignment is invalid.
+ *
+ * @see posix_memalign(3)
+ */
+int test_posix_memalign(void **memptr, size_t alignment, size_t size);
+#else
+#define test_posix_memalign(memptr, alignment, size) \
+    _test_posix_memalign(memptr, alignment, size, __FILE__, __LINE__)
+#endif
+
+#ifdef DOXYGEN
+/**
+ * @brief Test function overriding memalign.
+ *
+ * The block is checked for leaks and overruns like one allocated with
+ * test_malloc(), and is freed with test_free().
+ *
+ * @param[in]  alignment  The alignment of the block, a power of two.
+ *
+ * @param[in]  size       The bytes which should be allocated.
+ *
+ * @return A pointer to the allocated memory, NULL with errno set to EINVAL if
+ *         the alignment isn't a power of two.
+ *
+ * @see memalign(3)
+ */
+void *test_memalign(size_t alignment, size_t size);
+#else
+#define test_memalign(alignment, size) \
+    _test_memalign(alignment, size, __FILE__, __LINE__)
+#endif
+
 #ifdef DOXYGEN
 /**
  * @brief Test function overriding realloc which detects buffer overruns
  *        and memoery leaks.
  *
+ * The block is resized in place if it fits the memory allocated for it,
+ * unless cmocka_set_realloc_move() is enabled.
+ *
  * @param[in]  ptr   The memory block which should be changed.
  *
  * @param[in]  size  The bytes which should be allocated.
@@ -2005,11 +2156,87 @@ void test_free(void *ptr);
 #define test_free(ptr) _test_free(ptr, __FILE__, __LINE__)
 #endif
 
+/**
+ * @brief Start a region of the test whose allocations are checked by
+ *        assert_max_allocations() and assert_max_peak_bytes().
+ *
+ * Without a region, the asserts check the allocations since the test
+ * function started. Calling this again restarts the region.
+ *
+ * Only blocks allocated with test_malloc(), test_calloc() and test_realloc()
+ * on the thread running the test are counted.
+ *
+ * @code
+ * static void test_process_packet(void **state)
+ * {
+ *     struct ctx *ctx = *state;
+ *
+ *     cmocka_memory_budget_begin();
+ *     process_packet(ctx, packet, sizeof(packet));
+ *     cmocka_memory_budget_end();
+ *
+ *     assert_max_allocations(0);
+ * }
+ * @endcode
+ *
+ * @see cmocka_memory_budget_end()
+ */
+void cmocka_memory_budget_begin(void);
+
+/**
+ * @brief End the region started by cmocka_memory_budget_begin().
+ *
+ * Allocations after the end of the region are not counted by
+ * assert_max_allocations() and assert_max_peak_bytes().
+ */
+void cmocka_memory_budget_end(void);
+
+#ifdef DOXYGEN
+/**
+ * @brief Assert that the code under test made at most the given number of
+ *        allocations in the memory budget region.
+ *
+ * test_realloc() counts as an allocation. The function prints an error
+ * message to standard error and terminates the test by calling fail() if
+ * there were more.
+ *
+ * @param[in]  maximum  The maximum number of allocations allowed.
+ *
+ * @see cmocka_memory_budget_begin()
+ */
+void assert_max_allocations(size_t maximum);
+#else
+#define assert_max_allocations(maximum) \
+    _assert_max_allocations((size_t)(maximum), __FILE__, __LINE__)
+#endif
+
+#ifdef DOXYGEN
+/**
+ * @brief Assert that the bytes allocated by the code under test never grew
+ *        by more than the given number in the memory budget region.
+ *
+ * Blocks which were already allocated when the region started don't count.
+ * The function prints an error message to standard error and terminates the
+ * test by calling fail() if the peak was higher.
+ *
+ * @param[in]  maximum  The maximum number of bytes allowed.
+ *
+ * @see cmocka_memory_budget_begin()
+ */
+void assert_max_peak_bytes(size_t maximum);
+#else
+#define assert_max_peak_bytes(maximum) \
+    _assert_max_peak_bytes((size_t)(maximum), __FILE__, __LINE__)
+#endif
+
 /* Redirect malloc, calloc and free to the unit test allocators. */
 #ifdef UNIT_TESTING
 #define malloc test_malloc
 #define realloc test_realloc
 #define calloc test_calloc
+#define aligned_alloc test_aligned_alloc
+#define posix_memalign test_posix_memalign
+#define memalign test_memalign
 #define free test_free
 #endif /* UNIT_TESTING */
 
@@ -2228,6 +2455,10 @@ void _expect_not_value(
     const char* const function, const char* const parameter,
     const char* const file, const int line, const LargestIntegralType value,
     const int count);
+void _expect_value_array(
+    const char* const function, const char* const parameter,
+    const char* const file, const int line,
+    const LargestIntegralType values[], const size_t count);
 
 void _expect_string(
     const char* const function, const char* const parameter,
@@ -2258,6 +2489,10 @@ void _check_expected(
 void _will_return(const char * const function_name, const char * const file,
                   const int line, const LargestIntegralType value,
                   const int count);
+void _will_return_array(const char * const function_name,
+                        const char * const file, const int line,
+                        const LargestIntegralType values[],
+                        const size_t count);
 void _assert_true(const LargestIntegralType result,
                   const char* const expression,
                   const char * const file, const int line);
@@ -2306,7 +2541,17 @@ void* _test_malloc(const size_t size, const char* file, const int line);
 void* _test_realloc(void *ptr, const size_t size, const char* file, const int line);
 void* _test_calloc(const size_t number_of_elements, const size_t size,
                    const char* file, const int line);
+void* _test_aligned_alloc(const size_t alignment, const size_t size,
+                          const char* file, const int line);
+int _test_posix_memalign(void** memptr, const size_t alignment,
+                         const size_t size, const char* file, const int line);
+void* _test_memalign(const size_t alignment, const size_t size,
+                     const char* file, const int line);
 void _test_free(void* const ptr, const char* file, const int line);
+void _assert_max_allocations(const size_t maximum,
+                             const char * const file, const int line);
+void _assert_max_peak_bytes(const size_t maximum,
+                            const char * const file, const int line);
 
 void _fail(const char * const file, const int line);
 
@@ -2379,6 +2624,345 @@ void cmocka_set_test_filter(const char *pattern);
  */
 void cmocka_set_skip_filter(const char *pattern);
 
+/**
+ * @brief Run the tests of a group in parallel worker processes.
+ *
+ * After the group setup function ran, the given number of worker processes
+ * are forked. Each of them takes the next test which wasn't run yet, runs it
+ * with its setup and teardown functions and sends the result back. The
+ * output of each test is captured and printed with its result in the order
+ * of the tests, so the output is the same as when the tests are run one after
+ * another, except that what a test printed to stdout and stderr is no longer
+ * interleaved.
+ *
+ * Tests run in separate processes, so they can't see what other tests changed
+ * in the group state or other global state. A test which crashes or exits
+ * fails, and the remaining tests are run by a new worker process. Only
+ * supported on platforms with fork().
+ *
+ * This can be overriden with the environment variable CMOCKA_JOBS set to the
+ * number of processes.
+ *
+ * @param[in]  jobs       The number of worker processes, 0 or 1 (the
+ *                        default) to run the tests in the test process.
+ */
+void cmocka_set_jobs(size_t jobs);
+
+/**
+ * @brief Share the mocks of a test between all threads.
+ *
+ * By default the values queued with will_return(), expect_*() and
+ * expect_function_call() are only visible to the thread running the test. If
+ * the code under test calls mock(), check_expected() or function_called()
+ * from threads it creates itself, enable shared mocks. The queues of the
+ * running test are then shared by all threads and protected by a lock. Only
+ * one test may run at a time while shared mocks are enabled, and all threads
+ * using the mocks of a test must be done before the test returns.
+ *
+ * A failure raised by another thread than the test thread can't stop the
+ * test. Instead the failed assertion, mock(), check_expected() or
+ * function_called() returns on that thread, mock() returning 0, and the test
+ * fails with the error messages of the thread once the test function
+ * returns. The thread keeps running past the failed check, cmocka doesn't end
+ * threads owned by the code under test.
+ *
+ * This can be overriden with the environment variable CMOCKA_SHARED_MOCKS
+ * set to 1 or 0. Shared mocks aren't supported on platforms without atomic
+ * operations.
+ *
+ * @param[in]  enabled    Whether tests use shared mocks.
+ */
+void cmocka_set_shared_mocks(int enabled);
+
+/**
+ * @brief Track the blocks allocated by all threads in one heap.
+ *
+ * By default the blocks allocated with test_malloc() are tracked by the
+ * thread which allocated them. A block can then only be freed on that thread,
+ * and the leaks of other threads aren't reported. With the shared heap,
+ * blocks may be freed on any thread, and a test fails if it leaks blocks
+ * allocated by any thread. The blocks are tracked in shards keyed on their
+ * address, each protected by its own lock, so threads allocating at the same
+ * time rarely wait for each other.
+ *
+ * The allocation counters and the memory budget count the allocations of all
+ * threads. The block pool of cmocka_set_malloc_pool() isn't used with the
+ * shared heap. All threads must be done with the blocks of a test before the
+ * test returns, and it must be set before any blocks are allocated.
+ *
+ * This can be overriden with the environment variable CMOCKA_SHARED_HEAP set
+ * to 1 or 0. The shared heap isn't supported on platforms without atomic
+ * operations.
+ *
+ * @param[in]  enabled    Whether tests use the shared heap.
+ */
+void cmocka_set_shared_heap(int enabled);
+
+/**
+ * @brief Allocate the small blocks of tests from a pool.
+ *
+ * By default every test_malloc() and test_free() goes through malloc() and
+ * free(). With the block pool enabled small blocks are carved from larger
+ * slabs instead, and a freed block is reused by the next allocation of a
+ * similar size, which speeds up tests allocating many small blocks. The
+ * guard blocks, fill patterns and leak checks are the same in both cases.
+ *
+ * This can be overriden with the environment variable CMOCKA_MALLOC_POOL set
+ * to 1 or 0.
+ *
+ * @param[in]  enabled    Whether tests use the block pool.
+ */
+void cmocka_set_malloc_pool(int enabled);
+
+/**
+ * @brief Set the size of the guard blocks around blocks allocated by tests.
+ *
+ * test_malloc() surrounds every block with guard blocks which are checked for
+ * buffer overruns and underruns when the block is freed. Larger guard blocks
+ * catch writes further past the ends of a block.
+ *
+ * This can be overriden with the environment variable
+ * CMOCKA_MALLOC_GUARD_SIZE set to the number of bytes.
+ *
+ * @param[in]  size       The size of each guard block in bytes, at least 16
+ *                        (the default) and at most 65536. It's rounded up to
+ *                        a multiple of the alignment of allocated blocks.
+ */
+void cmocka_set_malloc_guard_size(size_t size);
+
+enum cm_malloc_guard_pages {
+    CM_MALLOC_GUARD_PAGES_NONE,
+    CM_MALLOC_GUARD_PAGES_OVERFLOW,
+    CM_MALLOC_GUARD_PAGES_UNDERFLOW,
+};
+
+/**
+ * @brief Place blocks allocated by tests next to inaccessible pages.
+ *
+ * Guard blocks only reveal a buffer overrun when the block is freed. In
+ * guard page mode test_malloc() maps every block on its own pages, so it
+ * ends right before an inaccessible page (CM_MALLOC_GUARD_PAGES_OVERFLOW) or
+ * starts right after one (CM_MALLOC_GUARD_PAGES_UNDERFLOW). An access past
+ * that end of the block then crashes at the faulty instruction, and the test
+ * fails with the location where the block was allocated. The blocks are still
+ * aligned, so an overrun of less than the alignment is only caught by the
+ * guard block when the block is freed.
+ *
+ * Guard pages use a lot more memory than the normal blocks, so enable them
+ * for the tests which need them, e.g. in a test or in the setup function of a
+ * group. The setting applies to all blocks allocated after the call, until it
+ * is changed again. Freed mappings are reused by later blocks of the same
+ * size.
+ *
+ * This can be overriden with the environment variable
+ * CMOCKA_MALLOC_GUARD_PAGES set to OVERFLOW, UNDERFLOW or NONE. Guard pages
+ * aren't supported on platforms without mmap() and mprotect().
+ *
+ * @param[in]  mode       Where to place the inaccessible page of a block.
+ */
+void cmocka_set_malloc_guard_pages(enum cm_malloc_guard_pages mode);
+
+/**
+ * @brief Hold back blocks freed by tests to detect writes after free.
+ *
+ * test_free() fills a freed block with a pattern. With a quarantine the
+ * memory of freed blocks isn't reused until the blocks in the quarantine
+ * exceed the given number of bytes. The oldest blocks are then released and
+ * the test fails if one of them was written to after it was freed, with the
+ * location where the block was allocated and freed. The remaining blocks
+ * are checked when the test returns.
+ *
+ * This can be overriden with the environment variable
+ * CMOCKA_MALLOC_QUARANTINE_SIZE set to the number of bytes.
+ *
+ * @param[in]  size       The maximum number of bytes of quarantined blocks,
+ *                        0 (the default) to release blocks when they are
+ *                        freed.
+ */
+void cmocka_set_malloc_quarantine_size(size_t size);
+
+/**
+ * @brief Print the allocation counters of every test.
+ *
+ * cmocka counts the blocks allocated and freed by each test function. When
+ * enabled, the number of allocations and frees, the bytes allocated, the
+ * peak of the bytes and blocks in use and a histogram of the block sizes
+ * are printed after the result of each test which passed or failed. The
+ * counters are printed as "[  MALLOC  ]" lines by the standard output, as
+ * "malloc:" lines in subunit, as diagnostics in TAP, and as properties of the
+ * test case in JUnit XML, so allocation regressions can be tracked by CI.
+ *
+ * The histogram has a bucket for every power of two, e.g. "16-31:3" counts
+ * three blocks of 16 to 31 bytes. The peaks include blocks allocated by the
+ * setup function of the test.
+ *
+ * This can be overriden with the environment variable CMOCKA_MALLOC_STATS
+ * set to 1 or 0.
+ *
+ * @param[in]  enabled    Whether allocation counters are printed.
+ */
+void cmocka_set_malloc_stats(int enabled);
+
+/**
+ * @brief Record the backtrace of every block allocated by tests.
+ *
+ * A leaked block is reported with the file and line where test_malloc() was
+ * called, which is often the same allocation wrapper for every block. With
+ * backtraces enabled, the given number of callers of test_malloc(),
+ * test_calloc() and test_realloc() are recorded for each block, and leaked
+ * blocks are reported once per unique backtrace with the number of blocks
+ * and bytes they hold.
+ *
+ * Each unique backtrace is stored once, so the memory used doesn't grow with
+ * the number of allocations. Once 65536 unique backtraces have been recorded,
+ * blocks allocated from new call stacks are reported without a backtrace.
+ * Backtraces need backtrace() from execinfo.h; build with frame pointers or
+ * unwind tables and link with -rdynamic to get function names.
+ *
+ * This can be overriden with the environment variable
+ * CMOCKA_MALLOC_BACKTRACE set to the number of frames.
+ *
+ * @param[in]  depth      The number of frames to record, at most 64, or 0
+ *                        (the default) to record none.
+ */
+void cmocka_set_malloc_backtrace(size_t depth);
+
+/**
+ * @brief Fail every allocation of tests once to test the error paths.
+ *
+ * When enabled, each test function is first run once to count the calls to
+ * test_malloc(), test_calloc() and test_realloc() it makes. It is then rerun
+ * once per allocation, with that allocation returning NULL. A rerun which
+ * crashes, leaks blocks, frees invalid pointers or corrupts blocks makes the
+ * test fail, with the location of the allocation which returned NULL and the
+ * errors. Reruns in which the test fails an assertion are fine, as the test
+ * may well check the result of the code under test.
+ *
+ * Every rerun is a child process forked after the setup function of the
+ * test, so the setup runs only once. The test function is finally run as
+ * usual. Tests which allocate from other threads or depend on external state
+ * which doesn't survive a fork() can't be swept. Only supported on platforms
+ * with fork().
+ *
+ * This can be overriden with the environment variable
+ * CMOCKA_MALLOC_FAIL_SWEEP set to 1 or 0.
+ *
+ * @param[in]  enabled    Whether allocations are failed one by one.
+ */
+void cmocka_set_malloc_fail_sweep(int enabled);
+
+/**
+ * @brief Always move blocks resized by test_realloc().
+ *
+ * By default test_realloc() resizes a block in place if it fits the memory
+ * allocated for it, and leaves room to grow a block it moves, so growing a
+ * buffer one element at a time doesn't copy it on every call. Moving the
+ * block on every call instead catches code which keeps using the old
+ * pointer.
+ *
+ * This can be overriden with the environment variable CMOCKA_REALLOC_MOVE set
+ * to 1 or 0.
+ *
+ * @param[in]  enabled    Whether test_realloc() always moves blocks.
+ */
+void cmocka_set_realloc_move(int enabled);
+
+/**
+ * @brief Record a trace of the interactions with the mocks of a test.
+ *
+ * Every call to mock(), check_expected() and function_called() is recorded
+ * with a timestamp, the value returned or checked and the source location in
+ * a buffer preallocated when the test starts. Once the buffer is full the
+ * oldest records are overwritten. If a test fails, the trace is printed with
+ * the error message of the test.
+ *
+ * This can be overriden with the environment variable CMOCKA_MOCK_TRACE set
+ * to the number of records.
+ *
+ * @param[in]  number_of_records  The number of interactions to keep, rounded
+ *                                up to a power of two. 0 disables the trace.
+ *
+ * @see cmocka_print_mock_trace()
+ */
+void cmocka_set_mock_trace(size_t number_of_records);
+
+/**
+ * @brief Print the trace of the interactions with the mocks of the running
+ * test.
+ *
+ * Nothing is printed if the trace isn't enabled.
+ *
+ * @see cmocka_set_mock_trace()
+ */
+void cmocka_print_mock_trace(void);
+
+/* Expectations recorded once and queued by several tests. */
+struct CMExpectationPlan;
+
+/**
+ * @brief Start recording an expectation plan.
+ *
+ * Tests of a group often queue the same return values, parameter checks and
+ * function calls in their setup. An expectation plan records these once, for
+ * example in a group setup, and queues them for a test with a single call to
+ * cmocka_expectation_plan_apply(), without allocating any of the values and
+ * checks again.
+ *
+ * Until cmocka_expectation_plan_end() is called, will_return(), the expect_*()
+ * macros, expect_function_call() and ignore_function_calls() of this thread
+ * queue into the plan instead of the running test.
+ *
+ * @code
+ * static struct CMExpectationPlan *plan;
+ *
+ * static int group_setup(void **state)
+ * {
+ *     plan = cmocka_expectation_plan_begin();
+ *     will_return_always(__wrap_getpid, 42);
+ *     expect_string(__wrap_open, path, "/etc/config");
+ *     cmocka_expectation_plan_end(plan);
+ *     return 0;
+ * }
+ *
+ * static int setup(void **state)
+ * {
+ *     cmocka_expectation_plan_apply(plan);
+ *     return 0;
+ * }
+ * @endcode
+ *
+ * @return The plan being recorded, to be released with
+ *         cmocka_expectation_plan_free().
+ */
+struct CMExpectationPlan *cmocka_expectation_plan_begin(void);
+
+/**
+ * @brief Stop recording an expectation plan.
+ *
+ * @param[in]  plan       The plan returned by cmocka_expectation_plan_begin().
+ */
+void cmocka_expectation_plan_end(struct CMExpectationPlan *plan);
+
+/**
+ * @brief Queue the expectations of a plan for the running test.
+ *
+ * The expectations are queued after the ones the test already queued and
+ * keep the source location they were recorded at. A plan can be applied any
+ * number of times.
+ *
+ * @param[in]  plan       The plan to queue the expectations of.
+ */
+void cmocka_expectation_plan_apply(const struct CMExpectationPlan *plan);
+
+/**
+ * @brief Release an expectation plan.
+ *
+ * No test may reference the plan anymore, release it in a group teardown.
+ *
+ * @param[in]  plan       The plan to release, may be NULL.
+ */
+void cmocka_expectation_plan_free(struct CMExpectationPlan *plan);
+
 /** @} */
 
 #endif /* CMOCKA_H_ */
@@ -35,6 +35,36 @@
 #include <strings.h>
 #endif
 
+/* Allocation backtraces need backtrace() of glibc or libexecinfo. */
+#if defined(HAVE_EXECINFO_H) && defined(HAVE_BACKTRACE)
+#include <execinfo.h>
+#define CM_HAVE_BACKTRACE 1
+#endif
+
+/* The allocation failure sweep forks the test process. */
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H) && !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#define CM_HAVE_FORK 1
+#endif
+
+/* Guard pages need mmap() and mprotect(). */
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MPROTECT) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#define CM_HAVE_GUARD_PAGES 1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+/* Wrapping the allocation functions needs GNU ld and weak symbols. */
+#if defined(__GNUC__) && defined(__ELF__)
+#define CM_HAVE_MALLOC_WRAP 1
+#endif
+
 #include <stdint.h>
 #include <setjmp.h>
 #include <stdarg.h>
@@ -44,6 +74,7 @@
 #include <string.h>
 #include <time.h>
 #include <float.h>
+#include <limits.h>
 
 /*
  * This allows to add a platform specific header file. Some embedded platforms
@@ -62,8 +93,11 @@
 #include <cmocka.h>
 #include <cmocka_private.h>
 
-/* Size of guard bytes around dynamically allocated blocks. */
+/* Default size of guard bytes around dynamically allocated blocks, which is
+ * also the minimum size. */
 #define MALLOC_GUARD_SIZE 16
+/* Maximum size of guard bytes set by cmocka_set_malloc_guard_size(). */
+#define MALLOC_GUARD_MAX_SIZE (64 * 1024)
 /* Pattern used to initialize guard blocks. */
 #define MALLOC_GUARD_PATTERN 0xEF
 /* Pattern used to initialize memory allocated with test_malloc(). */
@@ -73,6 +107,32 @@
 #ifndef MALLOC_ALIGNMENT
 #define MALLOC_ALIGNMENT sizeof(size_t)
 #endif
+/* Initial number of entries of the registry of allocated blocks.  NOTE: This
+ * must be base2. */
+#define MALLOC_BLOCK_REGISTRY_INITIAL_SIZE 256
+/* Number of shards of the shared heap is 2^MALLOC_HEAP_SHARD_BITS. */
+#define MALLOC_HEAP_SHARD_BITS 6
+#define MALLOC_HEAP_SHARDS (1 << MALLOC_HEAP_SHARD_BITS)
+/* Granularity of the size classes of the block pool.  NOTE: This must be
+ * base2. */
+#define MALLOC_POOL_CLASS_SIZE 32
+/* Number of size classes of the block pool.  Larger blocks are allocated with
+ * malloc(). */
+#define MALLOC_POOL_CLASSES 32
+/* Size of the slabs the cells of the block pool are carved from. */
+#define MALLOC_POOL_SLAB_SIZE (64 * 1024)
+/* Number of freed guard page mappings kept for reuse. */
+#define MALLOC_GUARD_PAGE_CACHE_SIZE 64
+/* Maximum number of frames of the backtrace of an allocation. */
+#define MALLOC_BACKTRACE_MAX_DEPTH 64
+/* Maximum number of unique backtraces kept by the stack depot, later ones
+ * aren't recorded. */
+#define STACK_DEPOT_MAX_STACKS (64 * 1024)
+/* Initial number of buckets of the stack depot.  NOTE: This must be base2. */
+#define STACK_DEPOT_INITIAL_SIZE 1024
+/* Number of buckets of the histogram of allocation sizes, the last one also
+ * counts all larger sizes. */
+#define MALLOC_STATS_SIZE_BUCKETS 32
 
 /* Printf formatting for source code locations. */
 #define SOURCE_LOCATION_FORMAT "%s:%u"
@@ -95,6 +155,41 @@
 #define MAX(a,b) ((a) < (b) ? (b) : (a))
 #endif
 
+/* Keep a function in its own stack frame. */
+#if defined(__GNUC__)
+#define CM_NOINLINE __attribute__((noinline))
+#else
+#define CM_NOINLINE
+#endif
+
+/* Spin lock primitives used to share the mock state between threads. */
+#if defined(HAVE_GCC_SYNC_BUILTINS)
+#define CM_SPIN_LOCK_TRY(lock) (__sync_lock_test_and_set((lock), 1) == 0)
+#define CM_SPIN_LOCK_RELEASE(lock) __sync_lock_release(lock)
+#define CM_ATOMIC_INCREMENT(value) __sync_add_and_fetch((value), 1)
+#elif defined(_WIN32)
+#define CM_SPIN_LOCK_TRY(lock) (InterlockedExchange((lock), 1) == 0)
+#define CM_SPIN_LOCK_RELEASE(lock) InterlockedExchange((lock), 0)
+#define CM_ATOMIC_INCREMENT(value) InterlockedIncrementSizeT(value)
+#endif
+
+/* Initial number of slots of a symbol map hash table.  NOTE: This must be
+ * base2. */
+#define SYMBOL_MAP_INITIAL_SIZE 32
+/* Initial number of slots of the symbol name table.  NOTE: This must be
+ * base2. */
+#define SYMBOL_TABLE_INITIAL_SIZE 64
+/* Initial number of slots of a value queue.  NOTE: This must be base2. */
+#define VALUE_QUEUE_INITIAL_SIZE 8
+
+/* Size of the chunks the per-test arena hands out memory from. */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+/* Alignment of blocks allocated from the arena.  NOTE: This must be base2. */
+#define ARENA_ALIGNMENT sizeof(LargestIntegralType)
+
+/* Upper bound of the number of records of the mock trace of a test. */
+#define MOCK_TRACE_MAX_RECORDS (1024 * 1024)
+
 /**
  * POSIX has sigsetjmp/siglongjmp, while Windows only has setjmp/longjmp.
  */
@@ -150,13 +245,36 @@ typedef struct ListNode {
     struct ListNode *prev;
 } ListNode;
 
+/*
+ * Backtrace of an allocation, kept once in the stack depot however many
+ * blocks were allocated from the same call stack.
+ */
+typedef struct StackDepotEntry {
+    struct StackDepotEntry *next; /* Next entry of the same bucket. */
+    size_t hash;
+    size_t depth;             /* Number of frames. */
+    void **frames;            /* Return addresses, innermost first. */
+} StackDepotEntry;
+
 /* Debug information for malloc(). */
 struct MallocBlockInfoData {
     void* block;              /* Address of the block returned by malloc(). */
     size_t allocated_size;    /* Total size of the allocated block. */
     size_t size;              /* Request block size. */
+    size_t pool_class;        /* Size class of a block allocated from the */
+                              /* block pool plus one, 0 for malloc(). */
+    enum cm_malloc_guard_pages guard_pages; /* Guard page mode of a block */
+                                            /* mapped on its own pages. */
+    char *ptr;                /* Address returned by test_malloc(). */
+    size_t leading_guard_size;  /* Size of the guard block before ptr. */
+    size_t trailing_guard_size; /* Size of the guard block after the data. */
     SourceLocation location;  /* Where the block was allocated. */
-    ListNode node;            /* Node within list of all allocated blocks. */
+    const StackDepotEntry *stack; /* Backtrace of the allocation or NULL. */
+    SourceLocation free_location; /* Where a quarantined block was freed. */
+    size_t serial;            /* Allocation order, see */
+                              /* check_point_allocated_blocks(). */
+    ListNode node;            /* Node within list of all allocated blocks, */
+                              /* or of the quarantine once freed. */
 };
 
 typedef union {
@@ -164,38 +282,342 @@ typedef union {
     char *ptr;
 } MallocBlockInfo;
 
+/*
+ * Entry of the registry of blocks allocated by test_malloc().  When a block is
+ * freed its entry is left behind as a tombstone which remembers where the
+ * block was allocated and freed, until the address is allocated again or the
+ * registry is rehashed.
+ */
+typedef struct MallocBlockEntry {
+    const void *ptr;          /* Address returned by test_malloc(), NULL if */
+                              /* the entry is unused. */
+    struct MallocBlockInfoData *block; /* Header of the block, NULL once */
+                                       /* the block is freed. */
+    SourceLocation location;  /* Where a freed block was allocated. */
+    SourceLocation free_location; /* Where a freed block was freed. */
+} MallocBlockEntry;
+
+/* Slab of memory the cells of the block pool are carved from. */
+typedef struct MallocPoolSlab {
+    struct MallocPoolSlab *next;
+} MallocPoolSlab;
+
+/*
+ * Pool of memory for the small blocks allocated by test_malloc() on a thread.
+ * A freed block is kept on the free list of its size class until a block of
+ * the same class is allocated, so tests which allocate many small blocks
+ * don't go through malloc() and free() for each of them.  Each free cell
+ * starts with the address of the next one.
+ */
+typedef struct MallocPool {
+    void *free_cells[MALLOC_POOL_CLASSES];
+    MallocPoolSlab *slabs;
+    char *slab_next;          /* Unused memory of the current slab. */
+    size_t slab_remaining;
+} MallocPool;
+
+/*
+ * Allocation counters of a test.  Bucket i > 0 of the size histogram counts
+ * the blocks of 2^(i-1) to 2^i - 1 bytes, bucket 0 the empty ones.
+ */
+typedef struct MallocStats {
+    size_t allocations;
+    size_t frees;
+    size_t allocated_bytes;   /* Total size of all allocated blocks. */
+    size_t live_bytes;        /* Size of the blocks currently allocated. */
+    size_t live_blocks;
+    size_t peak_bytes;
+    size_t peak_blocks;
+    size_t size_histogram[MALLOC_STATS_SIZE_BUCKETS];
+} MallocStats;
+
+/*
+ * Region of a test whose allocations are checked against a budget, see
+ * cmocka_memory_budget_begin().  It covers the whole test function unless
+ * the test opens one itself.
+ */
+typedef struct MallocBudget {
+    int closed;
+    size_t allocations;       /* Allocations of the test before the region. */
+    size_t end_allocations;   /* Allocations of the test when it closed. */
+    size_t base_bytes;        /* Bytes allocated when the region opened. */
+    size_t peak_bytes;        /* Peak of the bytes allocated in the region. */
+} MallocBudget;
+
+/*
+ * Blocks freed on a thread which are held back before their memory is reused,
+ * oldest first, to detect writes through dangling pointers.
+ */
+typedef struct MallocQuarantine {
+    ListNode blocks;
+    size_t size;              /* Number of bytes of the blocks. */
+} MallocQuarantine;
+
+/*
+ * Mappings of freed guard page blocks on a thread, kept to be reused by the
+ * next guard page block of the same size instead of unmapping them.
+ */
+typedef struct MallocGuardPageCache {
+    char *mappings[MALLOC_GUARD_PAGE_CACHE_SIZE];
+    size_t sizes[MALLOC_GUARD_PAGE_CACHE_SIZE];
+    size_t count;
+} MallocGuardPageCache;
+
+/*
+ * Open addressing table of the blocks allocated on a thread, keyed on the
+ * address returned by test_malloc().
+ */
+typedef struct MallocBlockRegistry {
+    MallocBlockEntry *entries;
+    size_t size;              /* Number of entries, base2. */
+    size_t count;             /* Number of allocated blocks. */
+    size_t used;              /* Number of allocated blocks and tombstones. */
+} MallocBlockRegistry;
+
+/*
+ * Blocks allocated on a thread, or the blocks of the shared heap whose
+ * addresses fall into a shard.  The blocks are listed in allocation order.
+ */
+typedef struct MallocHeapShard {
+    volatile long lock;       /* Only taken while the heap is shared. */
+    size_t serial;            /* Serial of the last block of a thread. */
+    ListNode blocks;
+    MallocBlockRegistry registry;
+} MallocHeapShard;
+
+/* Chunk of memory the arena allocates from, followed by its data. */
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;              /* Number of usable bytes in the chunk. */
+} ArenaChunk;
+
+/*
+ * Bump pointer allocator for the bookkeeping objects of a test (queued
+ * values, parameter checks, call orderings and the nodes and tables which
+ * reference them).  Nothing is released individually, the whole arena is
+ * reset when the test is torn down and its chunks are reused by the next
+ * test.
+ */
+typedef struct Arena {
+    ArenaChunk *head;         /* First chunk of the arena. */
+    ArenaChunk *current;      /* Chunk memory is allocated from. */
+    size_t used;              /* Bytes used in the current chunk. */
+} Arena;
+
+/* Hash table of the unique backtraces of the allocations of a thread. */
+typedef struct StackDepot {
+    StackDepotEntry **buckets;
+    size_t size;              /* Number of buckets, base2. */
+    size_t count;             /* Number of unique backtraces. */
+    Arena arena;              /* Memory of the entries. */
+} StackDepot;
+
 /* State of each test. */
 typedef struct TestState {
-    const ListNode *check_point; /* Check point of the test if there's a */
+    size_t check_point;          /* Check point of the test if there's a */
                                  /* setup function. */
     void *state;                 /* State associated with the test. */
 } TestState;
 
-/* Determines whether two values are the same. */
-typedef int (*EqualityFunction)(const void *left, const void *right);
-
 /* Value of a symbol and the place it was declared. */
 typedef struct SymbolValue {
     SourceLocation location;
     LargestIntegralType value;
+    /* Block of values queued by will_return_array() or NULL.  The queued
+     * refcount is the number of values left, so the next one is at
+     * count - refcount and the SymbolValue itself is never modified. */
+    const LargestIntegralType *values;
+    size_t count;
 } SymbolValue;
 
 /*
- * Contains a list of values for a symbol.
- * NOTE: Each structure referenced by symbol_values_list_head must have a
- * SourceLocation as its' first member.
+ * A symbol name interned in the symbol table of the test.  Two names refer to
+ * the same symbol if and only if they're interned to the same SymbolName.
+ */
+typedef struct SymbolName {
+    const char *name;         /* Copy of the name in the arena of the test. */
+    unsigned int hash;        /* Hash of the characters of name. */
+    unsigned int id;          /* Order the name was interned in, from 1. */
+} SymbolName;
+
+/* Maps the address of a symbol name string to its interned symbol. */
+typedef struct SymbolNameAlias {
+    const char *name;
+    const SymbolName *symbol;
+} SymbolNameAlias;
+
+/*
+ * Table of the symbol names of a test.  Symbol names are mostly string
+ * literals passed by the mock and expect macros, so the table remembers
+ * every address a name was seen at.  Repeated lookups of the same literal
+ * only hash its address and compare its characters with the interned name,
+ * since a buffer may hold another name by now.  The characters are only
+ * hashed and looked up by name the first time an address is seen.
+ */
+typedef struct SymbolTable {
+    SymbolName **names;       /* Open addressing table keyed on the name. */
+    size_t names_size;
+    size_t names_count;
+    SymbolNameAlias *aliases; /* Open addressing table keyed on addresses. */
+    size_t aliases_size;
+    size_t aliases_count;
+} SymbolTable;
+
+/*
+ * How a parameter check event is evaluated.  The built-in checks are
+ * evaluated inline by _check_expected(), only checks added by _expect_check()
+ * call the check_value function of the event.
+ */
+typedef enum CheckKind {
+    CHECK_KIND_CALLBACK = 0,
+    CHECK_KIND_VALUE,
+    CHECK_KIND_NOT_VALUE,
+    CHECK_KIND_VALUE_ARRAY,
+    CHECK_KIND_IN_SET,
+    CHECK_KIND_NOT_IN_SET,
+    CHECK_KIND_IN_RANGE,
+    CHECK_KIND_NOT_IN_RANGE,
+    CHECK_KIND_STRING,
+    CHECK_KIND_NOT_STRING,
+    CHECK_KIND_MEMORY,
+    CHECK_KIND_NOT_MEMORY,
+    CHECK_KIND_ANY
+} CheckKind;
+
+/* A queued value, the number of times it's returned and for parameter checks
+ * the kind of check. */
+typedef struct ValueSlot {
+    const void *value;
+    int refcount;
+    CheckKind kind;
+} ValueSlot;
+
+/*
+ * First in first out queue of values stored in a ring buffer allocated from
+ * the arena of the test.  The ring buffer doubles in size when it's full.
+ */
+typedef struct ValueQueue {
+    ValueSlot *slots;
+    size_t size;              /* Number of slots, base2. */
+    size_t first;             /* Slot of the front of the queue. */
+    size_t count;             /* Number of queued values. */
+} ValueQueue;
+
+/*
+ * Contains a queue of values for a symbol.  Above the last level of a map the
+ * queue holds the entries of the next level instead, which are never popped
+ * so an entry stays in place when the values below it run out.
+ * NOTE: Each value queued at the last level must have a SourceLocation as
+ * its' first member.
  */
 typedef struct SymbolMapValue {
     const char *symbol_name;
-    ListNode symbol_values_list_head;
+    const SymbolName *symbol;
+    ValueQueue values;
 } SymbolMapValue;
 
+/*
+ * Top level of a map of symbols to values.  The entries are kept in
+ * declaration order in the entries queue, so leftover values are reported in
+ * a stable order, and are indexed by an open addressing hash table keyed on
+ * the interned symbol.  Entries are only removed when the whole map is freed.
+ */
+typedef struct SymbolMap {
+    ValueQueue entries;
+    SymbolMapValue **table;
+    size_t table_size;
+} SymbolMap;
+
 /* Where a particular ordering was located and its symbol name */
 typedef struct FuncOrderingValue {
     SourceLocation location;
     const char * function;
+    const SymbolName *symbol;
 } FuncOrderingValue;
 
+/*
+ * Function calls expected by a test in declaration order.  Every expected
+ * call before cursor is either ignored or already satisfied, which leaves
+ * ignored calls behind in the queue (the refcount of a satisfied
+ * expect_function_call_any() drops to WILL_RETURN_ONCE like an
+ * ignore_function_calls() one).  The symbols of the ignored calls before
+ * cursor are indexed in ignored_map, so a call to a function is in order if
+ * it's in ignored_map or is the expected call at cursor.
+ */
+typedef struct CallOrdering {
+    ValueQueue calls;
+    size_t cursor;
+    SymbolMap ignored_map;
+} CallOrdering;
+
+/* Kinds of mock interactions recorded by the mock trace. */
+typedef enum MockTraceType {
+    MOCK_TRACE_MOCK,
+    MOCK_TRACE_CHECK_EXPECTED,
+    MOCK_TRACE_FUNCTION_CALLED
+} MockTraceType;
+
+/* A mock interaction recorded by the mock trace. */
+typedef struct MockTraceRecord {
+    uint64_t time;                /* Nanoseconds since the test started. */
+    LargestIntegralType value;    /* Value returned or checked. */
+    const char *file;             /* Location of the interaction. */
+    unsigned int line;
+    unsigned int function_id;     /* Ids of the interned symbol names. */
+    unsigned int parameter_id;
+    MockTraceType type;
+} MockTraceRecord;
+
+/*
+ * Ring buffer of the latest mock interactions of a test.  The records are
+ * preallocated when the test starts so recording an interaction is cheap,
+ * they're only formatted when the trace is printed.
+ */
+typedef struct MockTrace {
+    MockTraceRecord *records;
+    size_t size;                  /* Number of records, base2, 0 if off. */
+    uint64_t count;               /* Number of interactions recorded. */
+#ifdef HAVE_STRUCT_TIMESPEC
+    struct timespec start;
+#endif
+} MockTrace;
+
+/* Values, checks and call orderings queued by the mocks of a test. */
+typedef struct MockState {
+    /* Symbol names used by the mocks of the test. */
+    SymbolTable symbol_table;
+    /* Keeps a map of the values that functions will have to return to
+     * provide mocked interfaces. */
+    SymbolMap function_result_map;
+    /* Location of the last mock value returned was declared. */
+    SourceLocation last_mock_value_location;
+    /* Keeps a map of the values that functions expect as parameters to their
+     * mocked interfaces. */
+    SymbolMap function_parameter_map;
+    /* Location of last parameter value checked was declared. */
+    SourceLocation last_parameter_location;
+    /* Expected order of function calls. */
+    CallOrdering call_ordering;
+    /* Location of last call ordering that was declared. */
+    SourceLocation last_call_ordering_location;
+    /* Events passed to _expect_check() by the caller which are released on
+     * teardown. */
+    ListNode check_event_heap_list;
+    /* Latest interactions with the mocks of the test. */
+    MockTrace trace;
+    /* Arena the mock bookkeeping objects of the test are allocated from. */
+    Arena arena;
+} MockState;
+
+/*
+ * Expectations recorded once and queued by any number of tests.  Tests only
+ * reference the values and checks of the plan, which are never modified
+ * while they're consumed, so applying a plan just queues its slots.
+ */
+struct CMExpectationPlan {
+    MockState state;
+};
+
 /* Used by list_free() to deallocate values referenced by list nodes. */
 typedef void (*CleanupListValue)(const void *value, void *cleanup_value_data);
 
@@ -213,6 +635,13 @@ typedef struct CheckIntegerSet {
     size_t size_of_set;
 } CheckIntegerSet;
 
+/* Structure used to check a parameter against a sequence of values. */
+typedef struct CheckIntegerArray {
+    CheckParameterEvent event;
+    const LargestIntegralType *values;
+    size_t count;             /* Number of values, see SymbolValue. */
+} CheckIntegerArray;
+
 /* Used to check whether a parameter matches the area of memory referenced by
  * this structure.  */
 typedef struct CheckMemoryData {
@@ -228,38 +657,87 @@ static ListNode* list_add_value(ListNode * const head, const void *value,
 static ListNode* list_remove(
     ListNode * const node, const CleanupListValue cleanup_value,
     void * const cleanup_value_data);
-static void list_remove_free(
-    ListNode * const node, const CleanupListValue cleanup_value,
-    void * const cleanup_value_data);
 static int list_empty(const ListNode * const head);
-static int list_find(
-    ListNode * const head, const void *value,
-    const EqualityFunction equal_func, ListNode **output);
-static int list_first(ListNode * const head, ListNode **output);
 static ListNode* list_free(
     ListNode * const head, const CleanupListValue cleanup_value,
     void * const cleanup_value_data);
 
-static void add_symbol_value(
-    ListNode * const symbol_map_head, const char * const symbol_names[],
+static void symbol_table_initialize(SymbolTable * const table);
+static const SymbolName* symbol_table_find(SymbolTable * const table,
+                                           const char * const name);
+static const SymbolName* symbol_table_add(SymbolTable * const table,
+                                          const char * const name);
+
+static void symbol_map_initialize(SymbolMap * const map);
+static SymbolMapValue* symbol_map_find(const SymbolMap * const map,
+                                       const SymbolName * const symbol);
+static SymbolMapValue* symbol_map_add(SymbolMap * const map,
+                                      const SymbolName * const symbol);
+
+static void call_ordering_initialize(CallOrdering * const ordering);
+static void call_ordering_check(CallOrdering * const ordering,
+                                const SymbolName * const symbol,
+                                const char *const function,
+                                const char *const file,
+                                const int line);
+
+static void mock_trace_initialize(MockState * const state);
+static void mock_trace_record(MockState * const state,
+                              const MockTraceType type,
+                              const char * const function,
+                              const char * const parameter,
+                              const LargestIntegralType value,
+                              const char * const file, const int line);
+static void mock_trace_print(MockState * const state,
+                             void (*print)(const char * const format, ...));
+
+static ValueSlot* add_symbol_value(
+    SymbolMap * const symbol_map, const char * const symbol_names[],
+    const size_t number_of_symbol_names, const void* value, const int count);
+static ValueSlot* add_symbol_map_value(
+    SymbolMapValue * const map_value, const char * const symbol_names[],
     const size_t number_of_symbol_names, const void* value, const int count);
 static int get_symbol_value(
-    ListNode * const symbol_map_head, const char * const symbol_names[],
-    const size_t number_of_symbol_names, void **output);
+    SymbolMap * const symbol_map, const char * const symbol_names[],
+    const size_t number_of_symbol_names, ValueSlot *output);
 static void free_value(const void *value, void *cleanup_value_data);
-static void free_symbol_map_value(
-    const void *value, void *cleanup_value_data);
-static void remove_always_return_values(ListNode * const map_head,
+static void remove_always_return_values(SymbolMap * const map,
                                         const size_t number_of_symbol_names);
 
-static size_t check_for_leftover_values_list(const ListNode * head,
-                                             const char * const error_message);
+static size_t check_for_leftover_calls(const CallOrdering * const ordering,
+                                       const char * const error_message);
 
 static size_t check_for_leftover_values(
-    const ListNode * const map_head, const char * const error_message,
+    const ValueQueue * const entries, const char * const error_message,
     const size_t number_of_symbol_names);
 
-static void remove_always_return_values_from_list(ListNode * const map_head);
+
+static void *libc_malloc(size_t size);
+static void libc_free(void *ptr);
+
+#ifdef CM_HAVE_MALLOC_WRAP
+/* The libc functions when linked with --wrap, NULL otherwise. */
+extern void *__real_malloc(size_t size) __attribute__((weak));
+extern void *__real_calloc(size_t nmemb, size_t size) __attribute__((weak));
+extern void *__real_realloc(void *ptr, size_t size) __attribute__((weak));
+extern void __real_free(void *ptr) __attribute__((weak));
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+void __wrap_free(void *ptr);
+char *__wrap_strdup(const char *s);
+#endif
+
+static void *arena_alloc(Arena * const arena, const size_t size);
+static void arena_reset(Arena * const arena);
+static void arena_release(Arena * const arena);
+static void release_mock_states(void);
+static void release_malloc_pool(void);
+static void release_guard_page_cache(void);
+static void release_stack_depot(StackDepot * const depot);
+static size_t drain_malloc_quarantine(void);
+static void block_registry_drop_tombstones(void);
 
 /*
  * This must be called at the beginning of a test to initialize some data
@@ -272,6 +750,16 @@ static void teardown_testing(const char *test_name);
 
 static enum cm_message_output cm_get_output(void);
 
+static MockState* mock_state(void);
+static void mock_state_lock(void);
+static void mock_state_unlock(void);
+static void mock_state_unlock_all(void);
+static void malloc_state_unlock_all(void);
+static void defer_failure(void);
+static void fail_if_deferred_failures(void);
+static void clear_deferred_failures(void);
+static void print_mock_trace_on_failure(void);
+
 static int cm_error_message_enabled = 1;
 static CMOCKA_THREAD char *cm_error_message;
 
@@ -291,25 +779,116 @@ int global_expecting_assert = 0;
 const char *global_last_failed_assert = NULL;
 static int global_skip_test;
 
-/* Keeps a map of the values that functions will have to return to provide */
-/* mocked interfaces. */
-static CMOCKA_THREAD ListNode global_function_result_map_head;
-/* Location of the last mock value returned was declared. */
-static CMOCKA_THREAD SourceLocation global_last_mock_value_location;
-
-/* Keeps a map of the values that functions expect as parameters to their
- * mocked interfaces. */
-static CMOCKA_THREAD ListNode global_function_parameter_map_head;
-/* Location of last parameter value checked was declared. */
-static CMOCKA_THREAD SourceLocation global_last_parameter_location;
-
-/* List (acting as FIFO) of call ordering. */
-static CMOCKA_THREAD ListNode global_call_ordering_head;
-/* Location of last call ordering that was declared. */
-static CMOCKA_THREAD SourceLocation global_last_call_ordering_location;
-
-/* List of all currently allocated blocks. */
-static CMOCKA_THREAD ListNode global_allocated_blocks;
+/* Mock state of the test running on this thread. */
+static CMOCKA_THREAD MockState global_thread_mock_state;
+
+/* Expectation plan being recorded on this thread or NULL. */
+static CMOCKA_THREAD struct CMExpectationPlan *global_recording_plan;
+
+/* Mock state shared by all threads while a test runs with shared mocks. */
+static MockState global_shared_mock_state;
+/* Set while the running test uses global_shared_mock_state. */
+static int global_shared_mocks_active = 0;
+/* Whether tests use shared mocks, see cmocka_set_shared_mocks(). */
+static int global_shared_mocks = 0;
+/* Number of records of the mock trace, see cmocka_set_mock_trace(). */
+static size_t global_mock_trace_records = 0;
+/* Spin lock protecting global_shared_mock_state. */
+static volatile long global_shared_mock_lock = 0;
+/* Number of times this thread acquired global_shared_mock_lock. */
+static CMOCKA_THREAD int global_shared_mock_lock_depth = 0;
+/* Failures raised by other threads than the test thread and their error
+ * messages, protected by global_shared_mock_lock. */
+static int global_deferred_failures = 0;
+static char *global_deferred_error_message;
+
+/* Blocks allocated by the thread, indexed with the recently freed ones. */
+static CMOCKA_THREAD MallocHeapShard global_thread_heap;
+/* Shards of the heap shared by all threads, keyed on the block address. */
+static MallocHeapShard global_heap_shards[MALLOC_HEAP_SHARDS];
+/* Serial of the last block allocated from the shared heap. */
+static volatile size_t global_shared_heap_serial = 0;
+/* Set while the running test uses the shared heap. */
+static int global_shared_heap_active = 0;
+/* Whether tests use the shared heap, see cmocka_set_shared_heap(). */
+static int global_shared_heap = 0;
+/* Shard of the shared heap locked by this thread or NULL. */
+static CMOCKA_THREAD MallocHeapShard *global_locked_heap_shard;
+/* Spin lock protecting the allocation counters, the quarantine and the stack
+ * depot while the heap is shared. */
+static volatile long global_shared_malloc_lock = 0;
+/* Whether this thread holds global_shared_malloc_lock. */
+static CMOCKA_THREAD int global_shared_malloc_locked = 0;
+/* Set while a wrapped allocation function of this thread tracks a block. */
+static CMOCKA_THREAD int global_malloc_wrapper_active = 0;
+/* Pool of small blocks, used while global_malloc_pool_active is set. */
+static CMOCKA_THREAD MallocPool global_malloc_pool;
+/* Set while the running test allocates small blocks from the pool. */
+static int global_malloc_pool_active = 0;
+/* Whether tests use the block pool, see cmocka_set_malloc_pool(). */
+static int global_malloc_pool_enabled = 0;
+/* Size of the guard blocks of blocks allocated by the running test. */
+static size_t global_malloc_guard_size = MALLOC_GUARD_SIZE;
+/* Size of the guard blocks, see cmocka_set_malloc_guard_size(). */
+static size_t global_requested_malloc_guard_size = MALLOC_GUARD_SIZE;
+/* Guard page mode of the blocks allocated by the running test. */
+static enum cm_malloc_guard_pages global_malloc_guard_pages_active =
+    CM_MALLOC_GUARD_PAGES_NONE;
+/* Guard page mode, see cmocka_set_malloc_guard_pages(). */
+static enum cm_malloc_guard_pages global_malloc_guard_pages =
+    CM_MALLOC_GUARD_PAGES_NONE;
+#ifdef CM_HAVE_GUARD_PAGES
+/* Freed guard page mappings. */
+static CMOCKA_THREAD MallocGuardPageCache global_guard_page_cache;
+/* Size of a memory page, 0 until it's queried. */
+static size_t global_page_size = 0;
+#endif
+/* Unique backtraces of the allocations of the thread. */
+static CMOCKA_THREAD StackDepot global_stack_depot;
+/* Unique backtraces of the allocations from the shared heap. */
+static StackDepot global_shared_stack_depot;
+/* Number of frames recorded for each allocation of the running test. */
+static size_t global_malloc_backtrace_depth = 0;
+/* Backtrace depth, see cmocka_set_malloc_backtrace(). */
+static size_t global_requested_malloc_backtrace_depth = 0;
+/* Number of memory errors of the running test: crashes, leaks, invalid
+ * frees and corrupt guard blocks or freed blocks. */
+static CMOCKA_THREAD int global_memory_errors = 0;
+/* Whether the allocations of tests are failed one by one, see
+ * cmocka_set_malloc_fail_sweep(). */
+static int global_malloc_fail_sweep = 0;
+/* Number of processes running the tests of a group, see cmocka_set_jobs(). */
+static size_t global_jobs = 0;
+/* Set while the allocations of the test function are counted. */
+static CMOCKA_THREAD int global_malloc_fail_counting = 0;
+/* Number of allocations of the test function so far. */
+static CMOCKA_THREAD size_t global_malloc_fail_count = 0;
+/* Allocation of the test function which returns NULL, 0 for none. */
+static CMOCKA_THREAD size_t global_malloc_fail_at = 0;
+/* Where the allocation which returned NULL was made. */
+static CMOCKA_THREAD SourceLocation global_malloc_fail_location;
+/* Allocation counters of the running test. */
+static CMOCKA_THREAD MallocStats global_malloc_stats;
+/* Memory budget region of the running test. */
+static CMOCKA_THREAD MallocBudget global_malloc_budget;
+/* Allocation counters and memory budget of all threads while the heap is
+ * shared. */
+static MallocStats global_shared_malloc_stats;
+static MallocBudget global_shared_malloc_budget;
+/* Whether allocation counters are printed, see cmocka_set_malloc_stats(). */
+static int global_malloc_stats_enabled = 0;
+/* Quarantine of freed blocks. */
+static CMOCKA_THREAD MallocQuarantine global_malloc_quarantine;
+/* Quarantine of the blocks freed while the heap is shared. */
+static MallocQuarantine global_shared_malloc_quarantine;
+/* Number of bytes of freed blocks quarantined by the running test. */
+static size_t global_malloc_quarantine_size = 0;
+/* Size of the quarantine, see cmocka_set_malloc_quarantine_size(). */
+static size_t global_requested_malloc_quarantine_size = 0;
+/* Set while test_realloc() of the running test always moves blocks. */
+static int global_realloc_move_active = 0;
+/* Whether test_realloc() always moves blocks, see cmocka_set_realloc_move(). */
+static int global_realloc_move = 0;
 
 static enum cm_message_output global_msg_output = CM_OUTPUT_STDOUT;
 
@@ -332,9 +911,14 @@ static const int exception_signals[] = {
 };
 
 /* Default signal functions that should be restored after a test is complete. */
+#ifdef HAVE_SIGACTION
+static struct sigaction default_signal_actions[
+    ARRAY_SIZE(exception_signals)];
+#else
 typedef void (*SignalFunction)(int signal);
 static SignalFunction default_signal_functions[
     ARRAY_SIZE(exception_signals)];
+#endif
 
 #else /* _WIN32 */
 
@@ -382,14 +966,62 @@ enum CMUnitTestStatus {
 };
 
 struct CMUnitTestState {
-    const ListNode *check_point; /* Check point of the test if there's a setup function. */
+    size_t check_point; /* Check point of the test if there's a setup function. */
     const struct CMUnitTest *test; /* Point to array element in the tests we get passed */
     void *state; /* State associated with the test */
     const char *error_message; /* The error messages by the test */
     enum CMUnitTestStatus status; /* PASSED, FAILED, ABORT ... */
     double runtime; /* Time calculations */
+    MallocStats malloc_stats; /* Allocations of the test function */
 };
 
+#ifdef CM_HAVE_FORK
+/* Result of a test of a group run by a worker process. */
+typedef struct CMTestJob {
+    int done;            /* Whether the result was received. */
+    int rc;              /* What cmocka_run_one_tests() returned. */
+    char *stdout_output; /* What the test printed, freed with libc_free(). */
+    char *stderr_output;
+} CMTestJob;
+
+/* Worker process running the tests of a group. */
+typedef struct CMTestWorker {
+    pid_t pid;           /* 0 once the worker exited. */
+    int task_fd;         /* Indices of the tests to run are written here. */
+    int result_fd;       /* Results of the tests are read from here. */
+    size_t test;         /* Index of the running test, SIZE_MAX if idle. */
+} CMTestWorker;
+
+/*
+ * Result of a test sent by a worker, followed by the error message and the
+ * output of the test, each of the given size.
+ */
+typedef struct CMTestResult {
+    size_t test;
+    int rc;
+    enum CMUnitTestStatus status;
+    double runtime;
+    MallocStats malloc_stats;
+    size_t error_message_size;
+    size_t stdout_size;
+    size_t stderr_size;
+} CMTestResult;
+
+/* Pool of worker processes running the tests of a group, see cm_get_jobs(). */
+typedef struct CMTestPool {
+    struct CMUnitTestState *tests;
+    size_t number_of_tests;
+    CMTestJob *jobs;
+    CMTestWorker *workers;
+    size_t number_of_workers;
+    struct pollfd *poll_fds;
+    size_t next_test;    /* Index of the next test handed to a worker. */
+#ifdef SIGPIPE
+    void (*sigpipe_handler)(int);
+#endif
+} CMTestPool;
+#endif /* CM_HAVE_FORK */
+
 /* Exit the currently executing test. */
 static void exit_test(const int quit_application)
 {
@@ -405,7 +1037,15 @@ static void exit_test(const int quit_application)
         print_error("%s", cm_error_message);
         abort();
     } else if (global_running_test) {
+        mock_state_unlock_all();
+        malloc_state_unlock_all();
         cm_longjmp(global_run_test_env, 1);
+    } else if (global_shared_mocks_active || global_shared_heap_active) {
+        malloc_state_unlock_all();
+        /* A thread spawned by the code under test can't jump out of the
+         * test, the test thread reports the failure instead.  The thread
+         * belongs to the code under test, so it keeps running. */
+        defer_failure();
     } else if (quit_application) {
         exit(-1);
     }
@@ -540,1538 +1180,3873 @@ static int c_strmatch(const char *str, const char *pattern)
     return 0;
 }
 
-/* Create function results and expected parameter lists. */
-void initialize_testing(const char *test_name) {
-    (void)test_name;
-    list_initialize(&global_function_result_map_head);
-    initialize_source_location(&global_last_mock_value_location);
-    list_initialize(&global_function_parameter_map_head);
-    initialize_source_location(&global_last_parameter_location);
-    list_initialize(&global_call_ordering_head);
-    initialize_source_location(&global_last_parameter_location);
+/* Determine whether the mocks of a test are shared between threads. */
+static int cm_get_shared_mocks(void)
+{
+#ifdef CM_SPIN_LOCK_TRY
+    const char *env = getenv("CMOCKA_SHARED_MOCKS");
+
+    if (env != NULL && strlen(env) == 1) {
+        return env[0] == '1';
+    }
+    return global_shared_mocks;
+#else
+    return 0;
+#endif
 }
 
+/* Determine whether blocks are tracked by a heap shared between threads. */
+static int cm_get_shared_heap(void)
+{
+#if defined(CM_SPIN_LOCK_TRY) && defined(CM_ATOMIC_INCREMENT)
+    const char *env = getenv("CMOCKA_SHARED_HEAP");
 
-static void fail_if_leftover_values(const char *test_name) {
-    int error_occurred = 0;
-    (void)test_name;
-    remove_always_return_values(&global_function_result_map_head, 1);
-    if (check_for_leftover_values(
-            &global_function_result_map_head,
-            "%s() has remaining non-returned values.\n", 1)) {
-        error_occurred = 1;
+    if (env != NULL && strlen(env) == 1) {
+        return env[0] == '1';
     }
+    return global_shared_heap;
+#else
+    return 0;
+#endif
+}
 
-    remove_always_return_values(&global_function_parameter_map_head, 2);
-    if (check_for_leftover_values(
-            &global_function_parameter_map_head,
-            "'%s' parameter still has values that haven't been checked.\n",
-            2)) {
-        error_occurred = 1;
-    }
 
-    remove_always_return_values_from_list(&global_call_ordering_head);
-    if (check_for_leftover_values_list(&global_call_ordering_head,
-        "%s function was expected to be called but was not.\n")) {
-        error_occurred = 1;
+/* Determine the number of records of the mock trace of a test, 0 if off. */
+static size_t cm_get_mock_trace_records(void)
+{
+    const char *env = getenv("CMOCKA_MOCK_TRACE");
+    size_t records = global_mock_trace_records;
+    size_t size;
+
+    if (env != NULL) {
+        records = (size_t)strtoul(env, NULL, 10);
     }
-    if (error_occurred) {
-        exit_test(1);
+    if (records == 0) {
+        return 0;
+    }
+    if (records > MOCK_TRACE_MAX_RECORDS) {
+        records = MOCK_TRACE_MAX_RECORDS;
     }
+    for (size = 1; size < records; size *= 2) {
+    }
+    return size;
 }
 
 
-static void teardown_testing(const char *test_name) {
-    (void)test_name;
-    list_free(&global_function_result_map_head, free_symbol_map_value,
-              (void*)0);
-    initialize_source_location(&global_last_mock_value_location);
-    list_free(&global_function_parameter_map_head, free_symbol_map_value,
-              (void*)1);
-    initialize_source_location(&global_last_parameter_location);
-    list_free(&global_call_ordering_head, free_value,
-              (void*)0);
-    initialize_source_location(&global_last_call_ordering_location);
-}
+/* Determine whether small blocks are allocated from the block pool. */
+static int cm_get_malloc_pool(void)
+{
+    const char *env = getenv("CMOCKA_MALLOC_POOL");
 
-/* Initialize a list node. */
-static ListNode* list_initialize(ListNode * const node) {
-    node->value = NULL;
-    node->next = node;
-    node->prev = node;
-    node->refcount = 1;
-    return node;
+    if (env != NULL && strlen(env) == 1) {
+        return env[0] == '1';
+    }
+    return global_malloc_pool_enabled;
 }
 
 
 /*
- * Adds a value at the tail of a given list.
- * The node referencing the value is allocated from the heap.
+ * Determine the size of the guard blocks around allocated blocks, rounded up
+ * to MALLOC_ALIGNMENT so the block header in front of them stays aligned.
  */
-static ListNode* list_add_value(ListNode * const head, const void *value,
-                                     const int refcount) {
-    ListNode * const new_node = (ListNode*)malloc(sizeof(ListNode));
-    assert_non_null(head);
-    assert_non_null(value);
-    new_node->value = value;
-    new_node->refcount = refcount;
-    return list_add(head, new_node);
-}
-
-
-/* Add new_node to the end of the list. */
-static ListNode* list_add(ListNode * const head, ListNode *new_node) {
-    assert_non_null(head);
-    assert_non_null(new_node);
-    new_node->next = head;
-    new_node->prev = head->prev;
-    head->prev->next = new_node;
-    head->prev = new_node;
-    return new_node;
-}
-
+static size_t cm_get_malloc_guard_size(void)
+{
+    const char *env = getenv("CMOCKA_MALLOC_GUARD_SIZE");
+    size_t guard_size = global_requested_malloc_guard_size;
 
-/* Remove a node from a list. */
-static ListNode* list_remove(
-        ListNode * const node, const CleanupListValue cleanup_value,
-        void * const cleanup_value_data) {
-    assert_non_null(node);
-    node->prev->next = node->next;
-    node->next->prev = node->prev;
-    if (cleanup_value) {
-        cleanup_value(node->value, cleanup_value_data);
+    if (env != NULL) {
+        guard_size = (size_t)strtoul(env, NULL, 10);
     }
-    return node;
+    if (guard_size < MALLOC_GUARD_SIZE) {
+        return MALLOC_GUARD_SIZE;
+    }
+    if (guard_size > MALLOC_GUARD_MAX_SIZE) {
+        return MALLOC_GUARD_MAX_SIZE;
+    }
+    return (guard_size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
 }
 
 
-/* Remove a list node from a list and free the node. */
-static void list_remove_free(
-        ListNode * const node, const CleanupListValue cleanup_value,
-        void * const cleanup_value_data) {
-    assert_non_null(node);
-    free(list_remove(node, cleanup_value, cleanup_value_data));
+/* Determine the number of frames recorded for each allocation. */
+static size_t cm_get_malloc_backtrace_depth(void)
+{
+    const char *env = getenv("CMOCKA_MALLOC_BACKTRACE");
+    size_t depth = global_requested_malloc_backtrace_depth;
+
+    if (env != NULL) {
+        depth = (size_t)strtoul(env, NULL, 10);
+    }
+#ifndef CM_HAVE_BACKTRACE
+    depth = 0;
+#endif
+    if (depth > MALLOC_BACKTRACE_MAX_DEPTH) {
+        return MALLOC_BACKTRACE_MAX_DEPTH;
+    }
+    return depth;
 }
 
 
 /*
- * Frees memory kept by a linked list The cleanup_value function is called for
- * every "value" field of nodes in the list, except for the head.  In addition
- * to each list value, cleanup_value_data is passed to each call to
- * cleanup_value.  The head of the list is not deallocated.
+ * Determine the number of worker processes running the tests of a group, 0
+ * or 1 to run them in this process.
  */
-static ListNode* list_free(
-        ListNode * const head, const CleanupListValue cleanup_value,
-        void * const cleanup_value_data) {
-    assert_non_null(head);
-    while (!list_empty(head)) {
-        list_remove_free(head->next, cleanup_value, cleanup_value_data);
+static size_t cm_get_jobs(void)
+{
+    const char *env = getenv("CMOCKA_JOBS");
+    size_t jobs = global_jobs;
+
+    if (env != NULL) {
+        jobs = (size_t)strtoul(env, NULL, 10);
     }
-    return head;
+#ifndef CM_HAVE_FORK
+    jobs = 0;
+#endif
+    return jobs;
 }
 
 
-/* Determine whether a list is empty. */
-static int list_empty(const ListNode * const head) {
-    assert_non_null(head);
-    return head->next == head;
+/* Determine whether the allocations of tests are failed one by one. */
+static int cm_get_malloc_fail_sweep(void)
+{
+    const char *env = getenv("CMOCKA_MALLOC_FAIL_SWEEP");
+    int enabled = global_malloc_fail_sweep;
+
+    if (env != NULL && strlen(env) == 1) {
+        enabled = env[0] == '1';
+    }
+#ifndef CM_HAVE_FORK
+    enabled = 0;
+#endif
+    return enabled;
 }
 
 
-/*
- * Find a value in the list using the equal_func to compare each node with the
- * value.
- */
-static int list_find(ListNode * const head, const void *value,
-                     const EqualityFunction equal_func, ListNode **output) {
-    ListNode *current;
-    assert_non_null(head);
-    for (current = head->next; current != head; current = current->next) {
-        if (equal_func(current->value, value)) {
-            *output = current;
-            return 1;
-        }
+/* Determine whether the allocation counters of tests are printed. */
+static int cm_get_malloc_stats(void)
+{
+    const char *env = getenv("CMOCKA_MALLOC_STATS");
+
+    if (env != NULL && strlen(env) == 1) {
+        return env[0] == '1';
     }
-    return 0;
+    return global_malloc_stats_enabled;
 }
 
-/* Returns the first node of a list */
-static int list_first(ListNode * const head, ListNode **output) {
-    ListNode *target_node = NULL;
-    assert_non_null(head);
-    if (list_empty(head)) {
-        return 0;
+
+/* Determine the number of bytes of freed blocks which are quarantined. */
+static size_t cm_get_malloc_quarantine_size(void)
+{
+    const char *env = getenv("CMOCKA_MALLOC_QUARANTINE_SIZE");
+
+    if (env != NULL) {
+        return (size_t)strtoul(env, NULL, 10);
     }
-    target_node = head->next;
-    *output = target_node;
-    return 1;
+    return global_requested_malloc_quarantine_size;
 }
 
 
-/* Deallocate a value referenced by a list. */
-static void free_value(const void *value, void *cleanup_value_data) {
-    (void)cleanup_value_data;
-    assert_non_null(value);
-    free((void*)value);
+/* Determine where blocks are placed next to an inaccessible page. */
+static enum cm_malloc_guard_pages cm_get_malloc_guard_pages(void)
+{
+    enum cm_malloc_guard_pages mode = global_malloc_guard_pages;
+    const char *env = getenv("CMOCKA_MALLOC_GUARD_PAGES");
+
+    if (env != NULL) {
+        if (strcasecmp(env, "NONE") == 0 || strcmp(env, "0") == 0) {
+            mode = CM_MALLOC_GUARD_PAGES_NONE;
+        } else if (strcasecmp(env, "OVERFLOW") == 0 || strcmp(env, "1") == 0) {
+            mode = CM_MALLOC_GUARD_PAGES_OVERFLOW;
+        } else if (strcasecmp(env, "UNDERFLOW") == 0) {
+            mode = CM_MALLOC_GUARD_PAGES_UNDERFLOW;
+        }
+    }
+#ifndef CM_HAVE_GUARD_PAGES
+    mode = CM_MALLOC_GUARD_PAGES_NONE;
+#endif
+    return mode;
 }
 
 
-/* Releases memory associated to a symbol_map_value. */
-static void free_symbol_map_value(const void *value,
-                                  void *cleanup_value_data) {
-    SymbolMapValue * const map_value = (SymbolMapValue*)value;
-    const LargestIntegralType children = cast_ptr_to_largest_integral_type(cleanup_value_data);
-    assert_non_null(value);
-    list_free(&map_value->symbol_values_list_head,
-              children ? free_symbol_map_value : free_value,
-              (void *) ((uintptr_t)children - 1));
-    free(map_value);
+/* Determine whether test_realloc() always moves blocks. */
+static int cm_get_realloc_move(void)
+{
+    const char *env = getenv("CMOCKA_REALLOC_MOVE");
+
+    if (env != NULL && strlen(env) == 1) {
+        return env[0] == '1';
+    }
+    return global_realloc_move;
 }
 
 
 /*
- * Determine whether a symbol name referenced by a symbol_map_value matches the
- * specified function name.
+ * Get the mock state of the running test, or of the expectation plan being
+ * recorded.
  */
-static int symbol_names_match(const void *map_value, const void *symbol) {
-    return !strcmp(((SymbolMapValue*)map_value)->symbol_name,
-                   (const char*)symbol);
+static MockState* mock_state(void) {
+    if (global_recording_plan != NULL) {
+        return &global_recording_plan->state;
+    }
+    return global_shared_mocks_active ? &global_shared_mock_state :
+                                        &global_thread_mock_state;
 }
 
+
 /*
- * Adds a value to the queue of values associated with the given hierarchy of
- * symbols.  It's assumed value is allocated from the heap.
+ * Lock the mock state of the running test if it's shared between threads,
+ * along with the failures deferred by other threads.  The lock is recursive,
+ * every call must be paired with mock_state_unlock().
  */
-static void add_symbol_value(ListNode * const symbol_map_head,
-                             const char * const symbol_names[],
-                             const size_t number_of_symbol_names,
-                             const void* value, const int refcount) {
-    const char* symbol_name;
-    ListNode *target_node;
-    SymbolMapValue *target_map_value;
-    assert_non_null(symbol_map_head);
-    assert_non_null(symbol_names);
-    assert_true(number_of_symbol_names);
-    symbol_name = symbol_names[0];
+static void mock_state_lock(void) {
+#ifdef CM_SPIN_LOCK_TRY
+    if ((global_shared_mocks_active || global_shared_heap_active) &&
+        global_shared_mock_lock_depth++ == 0) {
+        while (!CM_SPIN_LOCK_TRY(&global_shared_mock_lock)) {
+        }
+    }
+#endif
+}
+
 
-    if (!list_find(symbol_map_head, symbol_name, symbol_names_match,
-                   &target_node)) {
-        SymbolMapValue * const new_symbol_map_value =
-            (SymbolMapValue*)malloc(sizeof(*new_symbol_map_value));
-        new_symbol_map_value->symbol_name = symbol_name;
-        list_initialize(&new_symbol_map_value->symbol_values_list_head);
-        target_node = list_add_value(symbol_map_head, new_symbol_map_value,
-                                          1);
+/* Unlock the mock state of the running test. */
+static void mock_state_unlock(void) {
+#ifdef CM_SPIN_LOCK_TRY
+    if ((global_shared_mocks_active || global_shared_heap_active) &&
+        --global_shared_mock_lock_depth == 0) {
+        CM_SPIN_LOCK_RELEASE(&global_shared_mock_lock);
     }
+#endif
+}
 
-    target_map_value = (SymbolMapValue*)target_node->value;
-    if (number_of_symbol_names == 1) {
-            list_add_value(&target_map_value->symbol_values_list_head,
-                                value, refcount);
-    } else {
-        add_symbol_value(&target_map_value->symbol_values_list_head,
-                         &symbol_names[1], number_of_symbol_names - 1, value,
-                         refcount);
+
+/* Release the lock of the mock state before jumping out of a test. */
+static void mock_state_unlock_all(void) {
+    if (global_shared_mock_lock_depth > 0) {
+        global_shared_mock_lock_depth = 1;
+        mock_state_unlock();
     }
 }
 
 
-/*
- * Gets the next value associated with the given hierarchy of symbols.
- * The value is returned as an output parameter with the function returning the
- * node's old refcount value if a value is found, 0 otherwise.  This means that
- * a return value of 1 indicates the node was just removed from the list.
- */
-static int get_symbol_value(
-        ListNode * const head, const char * const symbol_names[],
-        const size_t number_of_symbol_names, void **output) {
-    const char* symbol_name = NULL;
-    ListNode *target_node = NULL;
-    assert_non_null(head);
-    assert_non_null(symbol_names);
-    assert_true(number_of_symbol_names);
-    assert_non_null(output);
-    symbol_name = symbol_names[0];
+/* Create function results and expected parameter lists. */
+void initialize_testing(const char *test_name) {
+    MockState *state;
+    (void)test_name;
+    global_shared_mocks_active = cm_get_shared_mocks();
+    global_shared_heap_active = cm_get_shared_heap();
+    /* Cells of the block pool can't be freed on other threads. */
+    global_malloc_pool_active = cm_get_malloc_pool() &&
+                                !global_shared_heap_active;
+    global_realloc_move_active = cm_get_realloc_move();
+    global_malloc_guard_size = cm_get_malloc_guard_size();
+    global_malloc_guard_pages_active = cm_get_malloc_guard_pages();
+    global_malloc_quarantine_size = cm_get_malloc_quarantine_size();
+    global_malloc_backtrace_depth = cm_get_malloc_backtrace_depth();
+    state = mock_state();
+    symbol_table_initialize(&state->symbol_table);
+    symbol_map_initialize(&state->function_result_map);
+    initialize_source_location(&state->last_mock_value_location);
+    symbol_map_initialize(&state->function_parameter_map);
+    initialize_source_location(&state->last_parameter_location);
+    call_ordering_initialize(&state->call_ordering);
+    initialize_source_location(&state->last_parameter_location);
+    list_initialize(&state->check_event_heap_list);
+    mock_trace_initialize(state);
+}
 
-    if (list_find(head, symbol_name, symbol_names_match, &target_node)) {
-        SymbolMapValue *map_value = NULL;
-        ListNode *child_list = NULL;
-        int return_value = 0;
-        assert_non_null(target_node);
-        assert_non_null(target_node->value);
 
-        map_value = (SymbolMapValue*)target_node->value;
-        child_list = &map_value->symbol_values_list_head;
+static void fail_if_leftover_values(const char *test_name) {
+    MockState * const state = mock_state();
+    int error_occurred = 0;
+    (void)test_name;
+    mock_state_lock();
+    remove_always_return_values(&state->function_result_map, 1);
+    if (check_for_leftover_values(
+            &state->function_result_map.entries,
+            "%s() has remaining non-returned values.\n", 1)) {
+        error_occurred = 1;
+    }
 
-        if (number_of_symbol_names == 1) {
-            ListNode *value_node = NULL;
-            return_value = list_first(child_list, &value_node);
-            assert_true(return_value);
-            /* Add a check to silence clang analyzer */
-            if (return_value == 0) {
-                goto out;
-            }
-            *output = (void*) value_node->value;
-            return_value = value_node->refcount;
-            if (value_node->refcount - 1 == 0) {
-                list_remove_free(value_node, NULL, NULL);
-            } else if (value_node->refcount > WILL_RETURN_ONCE) {
-                --value_node->refcount;
-            }
-        } else {
-            return_value = get_symbol_value(
-                child_list, &symbol_names[1], number_of_symbol_names - 1,
-                output);
-        }
-        if (list_empty(child_list)) {
-            list_remove_free(target_node, free_symbol_map_value, (void*)0);
-        }
-        return return_value;
+    remove_always_return_values(&state->function_parameter_map, 2);
+    if (check_for_leftover_values(
+            &state->function_parameter_map.entries,
+            "'%s' parameter still has values that haven't been checked.\n",
+            2)) {
+        error_occurred = 1;
     }
-out:
-    cm_print_error("No entries for symbol %s.\n", symbol_name);
-    return 0;
-}
 
-/**
- * Taverse a list of nodes and remove first symbol value in list that has a
- * refcount < -1 (i.e. should always be returned and has been returned at
- * least once).
- */
+    if (check_for_leftover_calls(&state->call_ordering,
+        "%s function was expected to be called but was not.\n")) {
+        error_occurred = 1;
+    }
+    mock_state_unlock();
+    if (error_occurred) {
+        exit_test(1);
+    }
+}
 
-static void remove_always_return_values_from_list(ListNode * const map_head)
-{
-    ListNode * current = NULL;
-    ListNode * next = NULL;
-    assert_non_null(map_head);
 
-    for (current = map_head->next, next = current->next;
-            current != map_head;
-            current = next, next = current->next) {
-        if (current->refcount < -1) {
-            list_remove_free(current, free_value, NULL);
-        }
-    }
+static void teardown_testing(const char *test_name) {
+    MockState *state;
+    (void)test_name;
+    /* Abandon a plan whose recording was interrupted by a failure. */
+    global_recording_plan = NULL;
+    drain_malloc_quarantine();
+    block_registry_drop_tombstones();
+    state = mock_state();
+    mock_state_lock();
+    list_free(&state->check_event_heap_list, free_value, NULL);
+    symbol_table_initialize(&state->symbol_table);
+    symbol_map_initialize(&state->function_result_map);
+    initialize_source_location(&state->last_mock_value_location);
+    symbol_map_initialize(&state->function_parameter_map);
+    initialize_source_location(&state->last_parameter_location);
+    call_ordering_initialize(&state->call_ordering);
+    initialize_source_location(&state->last_call_ordering_location);
+    state->trace.records = NULL;
+    state->trace.size = 0;
+    /* Everything above referenced memory of the arena. */
+    arena_reset(&state->arena);
+    mock_state_unlock();
+    clear_deferred_failures();
+}
+
+
+/* Allocate a chunk for the arena with at least size usable bytes. */
+static ArenaChunk* arena_chunk_new(const size_t size) {
+    const size_t header_size = (sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) &
+                               ~(ARENA_ALIGNMENT - 1);
+    const size_t chunk_size = MAX(size, ARENA_CHUNK_SIZE);
+    ArenaChunk * const chunk =
+        (ArenaChunk*)libc_malloc(header_size + chunk_size);
+    assert_non_null(chunk);
+    chunk->next = NULL;
+    chunk->size = chunk_size;
+    return chunk;
+}
+
+
+/* Return the first usable byte of an arena chunk. */
+static char* arena_chunk_data(ArenaChunk * const chunk) {
+    return (char *)chunk + ((sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) &
+                            ~(ARENA_ALIGNMENT - 1));
 }
 
+
 /*
- * Traverse down a tree of symbol values and remove the first symbol value
- * in each branch that has a refcount < -1 (i.e should always be returned
- * and has been returned at least once).
+ * Allocate a block of memory from the arena.  The block is valid until the
+ * arena is reset.
  */
-static void remove_always_return_values(ListNode * const map_head,
-                                        const size_t number_of_symbol_names) {
-    ListNode *current;
-    assert_non_null(map_head);
-    assert_true(number_of_symbol_names);
-    current = map_head->next;
-    while (current != map_head) {
-        SymbolMapValue * const value = (SymbolMapValue*)current->value;
-        ListNode * const next = current->next;
-        ListNode *child_list;
-        assert_non_null(value);
-        child_list = &value->symbol_values_list_head;
-
-        if (!list_empty(child_list)) {
-            if (number_of_symbol_names == 1) {
-                ListNode * const child_node = child_list->next;
-                /* If this item has been returned more than once, free it. */
-                if (child_node->refcount < -1) {
-                    list_remove_free(child_node, free_value, NULL);
-                }
-            } else {
-                remove_always_return_values(child_list,
-                                            number_of_symbol_names - 1);
-            }
+static void *arena_alloc(Arena * const arena, const size_t size) {
+    const size_t aligned_size =
+        (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    void *block;
+    assert_true(aligned_size >= size);
+
+    if (arena->current == NULL ||
+        arena->current->size - arena->used < aligned_size) {
+        ArenaChunk *chunk;
+
+        if (arena->current == NULL) {
+            chunk = arena->head;
+        } else {
+            chunk = arena->current->next;
         }
 
-        if (list_empty(child_list)) {
-            list_remove_free(current, free_value, NULL);
+        /* Chunks kept from previous tests are reused if they're big enough,
+         * otherwise a new chunk is linked in front of them. */
+        if (chunk == NULL || chunk->size < aligned_size) {
+            ArenaChunk * const new_chunk = arena_chunk_new(aligned_size);
+            new_chunk->next = chunk;
+            if (arena->current == NULL) {
+                arena->head = new_chunk;
+            } else {
+                arena->current->next = new_chunk;
+            }
+            chunk = new_chunk;
         }
-        current = next;
+        arena->current = chunk;
+        arena->used = 0;
     }
+
+    block = arena_chunk_data(arena->current) + arena->used;
+    arena->used += aligned_size;
+    return block;
 }
 
-static size_t check_for_leftover_values_list(const ListNode * head,
-                                             const char * const error_message)
-{
-    ListNode *child_node;
-    size_t leftover_count = 0;
-    if (!list_empty(head))
-    {
-        for (child_node = head->next; child_node != head;
-                 child_node = child_node->next, ++leftover_count) {
-            const FuncOrderingValue *const o =
-                    (const FuncOrderingValue*) child_node->value;
-            cm_print_error(error_message, "%s", o->function);
-            cm_print_error(SOURCE_LOCATION_FORMAT
-                    ": note: remaining item was declared here\n",
-                    o->location.file, o->location.line);
-        }
-    }
-    return leftover_count;
+
+/* Allocate a zero initialized array from the arena. */
+static void *arena_calloc(Arena * const arena, const size_t number_of_elements,
+                          const size_t size) {
+    void *block;
+    assert_true(size == 0 || number_of_elements <= (size_t)-1 / size);
+    block = arena_alloc(arena, number_of_elements * size);
+    memset(block, 0, number_of_elements * size);
+    return block;
 }
 
+
 /*
- * Checks if there are any leftover values set up by the test that were never
- * retrieved through execution, and fail the test if that is the case.
+ * Release all blocks allocated from the arena at once.  The chunks are kept
+ * for the next test.
  */
-static size_t check_for_leftover_values(
-        const ListNode * const map_head, const char * const error_message,
-        const size_t number_of_symbol_names) {
-    const ListNode *current;
-    size_t symbols_with_leftover_values = 0;
-    assert_non_null(map_head);
-    assert_true(number_of_symbol_names);
-
-    for (current = map_head->next; current != map_head;
-         current = current->next) {
-        const SymbolMapValue * const value =
-            (SymbolMapValue*)current->value;
-        const ListNode *child_list;
-        assert_non_null(value);
-        child_list = &value->symbol_values_list_head;
-
-        if (!list_empty(child_list)) {
-            if (number_of_symbol_names == 1) {
-                const ListNode *child_node;
-                cm_print_error(error_message, "%s", value->symbol_name);
-
-                for (child_node = child_list->next; child_node != child_list;
-                     child_node = child_node->next) {
-                    const SourceLocation * const location =
-                        (const SourceLocation*)child_node->value;
-                    cm_print_error(SOURCE_LOCATION_FORMAT
-                                   ": note: remaining item was declared here\n",
-                                   location->file, location->line);
-                }
-            } else {
-                cm_print_error("%s: ", value->symbol_name);
-                check_for_leftover_values(child_list, error_message,
-                                          number_of_symbol_names - 1);
-            }
-            symbols_with_leftover_values ++;
-        }
-    }
-    return symbols_with_leftover_values;
+static void arena_reset(Arena * const arena) {
+    arena->current = NULL;
+    arena->used = 0;
 }
 
 
-/* Get the next return value for the specified mock function. */
-LargestIntegralType _mock(const char * const function, const char* const file,
-                          const int line) {
-    void *result;
-    const int rc = get_symbol_value(&global_function_result_map_head,
-                                    &function, 1, &result);
-    if (rc) {
-        SymbolValue * const symbol = (SymbolValue*)result;
-        const LargestIntegralType value = symbol->value;
-        global_last_mock_value_location = symbol->location;
-        if (rc == 1) {
-            free(symbol);
-        }
-        return value;
-    } else {
-        cm_print_error(SOURCE_LOCATION_FORMAT ": error: Could not get value "
-                       "to mock function %s\n", file, line, function);
-        if (source_location_is_set(&global_last_mock_value_location)) {
-            cm_print_error(SOURCE_LOCATION_FORMAT
-                           ": note: Previously returned mock value was declared here\n",
-                           global_last_mock_value_location.file,
-                           global_last_mock_value_location.line);
-        } else {
-            cm_print_error("There were no previously returned mock values for "
-                           "this test.\n");
-        }
-        exit_test(1);
+/* Return the chunks of the arena to the system. */
+static void arena_release(Arena * const arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL) {
+        ArenaChunk * const next = chunk->next;
+        libc_free(chunk);
+        chunk = next;
     }
-    return 0;
+    arena->head = NULL;
+    arena_reset(arena);
 }
 
-/* Ensure that function is being called in proper order */
-void _function_called(const char *const function,
-                      const char *const file,
-                      const int line)
-{
-    ListNode *first_value_node = NULL;
-    ListNode *value_node = NULL;
-    int rc;
 
-    rc = list_first(&global_call_ordering_head, &value_node);
-    first_value_node = value_node;
-    if (rc) {
-        FuncOrderingValue *expected_call;
-        int cmp;
+/* Free the arenas of the mock states once all tests have been run. */
+static void release_mock_states(void) {
+    arena_release(&global_thread_mock_state.arena);
+    arena_release(&global_shared_mock_state.arena);
+}
 
-        expected_call = (FuncOrderingValue *)value_node->value;
+/* Initialize a list node. */
+static ListNode* list_initialize(ListNode * const node) {
+    node->value = NULL;
+    node->next = node;
+    node->prev = node;
+    node->refcount = 1;
+    return node;
+}
 
-        cmp = strcmp(expected_call->function, function);
-        if (value_node->refcount < -1) {
-            /*
-             * Search through value nodes until either function is found or
-             * encounter a non-zero refcount greater than -2
-             */
-            if (cmp != 0) {
-                value_node = value_node->next;
-                expected_call = (FuncOrderingValue *)value_node->value;
-
-                cmp = strcmp(expected_call->function, function);
-                while (value_node->refcount < -1 &&
-                       cmp != 0 &&
-                       value_node != first_value_node->prev) {
-                    value_node = value_node->next;
-                    if (value_node == NULL) {
-                        break;
-                    }
-                    expected_call = (FuncOrderingValue *)value_node->value;
-                    if (expected_call == NULL) {
-                        continue;
-                    }
-                    cmp = strcmp(expected_call->function, function);
-                }
 
-                if (expected_call == NULL || value_node == first_value_node->prev) {
-                    cm_print_error(SOURCE_LOCATION_FORMAT
-                                   ": error: No expected mock calls matching "
-                                   "called() invocation in %s",
-                                   file, line,
-                                   function);
-                    exit_test(1);
-                }
-            }
-        }
+/*
+ * Adds a value at the tail of a given list.
+ * The node referencing the value is allocated from the arena of the test.
+ */
+static ListNode* list_add_value(ListNode * const head, const void *value,
+                                     const int refcount) {
+    ListNode * const new_node =
+        (ListNode*)arena_alloc(&mock_state()->arena, sizeof(ListNode));
+    assert_non_null(head);
+    assert_non_null(value);
+    new_node->value = value;
+    new_node->refcount = refcount;
+    return list_add(head, new_node);
+}
 
-        if (cmp == 0) {
-            if (value_node->refcount > -2 && --value_node->refcount == 0) {
-                list_remove_free(value_node, free_value, NULL);
-            }
-        } else {
-            cm_print_error(SOURCE_LOCATION_FORMAT
-                           ": error: Expected call to %s but received called() "
-                           "in %s\n",
-                           file, line,
-                           expected_call->function,
-                           function);
-            exit_test(1);
-        }
-    } else {
-        cm_print_error(SOURCE_LOCATION_FORMAT
-                       ": error: No mock calls expected but called() was "
-                       "invoked in %s\n",
-                       file, line,
-                       function);
-        exit_test(1);
-    }
+
+/* Add new_node to the end of the list. */
+static ListNode* list_add(ListNode * const head, ListNode *new_node) {
+    assert_non_null(head);
+    assert_non_null(new_node);
+    new_node->next = head;
+    new_node->prev = head->prev;
+    head->prev->next = new_node;
+    head->prev = new_node;
+    return new_node;
 }
 
-/* Add a return value for the specified mock function name. */
-void _will_return(const char * const function_name, const char * const file,
-                  const int line, const LargestIntegralType value,
-                  const int count) {
-    SymbolValue * const return_value =
-        (SymbolValue*)malloc(sizeof(*return_value));
-    assert_true(count != 0);
-    return_value->value = value;
-    set_source_location(&return_value->location, file, line);
-    add_symbol_value(&global_function_result_map_head, &function_name, 1,
-                     return_value, count);
+
+/* Remove a node from a list. */
+static ListNode* list_remove(
+        ListNode * const node, const CleanupListValue cleanup_value,
+        void * const cleanup_value_data) {
+    assert_non_null(node);
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    if (cleanup_value) {
+        cleanup_value(node->value, cleanup_value_data);
+    }
+    return node;
 }
 
 
 /*
- * Add a custom parameter checking function.  If the event parameter is NULL
- * the event structure is allocated internally by this function.  If event
- * parameter is provided it must be allocated on the heap and doesn't need to
- * be deallocated by the caller.
+ * Empties a linked list.  The cleanup_value function is called for every
+ * "value" field of nodes in the list, except for the head.  In addition to
+ * each list value, cleanup_value_data is passed to each call to
+ * cleanup_value.  The nodes themselves are owned by the arena of the test.
  */
-void _expect_check(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const CheckParameterValue check_function,
-        const LargestIntegralType check_data,
-        CheckParameterEvent * const event, const int count) {
-    CheckParameterEvent * const check =
-        event ? event : (CheckParameterEvent*)malloc(sizeof(*check));
-    const char* symbols[] = {function, parameter};
-    check->parameter_name = parameter;
-    check->check_value = check_function;
-    check->check_value_data = check_data;
-    set_source_location(&check->location, file, line);
-    add_symbol_value(&global_function_parameter_map_head, symbols, 2, check,
-                     count);
+static ListNode* list_free(
+        ListNode * const head, const CleanupListValue cleanup_value,
+        void * const cleanup_value_data) {
+    assert_non_null(head);
+    while (!list_empty(head)) {
+        list_remove(head->next, cleanup_value, cleanup_value_data);
+    }
+    return head;
 }
 
-/*
- * Add an call expectations that a particular function is called correctly.
- * This is used for code under test that makes calls to several functions
- * in depended upon components (mocks).
- */
 
-void _expect_function_call(
-    const char * const function_name,
-    const char * const file,
-    const int line,
-    const int count)
-{
-    FuncOrderingValue *ordering;
+/* Determine whether a list is empty. */
+static int list_empty(const ListNode * const head) {
+    assert_non_null(head);
+    return head->next == head;
+}
 
-    assert_non_null(function_name);
-    assert_non_null(file);
-    assert_true(count != 0);
 
-    ordering = (FuncOrderingValue *)malloc(sizeof(*ordering));
+/* Deallocate a value referenced by a list. */
+static void free_value(const void *value, void *cleanup_value_data) {
+    (void)cleanup_value_data;
+    assert_non_null(value);
+    free((void*)value);
+}
 
-    set_source_location(&ordering->location, file, line);
-    ordering->function = function_name;
 
-    list_add_value(&global_call_ordering_head, ordering, count);
+/* Calculate the FNV-1a hash of a symbol name. */
+static unsigned int symbol_name_hash(const char *symbol_name) {
+    uint32_t hash = 2166136261U;
+    assert_non_null(symbol_name);
+    for (; *symbol_name != '\0'; symbol_name++) {
+        hash ^= (uint8_t)*symbol_name;
+        hash *= 16777619U;
+    }
+    return hash;
 }
 
-/* Returns 1 if the specified float values are equal, else returns 0. */
-static int float_compare(const float left,
-                         const float right,
-                         const float epsilon) {
-    float absLeft;
-    float absRight;
-    float largest;
-    float relDiff;
 
-    float diff = left - right;
-    diff = (diff >= 0.f) ? diff : -diff;
+/* Calculate the hash of an address. */
+static unsigned int address_hash(const void * const pointer) {
+    const uint64_t address = (uint64_t)(uintptr_t)pointer;
+    return (unsigned int)((address * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+}
 
-    // Check if the numbers are really close -- needed
-        // when comparing numbers near zero.
-        if (diff <= epsilon) {
-            return 1;
-    }
 
-    absLeft = (left >= 0.f) ? left : -left;
-    absRight = (right >= 0.f) ? right : -right;
+/* Initialize an empty symbol table.  The hash tables are allocated on
+ * demand. */
+static void symbol_table_initialize(SymbolTable * const table) {
+    assert_non_null(table);
+    table->names = NULL;
+    table->names_size = 0;
+    table->names_count = 0;
+    table->aliases = NULL;
+    table->aliases_size = 0;
+    table->aliases_count = 0;
+}
 
-        largest = (absRight > absLeft) ? absRight : absLeft;
-    relDiff = largest * FLT_EPSILON;
 
-        if (diff > relDiff) {
-        return 0;
+/*
+ * Find the slot of the name table which either references the interned
+ * symbol for name or is the empty slot where it would be inserted.
+ */
+static SymbolName** symbol_table_name_slot(SymbolName ** const names,
+                                           const size_t names_size,
+                                           const char * const name,
+                                           const unsigned int hash) {
+    const size_t mask = names_size - 1;
+    size_t i;
+    for (i = hash & mask; names[i] != NULL; i = (i + 1) & mask) {
+        if (names[i]->hash == hash && strcmp(names[i]->name, name) == 0) {
+            break;
+        }
     }
-    return 1;
+    return &names[i];
 }
 
-/* Returns 1 if the specified float values are equal. If the values are not equal
- * an error is displayed and 0 is returned. */
-static int float_values_equal_display_error(const float left,
-                                            const float right,
-                                            const float epsilon) {
-    const int equal = float_compare(left, right, epsilon);
-    if (!equal) {
-        cm_print_error(FloatPrintfFormat " != "
-                   FloatPrintfFormat "\n", left, right);
-    }
-    return equal;
-}
 
-/* Returns 1 if the specified float values are different. If the values are equal
- * an error is displayed and 0 is returned. */
-static int float_values_not_equal_display_error(const float left,
-                                                const float right,
-                                                const float epsilon) {
-    const int not_equal = (float_compare(left, right, epsilon) == 0);
-    if (!not_equal) {
-        cm_print_error(FloatPrintfFormat " == "
-                   FloatPrintfFormat "\n", left, right);
+/*
+ * Find the slot of the alias table which either references the address name
+ * or is the empty slot where it would be inserted.
+ */
+static SymbolNameAlias* symbol_table_alias_slot(
+        SymbolNameAlias * const aliases, const size_t aliases_size,
+        const char * const name) {
+    const size_t mask = aliases_size - 1;
+    size_t i;
+    for (i = address_hash(name) & mask;
+         aliases[i].name != NULL && aliases[i].name != name;
+         i = (i + 1) & mask) {
     }
-    return not_equal;
+    return &aliases[i];
 }
 
-/* Returns 1 if the specified values are equal.  If the values are not equal
- * an error is displayed and 0 is returned. */
-static int values_equal_display_error(const LargestIntegralType left,
-                                      const LargestIntegralType right) {
-    const int equal = left == right;
-    if (!equal) {
-        cm_print_error(LargestIntegralTypePrintfFormat " != "
-                       LargestIntegralTypePrintfFormat "\n", left, right);
+
+/* Remember the address a symbol name was seen at. */
+static void symbol_table_add_alias(SymbolTable * const table,
+                                   const char * const name,
+                                   const SymbolName * const symbol) {
+    SymbolNameAlias *slot;
+
+    /* Keep the load factor of the table below 1/2. */
+    if ((table->aliases_count + 1) * 2 > table->aliases_size) {
+        const size_t aliases_size = table->aliases_size ?
+            table->aliases_size * 2 : SYMBOL_TABLE_INITIAL_SIZE;
+        SymbolNameAlias * const aliases = (SymbolNameAlias*)arena_calloc(
+            &mock_state()->arena, aliases_size, sizeof(*aliases));
+        size_t i;
+
+        for (i = 0; i < table->aliases_size; i++) {
+            if (table->aliases[i].name != NULL) {
+                *symbol_table_alias_slot(aliases, aliases_size,
+                                         table->aliases[i].name) =
+                    table->aliases[i];
+            }
+        }
+        table->aliases = aliases;
+        table->aliases_size = aliases_size;
     }
-    return equal;
-}
 
-/*
- * Returns 1 if the specified values are not equal.  If the values are equal
- * an error is displayed and 0 is returned. */
-static int values_not_equal_display_error(const LargestIntegralType left,
-                                          const LargestIntegralType right) {
-    const int not_equal = left != right;
-    if (!not_equal) {
-        cm_print_error(LargestIntegralTypePrintfFormat " == "
-                       LargestIntegralTypePrintfFormat "\n", left, right);
+    slot = symbol_table_alias_slot(table->aliases, table->aliases_size, name);
+    if (slot->name == NULL) {
+        slot->name = name;
+        table->aliases_count++;
     }
-    return not_equal;
+    slot->symbol = symbol;
 }
 
 
 /*
- * Determine whether value is contained within check_integer_set.
- * If invert is 0 and the value is in the set 1 is returned, otherwise 0 is
- * returned and an error is displayed.  If invert is 1 and the value is not
- * in the set 1 is returned, otherwise 0 is returned and an error is
- * displayed.
+ * Look up the interned symbol for a name.  If create is set the name is
+ * interned if it isn't in the table yet, otherwise NULL is returned.
  */
-static int value_in_set_display_error(
-        const LargestIntegralType value,
-        const CheckIntegerSet * const check_integer_set, const int invert) {
-    int succeeded = invert;
-    assert_non_null(check_integer_set);
-    {
-        const LargestIntegralType * const set = check_integer_set->set;
-        const size_t size_of_set = check_integer_set->size_of_set;
+static const SymbolName* symbol_table_lookup(SymbolTable * const table,
+                                             const char * const name,
+                                             const int create) {
+    const SymbolName *symbol = NULL;
+    SymbolName **slot;
+    unsigned int hash;
+    assert_non_null(table);
+    assert_non_null(name);
+
+    /* Fast path, the same string has been seen before. */
+    if (table->aliases_count > 0) {
+        const SymbolNameAlias * const alias = symbol_table_alias_slot(
+            table->aliases, table->aliases_size, name);
+        if (alias->name != NULL && strcmp(alias->symbol->name, name) == 0) {
+            return alias->symbol;
+        }
+    }
+
+    if (create && (table->names_count + 1) * 2 > table->names_size) {
+        const size_t names_size = table->names_size ?
+            table->names_size * 2 : SYMBOL_TABLE_INITIAL_SIZE;
+        SymbolName ** const names = (SymbolName**)arena_calloc(
+            &mock_state()->arena, names_size, sizeof(*names));
         size_t i;
-        for (i = 0; i < size_of_set; i++) {
-            if (set[i] == value) {
-                /* If invert = 0 and item is found, succeeded = 1. */
-                /* If invert = 1 and item is found, succeeded = 0. */
-                succeeded = !succeeded;
-                break;
+
+        for (i = 0; i < table->names_size; i++) {
+            if (table->names[i] != NULL) {
+                *symbol_table_name_slot(names, names_size,
+                                        table->names[i]->name,
+                                        table->names[i]->hash) =
+                    table->names[i];
             }
         }
-        if (succeeded) {
-            return 1;
-        }
-        cm_print_error(LargestIntegralTypePrintfFormatDecimal
-                       " is %sin the set (",
-                       value, invert ? "" : "not ");
-        for (i = 0; i < size_of_set; i++) {
-            cm_print_error(LargestIntegralTypePrintfFormat ", ", set[i]);
-        }
-        cm_print_error(")\n");
+        table->names = names;
+        table->names_size = names_size;
     }
-    return 0;
+    if (table->names_size == 0) {
+        return NULL;
+    }
+
+    hash = symbol_name_hash(name);
+    slot = symbol_table_name_slot(table->names, table->names_size, name, hash);
+    if (*slot != NULL) {
+        symbol = *slot;
+    } else if (create) {
+        const size_t name_size = strlen(name) + 1;
+        SymbolName * const new_symbol = (SymbolName*)arena_alloc(
+            &mock_state()->arena, sizeof(*new_symbol) + name_size);
+        char * const name_copy = (char*)(new_symbol + 1);
+
+        memcpy(name_copy, name, name_size);
+        new_symbol->name = name_copy;
+        new_symbol->hash = hash;
+        new_symbol->id = (unsigned int)++table->names_count;
+        *slot = new_symbol;
+        symbol = new_symbol;
+    } else {
+        return NULL;
+    }
+
+    symbol_table_add_alias(table, name, symbol);
+    return symbol;
+}
+
+
+/* Find the interned symbol of a name, NULL if the name isn't known. */
+static const SymbolName* symbol_table_find(SymbolTable * const table,
+                                           const char * const name) {
+    return symbol_table_lookup(table, name, 0);
+}
+
+
+/* Intern a symbol name. */
+static const SymbolName* symbol_table_add(SymbolTable * const table,
+                                          const char * const name) {
+    return symbol_table_lookup(table, name, 1);
+}
+
+
+/* Initialize an empty value queue.  The slots are allocated on demand. */
+static void value_queue_initialize(ValueQueue * const queue) {
+    assert_non_null(queue);
+    queue->slots = NULL;
+    queue->size = 0;
+    queue->first = 0;
+    queue->count = 0;
+}
+
+
+/* Get the slot at index from the front of a value queue. */
+static ValueSlot* value_queue_at(const ValueQueue * const queue,
+                                 const size_t index) {
+    return &queue->slots[(queue->first + index) & (queue->size - 1)];
 }
 
 
 /*
- * Determine whether a value is within the specified range.  If the value is
- * within the specified range 1 is returned.  If the value isn't within the
- * specified range an error is displayed and 0 is returned.
+ * Double the number of slots of a value queue.  The queued slots are moved to
+ * the front of the new ring buffer.
  */
-static int integer_in_range_display_error(
-        const LargestIntegralType value, const LargestIntegralType range_min,
-        const LargestIntegralType range_max) {
-    if (value >= range_min && value <= range_max) {
-        return 1;
+static void value_queue_grow(ValueQueue * const queue) {
+    const size_t size = queue->size ? queue->size * 2 :
+                                      VALUE_QUEUE_INITIAL_SIZE;
+    ValueSlot * const slots = (ValueSlot*)arena_alloc(
+        &mock_state()->arena, size * sizeof(*slots));
+    size_t i;
+
+    for (i = 0; i < queue->count; i++) {
+        slots[i] = *value_queue_at(queue, i);
     }
-    cm_print_error(LargestIntegralTypePrintfFormatDecimal
-                   " is not within the range "
-                   LargestIntegralTypePrintfFormatDecimal "-"
-                   LargestIntegralTypePrintfFormatDecimal "\n",
-                   value, range_min, range_max);
-    return 0;
+    /* The old slots stay in the arena until the test is torn down. */
+    queue->slots = slots;
+    queue->size = size;
+    queue->first = 0;
 }
 
 
-/*
- * Determine whether a value is within the specified range.  If the value
- * is not within the range 1 is returned.  If the value is within the
- * specified range an error is displayed and zero is returned.
- */
-static int integer_not_in_range_display_error(
-        const LargestIntegralType value, const LargestIntegralType range_min,
-        const LargestIntegralType range_max) {
-    if (value < range_min || value > range_max) {
-        return 1;
+/* Add a value to the back of a value queue. */
+static ValueSlot* value_queue_push(ValueQueue * const queue,
+                                   const void *value, const int refcount) {
+    ValueSlot *slot;
+    assert_non_null(queue);
+
+    if (queue->count == queue->size) {
+        value_queue_grow(queue);
     }
-    cm_print_error(LargestIntegralTypePrintfFormatDecimal
-                   " is within the range "
-                   LargestIntegralTypePrintfFormatDecimal "-"
-                   LargestIntegralTypePrintfFormatDecimal "\n",
-                   value, range_min, range_max);
-    return 0;
+    slot = value_queue_at(queue, queue->count);
+    slot->value = value;
+    slot->refcount = refcount;
+    slot->kind = CHECK_KIND_CALLBACK;
+    queue->count++;
+    return slot;
 }
 
 
-/*
- * Determine whether the specified strings are equal.  If the strings are equal
- * 1 is returned.  If they're not equal an error is displayed and 0 is
- * returned.
- */
-static int string_equal_display_error(
-        const char * const left, const char * const right) {
-    if (strcmp(left, right) == 0) {
-        return 1;
+/* Remove the value at the front of a value queue. */
+static void value_queue_pop(ValueQueue * const queue) {
+    assert_non_null(queue);
+    assert_true(queue->count);
+    queue->first = (queue->first + 1) & (queue->size - 1);
+    queue->count--;
+}
+
+
+/* Create an empty symbol map entry for an interned symbol. */
+static SymbolMapValue* symbol_map_value_new(const SymbolName * const symbol) {
+    SymbolMapValue * const map_value = (SymbolMapValue*)arena_alloc(
+        &mock_state()->arena, sizeof(*map_value));
+    map_value->symbol_name = symbol->name;
+    map_value->symbol = symbol;
+    value_queue_initialize(&map_value->values);
+    return map_value;
+}
+
+
+/* Find the entry of the next level below a symbol map entry. */
+static SymbolMapValue* symbol_map_value_child(
+        const SymbolMapValue * const map_value,
+        const SymbolName * const symbol) {
+    size_t i;
+    if (symbol == NULL) {
+        return NULL;
     }
-    cm_print_error("\"%s\" != \"%s\"\n", left, right);
-    return 0;
+    for (i = 0; i < map_value->values.count; i++) {
+        SymbolMapValue * const child =
+            (SymbolMapValue*)value_queue_at(&map_value->values, i)->value;
+        if (child->symbol == symbol) {
+            return child;
+        }
+    }
+    return NULL;
 }
 
 
 /*
- * Determine whether the specified strings are equal.  If the strings are not
- * equal 1 is returned.  If they're not equal an error is displayed and 0 is
- * returned
+ * Find the entry of the next level below a symbol map entry, adding an empty
+ * entry if the symbol isn't below it yet.
  */
-static int string_not_equal_display_error(
-        const char * const left, const char * const right) {
-    if (strcmp(left, right) != 0) {
-        return 1;
+static SymbolMapValue* symbol_map_value_add_child(
+        SymbolMapValue * const map_value, const SymbolName * const symbol) {
+    SymbolMapValue *child = symbol_map_value_child(map_value, symbol);
+    if (child == NULL) {
+        child = symbol_map_value_new(symbol);
+        value_queue_push(&map_value->values, child, 1);
     }
-    cm_print_error("\"%s\" == \"%s\"\n", left, right);
-    return 0;
+    return child;
 }
 
 
 /*
- * Determine whether the specified areas of memory are equal.  If they're equal
- * 1 is returned otherwise an error is displayed and 0 is returned.
+ * Determine whether any values are queued below a symbol map entry, where
+ * number_of_symbol_names is the number of levels including the entry.
  */
-static int memory_equal_display_error(const char* const a, const char* const b,
-                                      const size_t size) {
-    size_t differences = 0;
+static int symbol_map_value_has_values(
+        const SymbolMapValue * const map_value,
+        const size_t number_of_symbol_names) {
     size_t i;
-    for (i = 0; i < size; i++) {
-        const char l = a[i];
-        const char r = b[i];
-        if (l != r) {
-            if (differences < 16) {
-                cm_print_error("difference at offset %" PRIdS " 0x%02x 0x%02x\n",
-                               i, l, r);
-            }
-            differences ++;
-        }
+    if (number_of_symbol_names == 1) {
+        return map_value->values.count > 0;
     }
-    if (differences > 0) {
-        if (differences >= 16) {
-            cm_print_error("...\n");
+    for (i = 0; i < map_value->values.count; i++) {
+        const SymbolMapValue * const child = (const SymbolMapValue*)
+            value_queue_at(&map_value->values, i)->value;
+        if (symbol_map_value_has_values(child, number_of_symbol_names - 1)) {
+            return 1;
         }
-        cm_print_error("%"PRIdS " bytes of %p and %p differ\n",
-                       differences, (void *)a, (void *)b);
-        return 0;
     }
-    return 1;
+    return 0;
+}
+
+
+/* Initialize an empty symbol map.  The hash table is allocated on demand. */
+static void symbol_map_initialize(SymbolMap * const map) {
+    assert_non_null(map);
+    value_queue_initialize(&map->entries);
+    map->table = NULL;
+    map->table_size = 0;
 }
 
 
 /*
- * Determine whether the specified areas of memory are not equal.  If they're
- * not equal 1 is returned otherwise an error is displayed and 0 is
- * returned.
+ * Find the slot of the hash table which either references the entry for
+ * symbol or is the empty slot where it would be inserted.
  */
-static int memory_not_equal_display_error(
-        const char* const a, const char* const b, const size_t size) {
-    size_t same = 0;
+static SymbolMapValue** symbol_map_slot(SymbolMapValue ** const table,
+                                        const size_t table_size,
+                                        const SymbolName * const symbol) {
+    const size_t mask = table_size - 1;
     size_t i;
-    for (i = 0; i < size; i++) {
-        const char l = a[i];
-        const char r = b[i];
-        if (l == r) {
-            same ++;
-        }
+    for (i = symbol->hash & mask;
+         table[i] != NULL && table[i]->symbol != symbol;
+         i = (i + 1) & mask) {
     }
-    if (same == size) {
-        cm_print_error("%"PRIdS "bytes of %p and %p the same\n",
-                       same, (void *)a, (void *)b);
-        return 0;
+    return &table[i];
+}
+
+
+/* Double the size of the hash table of a symbol map. */
+static void symbol_map_grow(SymbolMap * const map) {
+    const size_t table_size = map->table_size ?
+        map->table_size * 2 : SYMBOL_MAP_INITIAL_SIZE;
+    SymbolMapValue ** const table = (SymbolMapValue**)arena_calloc(
+        &mock_state()->arena, table_size, sizeof(*table));
+    size_t i;
+
+    for (i = 0; i < map->table_size; i++) {
+        SymbolMapValue * const value = map->table[i];
+        if (value != NULL) {
+            *symbol_map_slot(table, table_size, value->symbol) = value;
+        }
     }
-    return 1;
+    /* The old table stays in the arena until the test is torn down. */
+    map->table = table;
+    map->table_size = table_size;
 }
 
 
-/* CheckParameterValue callback to check whether a value is within a set. */
-static int check_in_set(const LargestIntegralType value,
-                        const LargestIntegralType check_value_data) {
-    return value_in_set_display_error(value,
-        cast_largest_integral_type_to_pointer(CheckIntegerSet*,
-                                              check_value_data), 0);
+/* Find the entry of a symbol map associated with an interned symbol. */
+static SymbolMapValue* symbol_map_find(const SymbolMap * const map,
+                                       const SymbolName * const symbol) {
+    assert_non_null(map);
+    if (map->entries.count == 0 || symbol == NULL) {
+        return NULL;
+    }
+    return *symbol_map_slot(map->table, map->table_size, symbol);
 }
 
 
-/* CheckParameterValue callback to check whether a value isn't within a set. */
-static int check_not_in_set(const LargestIntegralType value,
-                            const LargestIntegralType check_value_data) {
-    return value_in_set_display_error(value,
-        cast_largest_integral_type_to_pointer(CheckIntegerSet*,
-                                              check_value_data), 1);
+/*
+ * Find the entry of a symbol map associated with an interned symbol, adding
+ * an empty entry if the symbol isn't in the map yet.
+ */
+static SymbolMapValue* symbol_map_add(SymbolMap * const map,
+                                      const SymbolName * const symbol) {
+    SymbolMapValue **slot;
+    assert_non_null(map);
+    assert_non_null(symbol);
+
+    /* Keep the load factor of the table below 1/2. */
+    if ((map->entries.count + 1) * 2 > map->table_size) {
+        symbol_map_grow(map);
+    }
+
+    slot = symbol_map_slot(map->table, map->table_size, symbol);
+    if (*slot == NULL) {
+        *slot = symbol_map_value_new(symbol);
+        value_queue_push(&map->entries, *slot, 1);
+    }
+    return *slot;
 }
 
 
-/* Create the callback data for check_in_set() or check_not_in_set() and
- * register a check event. */
-static void expect_set(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType values[], const size_t number_of_values,
-        const CheckParameterValue check_function, const int count) {
-    CheckIntegerSet * const check_integer_set =
-        (CheckIntegerSet*)malloc(sizeof(*check_integer_set) +
-               (sizeof(values[0]) * number_of_values));
-    LargestIntegralType * const set = (LargestIntegralType*)(
-        check_integer_set + 1);
-    declare_initialize_value_pointer_pointer(check_data, check_integer_set);
+/*
+ * Adds a value to the queue of values associated with the given hierarchy of
+ * symbols.  It's assumed value is allocated from the arena of the test.
+ * Returns the slot the value was queued in.
+ */
+static ValueSlot* add_symbol_value(SymbolMap * const symbol_map,
+                             const char * const symbol_names[],
+                             const size_t number_of_symbol_names,
+                             const void* value, const int refcount) {
+    SymbolMapValue *target_map_value;
+    assert_non_null(symbol_map);
+    assert_non_null(symbol_names);
+    assert_true(number_of_symbol_names);
+
+    target_map_value = symbol_map_add(
+        symbol_map, symbol_table_add(&mock_state()->symbol_table, symbol_names[0]));
+    return add_symbol_map_value(target_map_value, &symbol_names[1],
+                                number_of_symbol_names - 1, value, refcount);
+}
+
+
+/*
+ * Adds a value to the queue of values associated with the given hierarchy of
+ * symbols below a symbol map entry.
+ */
+static ValueSlot* add_symbol_map_value(SymbolMapValue * const map_value,
+                                 const char * const symbol_names[],
+                                 const size_t number_of_symbol_names,
+                                 const void* value, const int refcount) {
+    SymbolMapValue *target_map_value;
+    assert_non_null(map_value);
+
+    if (number_of_symbol_names == 0) {
+        return value_queue_push(&map_value->values, value, refcount);
+    }
+
+    target_map_value = symbol_map_value_add_child(
+        map_value,
+        symbol_table_add(&mock_state()->symbol_table, symbol_names[0]));
+    return add_symbol_map_value(target_map_value, &symbol_names[1],
+                                number_of_symbol_names - 1, value, refcount);
+}
+
+
+/*
+ * Gets the next value associated with the given hierarchy of symbols below a
+ * symbol map entry.  A copy of the value's slot is returned as an output
+ * parameter with the function returning the slot's old refcount value if a
+ * value is found, 0 otherwise.
+ */
+static int get_symbol_map_value(SymbolMapValue * const map_value,
+                                const char * const symbol_names[],
+                                const size_t number_of_symbol_names,
+                                ValueSlot *output) {
+    ValueSlot *slot;
+    int return_value;
+
+    if (number_of_symbol_names > 0) {
+        SymbolMapValue * const child = symbol_map_value_child(
+            map_value,
+            symbol_table_find(&mock_state()->symbol_table, symbol_names[0]));
+        if (child == NULL ||
+            !symbol_map_value_has_values(child, number_of_symbol_names)) {
+            cm_print_error("No entries for symbol %s.\n", symbol_names[0]);
+            return 0;
+        }
+        return get_symbol_map_value(child, &symbol_names[1],
+                                    number_of_symbol_names - 1, output);
+    }
+
+    assert_true(map_value->values.count);
+    /* Add a check to silence clang analyzer */
+    if (map_value->values.count == 0) {
+        return 0;
+    }
+    slot = value_queue_at(&map_value->values, 0);
+    *output = *slot;
+    return_value = slot->refcount;
+    if (slot->refcount - 1 == 0) {
+        value_queue_pop(&map_value->values);
+    } else if (slot->refcount > WILL_RETURN_ONCE) {
+        --slot->refcount;
+    }
+    return return_value;
+}
+
+
+/*
+ * Gets the next value associated with the given hierarchy of symbols.
+ * A copy of the value's slot is returned as an output parameter with the
+ * function returning the slot's old refcount value if a value is found, 0
+ * otherwise.  This means that a return value of 1 indicates the value was
+ * just removed from the queue.
+ */
+static int get_symbol_value(
+        SymbolMap * const symbol_map, const char * const symbol_names[],
+        const size_t number_of_symbol_names, ValueSlot *output) {
+    SymbolMapValue *map_value;
+    assert_non_null(symbol_map);
+    assert_non_null(symbol_names);
+    assert_true(number_of_symbol_names);
+    assert_non_null(output);
+
+    map_value = symbol_map_find(
+        symbol_map, symbol_table_find(&mock_state()->symbol_table, symbol_names[0]));
+    if (map_value == NULL ||
+        !symbol_map_value_has_values(map_value, number_of_symbol_names)) {
+        cm_print_error("No entries for symbol %s.\n", symbol_names[0]);
+        return 0;
+    }
+    /* Empty entries stay in the map until it's freed by teardown_testing(). */
+    return get_symbol_map_value(map_value, &symbol_names[1],
+                                number_of_symbol_names - 1, output);
+}
+
+/*
+ * Remove the first symbol value below a symbol map entry that has a
+ * refcount < -1 (i.e should always be returned and has been returned at
+ * least once).
+ */
+static void remove_always_return_values_from_map_value(
+        SymbolMapValue * const value, const size_t number_of_symbol_names) {
+    ValueQueue * const queue = &value->values;
+    size_t i;
+
+    if (number_of_symbol_names == 1) {
+        /* If this item has been returned more than once, free it. */
+        if (queue->count > 0 && value_queue_at(queue, 0)->refcount < -1) {
+            value_queue_pop(queue);
+        }
+        return;
+    }
+    for (i = 0; i < queue->count; i++) {
+        remove_always_return_values_from_map_value(
+            (SymbolMapValue*)value_queue_at(queue, i)->value,
+            number_of_symbol_names - 1);
+    }
+}
+
+
+/*
+ * Traverse down a tree of symbol values and remove the first symbol value
+ * in each branch that has a refcount < -1 (i.e should always be returned
+ * and has been returned at least once).
+ */
+static void remove_always_return_values(SymbolMap * const map,
+                                        const size_t number_of_symbol_names) {
+    size_t i;
+    assert_non_null(map);
+    assert_true(number_of_symbol_names);
+
+    for (i = 0; i < map->entries.count; i++) {
+        SymbolMapValue * const value =
+            (SymbolMapValue*)value_queue_at(&map->entries, i)->value;
+        assert_non_null(value);
+        remove_always_return_values_from_map_value(value,
+                                                   number_of_symbol_names);
+    }
+}
+
+/*
+ * Checks if there are any expected function calls which weren't made by the
+ * test.  Ignored calls are skipped.
+ */
+static size_t check_for_leftover_calls(const CallOrdering * const ordering,
+                                       const char * const error_message)
+{
+    size_t i;
+    size_t leftover_count = 0;
+    assert_non_null(ordering);
+
+    for (i = ordering->cursor; i < ordering->calls.count; i++) {
+        const ValueSlot * const slot = value_queue_at(&ordering->calls, i);
+        const FuncOrderingValue * const o =
+            (const FuncOrderingValue*)slot->value;
+        if (slot->refcount < -1) {
+            continue;
+        }
+        cm_print_error(error_message, "%s", o->function);
+        cm_print_error(SOURCE_LOCATION_FORMAT
+                ": note: remaining item was declared here\n",
+                o->location.file, o->location.line);
+        leftover_count++;
+    }
+    return leftover_count;
+}
+
+/*
+ * Checks if there are any leftover values set up by the test that were never
+ * retrieved through execution, and fail the test if that is the case.
+ */
+static size_t check_for_leftover_values(
+        const ValueQueue * const entries, const char * const error_message,
+        const size_t number_of_symbol_names) {
+    size_t i;
+    size_t symbols_with_leftover_values = 0;
+    assert_non_null(entries);
+    assert_true(number_of_symbol_names);
+
+    for (i = 0; i < entries->count; i++) {
+        const SymbolMapValue * const value =
+            (const SymbolMapValue*)value_queue_at(entries, i)->value;
+        assert_non_null(value);
+
+        if (!symbol_map_value_has_values(value, number_of_symbol_names)) {
+            continue;
+        }
+        if (number_of_symbol_names == 1) {
+            size_t j;
+            cm_print_error(error_message, "%s", value->symbol_name);
+
+            for (j = 0; j < value->values.count; j++) {
+                const SourceLocation * const location =
+                    (const SourceLocation*)
+                        value_queue_at(&value->values, j)->value;
+                cm_print_error(SOURCE_LOCATION_FORMAT
+                               ": note: remaining item was declared here\n",
+                               location->file, location->line);
+            }
+        } else {
+            cm_print_error("%s: ", value->symbol_name);
+            check_for_leftover_values(&value->values, error_message,
+                                      number_of_symbol_names - 1);
+        }
+        symbols_with_leftover_values ++;
+    }
+    return symbols_with_leftover_values;
+}
+
+
+/* Allocate the mock trace of a test if tracing is enabled. */
+static void mock_trace_initialize(MockState * const state) {
+    MockTrace * const trace = &state->trace;
+    trace->size = cm_get_mock_trace_records();
+    trace->count = 0;
+    trace->records = NULL;
+    if (trace->size > 0) {
+        trace->records = (MockTraceRecord*)arena_alloc(
+            &state->arena, trace->size * sizeof(*trace->records));
+    }
+#ifdef HAVE_STRUCT_TIMESPEC
+    trace->start.tv_sec = 0;
+    trace->start.tv_nsec = 0;
+    CMOCKA_CLOCK_GETTIME(CLOCK_REALTIME, &trace->start);
+#endif
+}
+
+
+/*
+ * Record a mock interaction in the mock trace, overwriting the oldest record
+ * once the trace is full.  parameter may be NULL.
+ */
+static void mock_trace_record(MockState * const state,
+                              const MockTraceType type,
+                              const char * const function,
+                              const char * const parameter,
+                              const LargestIntegralType value,
+                              const char * const file, const int line) {
+    MockTrace * const trace = &state->trace;
+    MockTraceRecord *record;
+#ifdef HAVE_STRUCT_TIMESPEC
+    struct timespec now = trace->start;
+#endif
+
+    if (trace->size == 0) {
+        return;
+    }
+    record = &trace->records[trace->count++ & (trace->size - 1)];
+    record->time = 0;
+#ifdef HAVE_STRUCT_TIMESPEC
+    CMOCKA_CLOCK_GETTIME(CLOCK_REALTIME, &now);
+    record->time = (uint64_t)(now.tv_sec - trace->start.tv_sec) * 1000000000 +
+                   (uint64_t)now.tv_nsec - (uint64_t)trace->start.tv_nsec;
+#endif
+    record->value = value;
+    record->file = file;
+    record->line = (unsigned int)line;
+    record->function_id = symbol_table_add(&state->symbol_table, function)->id;
+    record->parameter_id = 0;
+    if (parameter != NULL) {
+        record->parameter_id =
+            symbol_table_add(&state->symbol_table, parameter)->id;
+    }
+    record->type = type;
+}
+
+
+/* Print the records of the mock trace of a test, oldest first. */
+static void mock_trace_print(MockState * const state,
+                             void (*print)(const char * const format, ...)) {
+    const MockTrace * const trace = &state->trace;
+    const SymbolTable * const table = &state->symbol_table;
+    const uint64_t first =
+        trace->count > trace->size ? trace->count - trace->size : 0;
+    const char **names;
+    uint64_t i;
+    size_t j;
+
+    if (trace->count == 0) {
+        return;
+    }
+    /* Map the symbol ids of the records back to the names. */
+    names = (const char**)arena_calloc(&state->arena, table->names_count + 1,
+                                       sizeof(*names));
+    for (j = 0; j < table->names_size; j++) {
+        if (table->names[j] != NULL) {
+            names[table->names[j]->id] = table->names[j]->name;
+        }
+    }
+
+    print("Mock trace (last " LargestIntegralTypePrintfFormatDecimal " of "
+          LargestIntegralTypePrintfFormatDecimal " interactions):\n",
+          (LargestIntegralType)(trace->count - first),
+          (LargestIntegralType)trace->count);
+    for (i = first; i < trace->count; i++) {
+        const MockTraceRecord * const record =
+            &trace->records[i & (trace->size - 1)];
+        const char * const function = names[record->function_id];
+        print("  +%u.%09us ", (unsigned int)(record->time / 1000000000),
+              (unsigned int)(record->time % 1000000000));
+        switch (record->type) {
+        case MOCK_TRACE_MOCK:
+            print("mock() in %s returned " LargestIntegralTypePrintfFormat,
+                  function, record->value);
+            break;
+        case MOCK_TRACE_CHECK_EXPECTED:
+            print("check_expected(%s) in %s with "
+                  LargestIntegralTypePrintfFormat,
+                  names[record->parameter_id], function, record->value);
+            break;
+        case MOCK_TRACE_FUNCTION_CALLED:
+            print("function_called() in %s", function);
+            break;
+        }
+        print(" at " SOURCE_LOCATION_FORMAT "\n", record->file, record->line);
+    }
+}
+
+
+/* Get the next return value for the specified mock function. */
+LargestIntegralType _mock(const char * const function, const char* const file,
+                          const int line) {
+    MockState * const state = mock_state();
+    LargestIntegralType value = 0;
+    ValueSlot result;
+    int rc;
+
+    mock_state_lock();
+    rc = get_symbol_value(&state->function_result_map, &function, 1,
+                          &result);
+    if (rc) {
+        SymbolValue * const symbol = (SymbolValue*)result.value;
+        state->last_mock_value_location = symbol->location;
+        if (symbol->values != NULL) {
+            value = symbol->values[symbol->count - (size_t)rc];
+        } else {
+            value = symbol->value;
+        }
+        mock_trace_record(state, MOCK_TRACE_MOCK, function, NULL, value,
+                          file, line);
+    } else {
+        cm_print_error(SOURCE_LOCATION_FORMAT ": error: Could not get value "
+                       "to mock function %s\n", file, line, function);
+        if (source_location_is_set(&state->last_mock_value_location)) {
+            cm_print_error(SOURCE_LOCATION_FORMAT
+                           ": note: Previously returned mock value was declared here\n",
+                           state->last_mock_value_location.file,
+                           state->last_mock_value_location.line);
+        } else {
+            cm_print_error("There were no previously returned mock values for "
+                           "this test.\n");
+        }
+        exit_test(1);
+    }
+    mock_state_unlock();
+    return value;
+}
+
+/* Initialize an empty call ordering. */
+static void call_ordering_initialize(CallOrdering * const ordering) {
+    assert_non_null(ordering);
+    value_queue_initialize(&ordering->calls);
+    ordering->cursor = 0;
+    symbol_map_initialize(&ordering->ignored_map);
+}
+
+
+/*
+ * Move the cursor of a call ordering past the expected calls which are
+ * ignored or satisfied, indexing the symbols of the ignored calls.
+ */
+static void call_ordering_advance(CallOrdering * const ordering) {
+    while (ordering->cursor < ordering->calls.count) {
+        const ValueSlot * const slot =
+            value_queue_at(&ordering->calls, ordering->cursor);
+        if (slot->refcount < -1) {
+            symbol_map_add(&ordering->ignored_map,
+                           ((const FuncOrderingValue*)slot->value)->symbol);
+        } else if (slot->refcount != 0) {
+            break;
+        }
+        ordering->cursor++;
+    }
+}
+
+
+/* Ensure that function is being called in proper order */
+void _function_called(const char *const function,
+                      const char *const file,
+                      const int line)
+{
+    mock_state_lock();
+    mock_trace_record(mock_state(), MOCK_TRACE_FUNCTION_CALLED, function,
+                      NULL, 0, file, line);
+    call_ordering_check(&mock_state()->call_ordering,
+                        symbol_table_find(&mock_state()->symbol_table,
+                                          function),
+                        function, file, line);
+    mock_state_unlock();
+}
+
+/* Check a call to a function against a call ordering. */
+static void call_ordering_check(CallOrdering * const ordering,
+                                const SymbolName * const symbol,
+                                const char *const function,
+                                const char *const file,
+                                const int line)
+{
+    ValueSlot *expected_slot;
+    const FuncOrderingValue *expected_call;
+
+    if (ordering->cursor == ordering->calls.count &&
+        ordering->ignored_map.entries.count == 0) {
+        cm_print_error(SOURCE_LOCATION_FORMAT
+                       ": error: No mock calls expected but called() was "
+                       "invoked in %s\n",
+                       file, line,
+                       function);
+        exit_test(1);
+        return;
+    }
+
+    if (symbol_map_find(&ordering->ignored_map, symbol) != NULL) {
+        return;
+    }
+
+    if (ordering->cursor == ordering->calls.count) {
+        cm_print_error(SOURCE_LOCATION_FORMAT
+                       ": error: No expected mock calls matching "
+                       "called() invocation in %s",
+                       file, line,
+                       function);
+        exit_test(1);
+        return;
+    }
+
+    expected_slot = value_queue_at(&ordering->calls, ordering->cursor);
+    expected_call = (const FuncOrderingValue *)expected_slot->value;
+    if (expected_call->symbol != symbol) {
+        cm_print_error(SOURCE_LOCATION_FORMAT
+                       ": error: Expected call to %s but received called() "
+                       "in %s\n",
+                       file, line,
+                       expected_call->function,
+                       function);
+        exit_test(1);
+        return;
+    }
+
+    /* An expect_function_call_any() entry is ignored once it's satisfied. */
+    --expected_slot->refcount;
+    call_ordering_advance(ordering);
+}
+
+/* Add a return value for the specified mock function name. */
+void _will_return(const char * const function_name, const char * const file,
+                  const int line, const LargestIntegralType value,
+                  const int count) {
+    MockState * const state = mock_state();
+    SymbolValue *return_value;
+    assert_true(count != 0);
+
+    mock_state_lock();
+    return_value = (SymbolValue*)arena_alloc(&state->arena,
+                                             sizeof(*return_value));
+    return_value->value = value;
+    return_value->values = NULL;
+    return_value->count = 0;
+    set_source_location(&return_value->location, file, line);
+    add_symbol_value(&state->function_result_map, &function_name, 1,
+                     return_value, count);
+    mock_state_unlock();
+}
+
+
+/*
+ * Add an array of return values for the specified mock function name.  The
+ * values are copied into a single block which is queued once and consumed
+ * one value per call to _mock().
+ */
+void _will_return_array(const char * const function_name,
+                        const char * const file, const int line,
+                        const LargestIntegralType values[],
+                        const size_t count) {
+    MockState * const state = mock_state();
+    SymbolValue *return_value;
+    LargestIntegralType *block_values;
     assert_non_null(values);
-    assert_true(number_of_values);
-    memcpy(set, values, number_of_values * sizeof(values[0]));
-    check_integer_set->set = set;
-    check_integer_set->size_of_set = number_of_values;
-    _expect_check(
-        function, parameter, file, line, check_function,
-        check_data.value, &check_integer_set->event, count);
+    assert_true(count > 0 && count <= INT_MAX);
+    assert_true(count <= ((size_t)-1 - sizeof(*return_value)) /
+                         sizeof(values[0]));
+
+    mock_state_lock();
+    return_value = (SymbolValue*)arena_alloc(
+        &state->arena, sizeof(*return_value) + count * sizeof(values[0]));
+    block_values = (LargestIntegralType*)(return_value + 1);
+    memcpy(block_values, values, count * sizeof(values[0]));
+
+    return_value->value = 0;
+    return_value->values = block_values;
+    return_value->count = count;
+    set_source_location(&return_value->location, file, line);
+    add_symbol_value(&state->function_result_map, &function_name, 1,
+                     return_value, (int)count);
+    mock_state_unlock();
+}
+
+
+/*
+ * Add a parameter checking function.  If the event parameter is NULL the
+ * event structure is allocated from the arena of the test, otherwise event
+ * must stay valid until the test is torn down.
+ */
+static void expect_check_event(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line, const CheckKind kind,
+        const CheckParameterValue check_function,
+        const LargestIntegralType check_data,
+        CheckParameterEvent * const event, const int count) {
+    MockState * const state = mock_state();
+    const char* symbols[] = {function, parameter};
+    CheckParameterEvent *check;
+
+    mock_state_lock();
+    check = event ? event :
+        (CheckParameterEvent*)arena_alloc(&state->arena, sizeof(*check));
+    check->parameter_name = parameter;
+    check->check_value = check_function;
+    check->check_value_data = check_data;
+    set_source_location(&check->location, file, line);
+    add_symbol_value(&state->function_parameter_map, symbols, 2, check,
+                     count)->kind = kind;
+    mock_state_unlock();
+}
+
+
+/*
+ * Add a custom parameter checking function.  If the event parameter is NULL
+ * the event structure is allocated internally by this function.  If event
+ * parameter is provided it must be allocated on the heap and doesn't need to
+ * be deallocated by the caller.
+ */
+void _expect_check(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const CheckParameterValue check_function,
+        const LargestIntegralType check_data,
+        CheckParameterEvent * const event, const int count) {
+    mock_state_lock();
+    if (event != NULL) {
+        list_add_value(&mock_state()->check_event_heap_list, event, 1);
+    }
+    expect_check_event(function, parameter, file, line, CHECK_KIND_CALLBACK,
+                       check_function, check_data, event, count);
+    mock_state_unlock();
+}
+
+/*
+ * Add an call expectations that a particular function is called correctly.
+ * This is used for code under test that makes calls to several functions
+ * in depended upon components (mocks).
+ */
+
+void _expect_function_call(
+    const char * const function_name,
+    const char * const file,
+    const int line,
+    const int count)
+{
+    MockState * const state = mock_state();
+    FuncOrderingValue *ordering;
+
+    assert_non_null(function_name);
+    assert_non_null(file);
+    assert_true(count != 0);
+
+    mock_state_lock();
+    ordering = (FuncOrderingValue *)arena_alloc(&state->arena,
+                                                sizeof(*ordering));
+
+    set_source_location(&ordering->location, file, line);
+    ordering->function = function_name;
+    ordering->symbol = symbol_table_add(&state->symbol_table, function_name);
+
+    value_queue_push(&state->call_ordering.calls, ordering, count);
+    call_ordering_advance(&state->call_ordering);
+    mock_state_unlock();
+}
+
+/*
+ * Queue the values below an entry of the symbol map of an expectation plan
+ * below the matching entry of the running test.
+ */
+static void expectation_plan_apply_map_value(
+        SymbolMapValue * const target, const SymbolMapValue * const source,
+        const size_t number_of_symbol_names) {
+    size_t i;
+    for (i = 0; i < source->values.count; i++) {
+        const ValueSlot * const slot = value_queue_at(&source->values, i);
+        if (number_of_symbol_names == 1) {
+            value_queue_push(&target->values, slot->value,
+                             slot->refcount)->kind = slot->kind;
+        } else {
+            const SymbolMapValue * const child =
+                (const SymbolMapValue*)slot->value;
+            expectation_plan_apply_map_value(
+                symbol_map_value_add_child(
+                    target, symbol_table_add(&mock_state()->symbol_table,
+                                             child->symbol_name)),
+                child, number_of_symbol_names - 1);
+        }
+    }
+}
+
+
+/* Queue the values of a symbol map of an expectation plan. */
+static void expectation_plan_apply_map(SymbolMap * const target,
+                                       const SymbolMap * const source,
+                                       const size_t number_of_symbol_names) {
+    size_t i;
+    for (i = 0; i < source->entries.count; i++) {
+        const SymbolMapValue * const entry = (const SymbolMapValue*)
+            value_queue_at(&source->entries, i)->value;
+        expectation_plan_apply_map_value(
+            symbol_map_add(target,
+                           symbol_table_add(&mock_state()->symbol_table,
+                                            entry->symbol_name)),
+            entry, number_of_symbol_names);
+    }
+}
+
+
+/*
+ * Queue the expected calls of an expectation plan.  The call orderings
+ * reference the interned symbol so they're copied for the running test.
+ */
+static void expectation_plan_apply_calls(CallOrdering * const target,
+                                         const CallOrdering * const source) {
+    MockState * const state = mock_state();
+    size_t i;
+    for (i = 0; i < source->calls.count; i++) {
+        const ValueSlot * const slot = value_queue_at(&source->calls, i);
+        FuncOrderingValue * const ordering = (FuncOrderingValue*)arena_alloc(
+            &state->arena, sizeof(*ordering));
+        *ordering = *(const FuncOrderingValue*)slot->value;
+        ordering->symbol = symbol_table_add(&state->symbol_table,
+                                            ordering->function);
+        value_queue_push(&target->calls, ordering, slot->refcount);
+    }
+    call_ordering_advance(target);
+}
+
+/* Returns 1 if the specified float values are equal, else returns 0. */
+static int float_compare(const float left,
+                         const float right,
+                         const float epsilon) {
+    float absLeft;
+    float absRight;
+    float largest;
+    float relDiff;
+
+    float diff = left - right;
+    diff = (diff >= 0.f) ? diff : -diff;
+
+    // Check if the numbers are really close -- needed
+        // when comparing numbers near zero.
+        if (diff <= epsilon) {
+            return 1;
+    }
+
+    absLeft = (left >= 0.f) ? left : -left;
+    absRight = (right >= 0.f) ? right : -right;
+
+        largest = (absRight > absLeft) ? absRight : absLeft;
+    relDiff = largest * FLT_EPSILON;
+
+        if (diff > relDiff) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns 1 if the specified float values are equal. If the values are not equal
+ * an error is displayed and 0 is returned. */
+static int float_values_equal_display_error(const float left,
+                                            const float right,
+                                            const float epsilon) {
+    const int equal = float_compare(left, right, epsilon);
+    if (!equal) {
+        cm_print_error(FloatPrintfFormat " != "
+                   FloatPrintfFormat "\n", left, right);
+    }
+    return equal;
+}
+
+/* Returns 1 if the specified float values are different. If the values are equal
+ * an error is displayed and 0 is returned. */
+static int float_values_not_equal_display_error(const float left,
+                                                const float right,
+                                                const float epsilon) {
+    const int not_equal = (float_compare(left, right, epsilon) == 0);
+    if (!not_equal) {
+        cm_print_error(FloatPrintfFormat " == "
+                   FloatPrintfFormat "\n", left, right);
+    }
+    return not_equal;
+}
+
+/* Returns 1 if the specified values are equal.  If the values are not equal
+ * an error is displayed and 0 is returned. */
+static int values_equal_display_error(const LargestIntegralType left,
+                                      const LargestIntegralType right) {
+    const int equal = left == right;
+    if (!equal) {
+        cm_print_error(LargestIntegralTypePrintfFormat " != "
+                       LargestIntegralTypePrintfFormat "\n", left, right);
+    }
+    return equal;
+}
+
+/*
+ * Returns 1 if the specified values are not equal.  If the values are equal
+ * an error is displayed and 0 is returned. */
+static int values_not_equal_display_error(const LargestIntegralType left,
+                                          const LargestIntegralType right) {
+    const int not_equal = left != right;
+    if (!not_equal) {
+        cm_print_error(LargestIntegralTypePrintfFormat " == "
+                       LargestIntegralTypePrintfFormat "\n", left, right);
+    }
+    return not_equal;
+}
+
+
+/*
+ * Determine whether value is contained within check_integer_set.
+ * If invert is 0 and the value is in the set 1 is returned, otherwise 0 is
+ * returned and an error is displayed.  If invert is 1 and the value is not
+ * in the set 1 is returned, otherwise 0 is returned and an error is
+ * displayed.
+ */
+static int value_in_set_display_error(
+        const LargestIntegralType value,
+        const CheckIntegerSet * const check_integer_set, const int invert) {
+    int succeeded = invert;
+    assert_non_null(check_integer_set);
+    {
+        const LargestIntegralType * const set = check_integer_set->set;
+        const size_t size_of_set = check_integer_set->size_of_set;
+        size_t i;
+        for (i = 0; i < size_of_set; i++) {
+            if (set[i] == value) {
+                /* If invert = 0 and item is found, succeeded = 1. */
+                /* If invert = 1 and item is found, succeeded = 0. */
+                succeeded = !succeeded;
+                break;
+            }
+        }
+        if (succeeded) {
+            return 1;
+        }
+        cm_print_error(LargestIntegralTypePrintfFormatDecimal
+                       " is %sin the set (",
+                       value, invert ? "" : "not ");
+        for (i = 0; i < size_of_set; i++) {
+            cm_print_error(LargestIntegralTypePrintfFormat ", ", set[i]);
+        }
+        cm_print_error(")\n");
+    }
+    return 0;
+}
+
+
+/*
+ * Determine whether a value is within the specified range.  If the value is
+ * within the specified range 1 is returned.  If the value isn't within the
+ * specified range an error is displayed and 0 is returned.
+ */
+static int integer_in_range_display_error(
+        const LargestIntegralType value, const LargestIntegralType range_min,
+        const LargestIntegralType range_max) {
+    if (value >= range_min && value <= range_max) {
+        return 1;
+    }
+    cm_print_error(LargestIntegralTypePrintfFormatDecimal
+                   " is not within the range "
+                   LargestIntegralTypePrintfFormatDecimal "-"
+                   LargestIntegralTypePrintfFormatDecimal "\n",
+                   value, range_min, range_max);
+    return 0;
+}
+
+
+/*
+ * Determine whether a value is within the specified range.  If the value
+ * is not within the range 1 is returned.  If the value is within the
+ * specified range an error is displayed and zero is returned.
+ */
+static int integer_not_in_range_display_error(
+        const LargestIntegralType value, const LargestIntegralType range_min,
+        const LargestIntegralType range_max) {
+    if (value < range_min || value > range_max) {
+        return 1;
+    }
+    cm_print_error(LargestIntegralTypePrintfFormatDecimal
+                   " is within the range "
+                   LargestIntegralTypePrintfFormatDecimal "-"
+                   LargestIntegralTypePrintfFormatDecimal "\n",
+                   value, range_min, range_max);
+    return 0;
+}
+
+
+/*
+ * Determine whether the specified strings are equal.  If the strings are equal
+ * 1 is returned.  If they're not equal an error is displayed and 0 is
+ * returned.
+ */
+static int string_equal_display_error(
+        const char * const left, const char * const right) {
+    if (strcmp(left, right) == 0) {
+        return 1;
+    }
+    cm_print_error("\"%s\" != \"%s\"\n", left, right);
+    return 0;
+}
+
+
+/*
+ * Determine whether the specified strings are equal.  If the strings are not
+ * equal 1 is returned.  If they're not equal an error is displayed and 0 is
+ * returned
+ */
+static int string_not_equal_display_error(
+        const char * const left, const char * const right) {
+    if (strcmp(left, right) != 0) {
+        return 1;
+    }
+    cm_print_error("\"%s\" == \"%s\"\n", left, right);
+    return 0;
+}
+
+
+/*
+ * Determine whether the specified areas of memory are equal.  If they're equal
+ * 1 is returned otherwise an error is displayed and 0 is returned.
+ */
+static int memory_equal_display_error(const char* const a, const char* const b,
+                                      const size_t size) {
+    size_t differences = 0;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        const char l = a[i];
+        const char r = b[i];
+        if (l != r) {
+            if (differences < 16) {
+                cm_print_error("difference at offset %" PRIdS " 0x%02x 0x%02x\n",
+                               i, l, r);
+            }
+            differences ++;
+        }
+    }
+    if (differences > 0) {
+        if (differences >= 16) {
+            cm_print_error("...\n");
+        }
+        cm_print_error("%"PRIdS " bytes of %p and %p differ\n",
+                       differences, (void *)a, (void *)b);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Determine whether the specified areas of memory are not equal.  If they're
+ * not equal 1 is returned otherwise an error is displayed and 0 is
+ * returned.
+ */
+static int memory_not_equal_display_error(
+        const char* const a, const char* const b, const size_t size) {
+    size_t same = 0;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        const char l = a[i];
+        const char r = b[i];
+        if (l == r) {
+            same ++;
+        }
+    }
+    if (same == size) {
+        cm_print_error("%"PRIdS "bytes of %p and %p the same\n",
+                       same, (void *)a, (void *)b);
+        return 0;
+    }
+    return 1;
+}
+
+
+/* CheckParameterValue callback to check whether a value is within a set. */
+static int check_in_set(const LargestIntegralType value,
+                        const LargestIntegralType check_value_data) {
+    return value_in_set_display_error(value,
+        cast_largest_integral_type_to_pointer(CheckIntegerSet*,
+                                              check_value_data), 0);
+}
+
+
+/* CheckParameterValue callback to check whether a value isn't within a set. */
+static int check_not_in_set(const LargestIntegralType value,
+                            const LargestIntegralType check_value_data) {
+    return value_in_set_display_error(value,
+        cast_largest_integral_type_to_pointer(CheckIntegerSet*,
+                                              check_value_data), 1);
+}
+
+
+/* Create the callback data for check_in_set() or check_not_in_set() and
+ * register a check event. */
+static void expect_set(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType values[], const size_t number_of_values,
+        const CheckKind kind, const CheckParameterValue check_function,
+        const int count) {
+    CheckIntegerSet *check_integer_set;
+    LargestIntegralType *set;
+    assert_non_null(values);
+    assert_true(number_of_values);
+
+    mock_state_lock();
+    check_integer_set = (CheckIntegerSet*)arena_alloc(&mock_state()->arena,
+        sizeof(*check_integer_set) + (sizeof(values[0]) * number_of_values));
+    set = (LargestIntegralType*)(check_integer_set + 1);
+    memcpy(set, values, number_of_values * sizeof(values[0]));
+    check_integer_set->set = set;
+    check_integer_set->size_of_set = number_of_values;
+    {
+        declare_initialize_value_pointer_pointer(check_data,
+                                                 check_integer_set);
+        expect_check_event(
+            function, parameter, file, line, kind, check_function,
+            check_data.value, &check_integer_set->event, count);
+    }
+    mock_state_unlock();
+}
+
+
+/* Add an event to check whether a value is in a set. */
+void _expect_in_set(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType values[], const size_t number_of_values,
+        const int count) {
+    expect_set(function, parameter, file, line, values, number_of_values,
+               CHECK_KIND_IN_SET, check_in_set, count);
+}
+
+
+/* Add an event to check whether a value isn't in a set. */
+void _expect_not_in_set(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType values[], const size_t number_of_values,
+        const int count) {
+    expect_set(function, parameter, file, line, values, number_of_values,
+               CHECK_KIND_NOT_IN_SET, check_not_in_set, count);
+}
+
+
+/* CheckParameterValue callback to check whether a value is within a range. */
+static int check_in_range(const LargestIntegralType value,
+                          const LargestIntegralType check_value_data) {
+    CheckIntegerRange * const check_integer_range =
+        cast_largest_integral_type_to_pointer(CheckIntegerRange*,
+                                              check_value_data);
+    assert_non_null(check_integer_range);
+    return integer_in_range_display_error(value, check_integer_range->minimum,
+                                          check_integer_range->maximum);
+}
+
+
+/* CheckParameterValue callback to check whether a value is not within a range. */
+static int check_not_in_range(const LargestIntegralType value,
+                              const LargestIntegralType check_value_data) {
+    CheckIntegerRange * const check_integer_range =
+        cast_largest_integral_type_to_pointer(CheckIntegerRange*,
+                                              check_value_data);
+    assert_non_null(check_integer_range);
+    return integer_not_in_range_display_error(
+        value, check_integer_range->minimum, check_integer_range->maximum);
+}
+
+
+/* Create the callback data for check_in_range() or check_not_in_range() and
+ * register a check event. */
+static void expect_range(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType minimum, const LargestIntegralType maximum,
+        const CheckKind kind, const CheckParameterValue check_function,
+        const int count) {
+    CheckIntegerRange *check_integer_range;
+
+    mock_state_lock();
+    check_integer_range = (CheckIntegerRange*)arena_alloc(
+        &mock_state()->arena, sizeof(*check_integer_range));
+    check_integer_range->minimum = minimum;
+    check_integer_range->maximum = maximum;
+    {
+        declare_initialize_value_pointer_pointer(check_data,
+                                                 check_integer_range);
+        expect_check_event(function, parameter, file, line, kind,
+                           check_function, check_data.value,
+                           &check_integer_range->event, count);
+    }
+    mock_state_unlock();
+}
+
+
+/* Add an event to determine whether a parameter is within a range. */
+void _expect_in_range(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType minimum, const LargestIntegralType maximum,
+        const int count) {
+    expect_range(function, parameter, file, line, minimum, maximum,
+                 CHECK_KIND_IN_RANGE, check_in_range, count);
+}
+
+
+/* Add an event to determine whether a parameter is not within a range. */
+void _expect_not_in_range(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType minimum, const LargestIntegralType maximum,
+        const int count) {
+    expect_range(function, parameter, file, line, minimum, maximum,
+                 CHECK_KIND_NOT_IN_RANGE, check_not_in_range, count);
+}
+
+
+/* CheckParameterValue callback to check whether a value is equal to an
+ * expected value. */
+static int check_value(const LargestIntegralType value,
+                       const LargestIntegralType check_value_data) {
+    return values_equal_display_error(value, check_value_data);
+}
+
+
+/* Add an event to check a parameter equals an expected value. */
+void _expect_value(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType value, const int count) {
+    expect_check_event(function, parameter, file, line, CHECK_KIND_VALUE,
+                       check_value, value, NULL, count);
+}
+
+
+/*
+ * Add an event to check a parameter against an array of values.  The values
+ * are copied into a single block which is queued once and consumed one value
+ * per call to _check_expected().
+ */
+void _expect_value_array(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType values[], const size_t count) {
+    CheckIntegerArray *check_integer_array;
+    LargestIntegralType *block_values;
+    assert_non_null(values);
+    assert_true(count > 0 && count <= INT_MAX);
+    assert_true(count <= ((size_t)-1 - sizeof(*check_integer_array)) /
+                         sizeof(values[0]));
+
+    mock_state_lock();
+    check_integer_array = (CheckIntegerArray*)arena_alloc(
+        &mock_state()->arena,
+        sizeof(*check_integer_array) + count * sizeof(values[0]));
+    block_values = (LargestIntegralType*)(check_integer_array + 1);
+    memcpy(block_values, values, count * sizeof(values[0]));
+    check_integer_array->values = block_values;
+    check_integer_array->count = count;
+    /* The value to compare against depends on the refcount of the queued
+     * check, so this is only evaluated by check_parameter_event(). */
+    expect_check_event(function, parameter, file, line,
+                       CHECK_KIND_VALUE_ARRAY, NULL, 0,
+                       &check_integer_array->event, (int)count);
+    mock_state_unlock();
+}
+
+
+/* CheckParameterValue callback to check whether a value is not equal to an
+ * expected value. */
+static int check_not_value(const LargestIntegralType value,
+                           const LargestIntegralType check_value_data) {
+    return values_not_equal_display_error(value, check_value_data);
+}
+
+
+/* Add an event to check a parameter is not equal to an expected value. */
+void _expect_not_value(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const LargestIntegralType value, const int count) {
+    expect_check_event(function, parameter, file, line, CHECK_KIND_NOT_VALUE,
+                       check_not_value, value, NULL, count);
+}
+
+
+/* CheckParameterValue callback to check whether a parameter equals a string. */
+static int check_string(const LargestIntegralType value,
+                        const LargestIntegralType check_value_data) {
+    return string_equal_display_error(
+        cast_largest_integral_type_to_pointer(char*, value),
+        cast_largest_integral_type_to_pointer(char*, check_value_data));
+}
+
+
+/* Add an event to check whether a parameter is equal to a string. */
+void _expect_string(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line, const char* string,
+        const int count) {
+    declare_initialize_value_pointer_pointer(string_pointer,
+                                             discard_const(string));
+    expect_check_event(function, parameter, file, line, CHECK_KIND_STRING,
+                       check_string, string_pointer.value, NULL, count);
+}
+
+
+/* CheckParameterValue callback to check whether a parameter is not equals to
+ * a string. */
+static int check_not_string(const LargestIntegralType value,
+                            const LargestIntegralType check_value_data) {
+    return string_not_equal_display_error(
+        cast_largest_integral_type_to_pointer(char*, value),
+        cast_largest_integral_type_to_pointer(char*, check_value_data));
+}
+
+
+/* Add an event to check whether a parameter is not equal to a string. */
+void _expect_not_string(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line, const char* string,
+        const int count) {
+    declare_initialize_value_pointer_pointer(string_pointer,
+                                             discard_const(string));
+    expect_check_event(function, parameter, file, line,
+                       CHECK_KIND_NOT_STRING, check_not_string,
+                       string_pointer.value, NULL, count);
+}
+
+/* CheckParameterValue callback to check whether a parameter equals an area of
+ * memory. */
+static int check_memory(const LargestIntegralType value,
+                        const LargestIntegralType check_value_data) {
+    CheckMemoryData * const check = cast_largest_integral_type_to_pointer(
+        CheckMemoryData*, check_value_data);
+    assert_non_null(check);
+    return memory_equal_display_error(
+        cast_largest_integral_type_to_pointer(const char*, value),
+        (const char*)check->memory, check->size);
+}
+
+
+/* Create the callback data for check_memory() or check_not_memory() and
+ * register a check event. */
+static void expect_memory_setup(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line,
+        const void * const memory, const size_t size, const CheckKind kind,
+        const CheckParameterValue check_function, const int count) {
+    CheckMemoryData *check_data;
+    void *mem;
+    assert_non_null(memory);
+    assert_true(size);
+
+    mock_state_lock();
+    check_data = (CheckMemoryData*)arena_alloc(&mock_state()->arena,
+                                               sizeof(*check_data) + size);
+    mem = (void*)(check_data + 1);
+    memcpy(mem, memory, size);
+    check_data->memory = mem;
+    check_data->size = size;
+    {
+        declare_initialize_value_pointer_pointer(check_data_pointer,
+                                                 check_data);
+        expect_check_event(function, parameter, file, line, kind,
+                           check_function, check_data_pointer.value,
+                           &check_data->event, count);
+    }
+    mock_state_unlock();
+}
+
+
+/* Add an event to check whether a parameter matches an area of memory. */
+void _expect_memory(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line, const void* const memory,
+        const size_t size, const int count) {
+    expect_memory_setup(function, parameter, file, line, memory, size,
+                        CHECK_KIND_MEMORY, check_memory, count);
+}
+
+
+/* CheckParameterValue callback to check whether a parameter is not equal to
+ * an area of memory. */
+static int check_not_memory(const LargestIntegralType value,
+                            const LargestIntegralType check_value_data) {
+    CheckMemoryData * const check = cast_largest_integral_type_to_pointer(
+        CheckMemoryData*, check_value_data);
+    assert_non_null(check);
+    return memory_not_equal_display_error(
+        cast_largest_integral_type_to_pointer(const char*, value),
+        (const char*)check->memory,
+        check->size);
+}
+
+
+/* Add an event to check whether a parameter doesn't match an area of memory. */
+void _expect_not_memory(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line, const void* const memory,
+        const size_t size, const int count) {
+    expect_memory_setup(function, parameter, file, line, memory, size,
+                        CHECK_KIND_NOT_MEMORY, check_not_memory, count);
+}
+
+
+/* CheckParameterValue callback that always returns 1. */
+static int check_any(const LargestIntegralType value,
+                     const LargestIntegralType check_value_data) {
+    (void)value;
+    (void)check_value_data;
+    return 1;
+}
+
+
+/* Add an event to allow any value for a parameter. */
+void _expect_any(
+        const char* const function, const char* const parameter,
+        const char* const file, const int line, const int count) {
+    expect_check_event(function, parameter, file, line, CHECK_KIND_ANY,
+                       check_any, 0, NULL, count);
+}
+
+
+/*
+ * Evaluate the parameter check event queued in a slot.  The built-in checks
+ * are evaluated directly, the check_value function of the event is only
+ * called for checks added by _expect_check().
+ */
+static int check_parameter_event(const ValueSlot * const slot,
+                                 const LargestIntegralType value) {
+    const CheckParameterEvent * const check =
+        (const CheckParameterEvent*)slot->value;
+    const LargestIntegralType data = check->check_value_data;
+    switch (slot->kind) {
+    case CHECK_KIND_VALUE:
+        return values_equal_display_error(value, data);
+    case CHECK_KIND_NOT_VALUE:
+        return values_not_equal_display_error(value, data);
+    case CHECK_KIND_VALUE_ARRAY: {
+        const CheckIntegerArray * const check_integer_array =
+            (const CheckIntegerArray*)check;
+        return values_equal_display_error(
+            value, check_integer_array->values[check_integer_array->count -
+                                               (size_t)slot->refcount]);
+    }
+    case CHECK_KIND_IN_SET:
+        return value_in_set_display_error(
+            value, (const CheckIntegerSet*)check, 0);
+    case CHECK_KIND_NOT_IN_SET:
+        return value_in_set_display_error(
+            value, (const CheckIntegerSet*)check, 1);
+    case CHECK_KIND_IN_RANGE:
+        return integer_in_range_display_error(
+            value, ((const CheckIntegerRange*)check)->minimum,
+            ((const CheckIntegerRange*)check)->maximum);
+    case CHECK_KIND_NOT_IN_RANGE:
+        return integer_not_in_range_display_error(
+            value, ((const CheckIntegerRange*)check)->minimum,
+            ((const CheckIntegerRange*)check)->maximum);
+    case CHECK_KIND_STRING:
+        return string_equal_display_error(
+            cast_largest_integral_type_to_pointer(char*, value),
+            cast_largest_integral_type_to_pointer(char*, data));
+    case CHECK_KIND_NOT_STRING:
+        return string_not_equal_display_error(
+            cast_largest_integral_type_to_pointer(char*, value),
+            cast_largest_integral_type_to_pointer(char*, data));
+    case CHECK_KIND_MEMORY:
+        return memory_equal_display_error(
+            cast_largest_integral_type_to_pointer(const char*, value),
+            (const char*)((const CheckMemoryData*)check)->memory,
+            ((const CheckMemoryData*)check)->size);
+    case CHECK_KIND_NOT_MEMORY:
+        return memory_not_equal_display_error(
+            cast_largest_integral_type_to_pointer(const char*, value),
+            (const char*)((const CheckMemoryData*)check)->memory,
+            ((const CheckMemoryData*)check)->size);
+    case CHECK_KIND_ANY:
+        return 1;
+    case CHECK_KIND_CALLBACK:
+        break;
+    }
+    return check->check_value(value, data);
+}
+
+
+void _check_expected(
+        const char * const function_name, const char * const parameter_name,
+        const char* file, const int line, const LargestIntegralType value) {
+    MockState * const state = mock_state();
+    ValueSlot result;
+    const char* symbols[] = {function_name, parameter_name};
+    int rc;
+
+    mock_state_lock();
+    mock_trace_record(state, MOCK_TRACE_CHECK_EXPECTED, function_name,
+                      parameter_name, value, file, line);
+    rc = get_symbol_value(&state->function_parameter_map, symbols, 2,
+                          &result);
+    if (rc) {
+        const CheckParameterEvent * const check =
+            (const CheckParameterEvent*)result.value;
+        int check_succeeded;
+        state->last_parameter_location = check->location;
+        check_succeeded = check_parameter_event(&result, value);
+        if (!check_succeeded) {
+            cm_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Check of parameter %s, function %s failed\n"
+                           SOURCE_LOCATION_FORMAT
+                           ": note: Expected parameter declared here\n",
+                           file, line,
+                           parameter_name, function_name,
+                           state->last_parameter_location.file,
+                           state->last_parameter_location.line);
+            _fail(file, line);
+        }
+    } else {
+        cm_print_error(SOURCE_LOCATION_FORMAT ": error: Could not get value "
+                    "to check parameter %s of function %s\n", file, line,
+                    parameter_name, function_name);
+        if (source_location_is_set(&state->last_parameter_location)) {
+            cm_print_error(SOURCE_LOCATION_FORMAT
+                        ": note: Previously declared parameter value was declared here\n",
+                        state->last_parameter_location.file,
+                        state->last_parameter_location.line);
+        } else {
+            cm_print_error("There were no previously declared parameter values "
+                        "for this test.\n");
+        }
+        exit_test(1);
+    }
+    mock_state_unlock();
+}
+
+
+/* Replacement for assert. */
+void mock_assert(const int result, const char* const expression,
+                 const char* const file, const int line) {
+    if (!result) {
+        if (global_expecting_assert) {
+            global_last_failed_assert = expression;
+            longjmp(global_expect_assert_env, result);
+        } else {
+            cm_print_error("ASSERT: %s\n", expression);
+            _fail(file, line);
+        }
+    }
+}
+
+
+void _assert_true(const LargestIntegralType result,
+                  const char * const expression,
+                  const char * const file, const int line) {
+    if (!result) {
+        cm_print_error("%s\n", expression);
+        _fail(file, line);
+    }
+}
+
+void _assert_return_code(const LargestIntegralType result,
+                         size_t rlen,
+                         const LargestIntegralType error,
+                         const char * const expression,
+                         const char * const file,
+                         const int line)
+{
+    LargestIntegralType valmax;
+
+
+    switch (rlen) {
+    case 1:
+        valmax = 255;
+        break;
+    case 2:
+        valmax = 32767;
+        break;
+    case 4:
+        valmax = 2147483647;
+        break;
+    case 8:
+    default:
+        if (rlen > sizeof(valmax)) {
+            valmax = 2147483647;
+        } else {
+            valmax = 9223372036854775807L;
+        }
+        break;
+    }
+
+    if (result > valmax - 1) {
+        if (error > 0) {
+            cm_print_error("%s < 0, errno("
+                           LargestIntegralTypePrintfFormatDecimal "): %s\n",
+                           expression, error, strerror((int)error));
+        } else {
+            cm_print_error("%s < 0\n", expression);
+        }
+        _fail(file, line);
+    }
+}
+
+void _assert_float_equal(const float a,
+                         const float b,
+                         const float epsilon,
+                         const char * const file,
+                         const int line) {
+    if (!float_values_equal_display_error(a, b, epsilon)) {
+        _fail(file, line);
+    }
+}
+
+void _assert_float_not_equal(const float a,
+                             const float b,
+                             const float epsilon,
+                             const char * const file,
+                             const int line) {
+    if (!float_values_not_equal_display_error(a, b, epsilon)) {
+        _fail(file, line);
+    }
+}
+
+void _assert_int_equal(
+        const LargestIntegralType a, const LargestIntegralType b,
+        const char * const file, const int line) {
+    if (!values_equal_display_error(a, b)) {
+        _fail(file, line);
+    }
+}
+
+
+void _assert_int_not_equal(
+        const LargestIntegralType a, const LargestIntegralType b,
+        const char * const file, const int line) {
+    if (!values_not_equal_display_error(a, b)) {
+        _fail(file, line);
+    }
+}
+
+
+void _assert_string_equal(const char * const a, const char * const b,
+                          const char * const file, const int line) {
+    if (!string_equal_display_error(a, b)) {
+        _fail(file, line);
+    }
+}
+
+
+void _assert_string_not_equal(const char * const a, const char * const b,
+                              const char *file, const int line) {
+    if (!string_not_equal_display_error(a, b)) {
+        _fail(file, line);
+    }
+}
+
+
+void _assert_memory_equal(const void * const a, const void * const b,
+                          const size_t size, const char* const file,
+                          const int line) {
+    if (!memory_equal_display_error((const char*)a, (const char*)b, size)) {
+        _fail(file, line);
+    }
+}
+
+
+void _assert_memory_not_equal(const void * const a, const void * const b,
+                              const size_t size, const char* const file,
+                              const int line) {
+    if (!memory_not_equal_display_error((const char*)a, (const char*)b,
+                                        size)) {
+        _fail(file, line);
+    }
+}
+
+
+void _assert_in_range(
+        const LargestIntegralType value, const LargestIntegralType minimum,
+        const LargestIntegralType maximum, const char* const file,
+        const int line) {
+    if (!integer_in_range_display_error(value, minimum, maximum)) {
+        _fail(file, line);
+    }
+}
+
+void _assert_not_in_range(
+        const LargestIntegralType value, const LargestIntegralType minimum,
+        const LargestIntegralType maximum, const char* const file,
+        const int line) {
+    if (!integer_not_in_range_display_error(value, minimum, maximum)) {
+        _fail(file, line);
+    }
+}
+
+void _assert_in_set(const LargestIntegralType value,
+                    const LargestIntegralType values[],
+                    const size_t number_of_values, const char* const file,
+                    const int line) {
+    CheckIntegerSet check_integer_set;
+    check_integer_set.set = values;
+    check_integer_set.size_of_set = number_of_values;
+    if (!value_in_set_display_error(value, &check_integer_set, 0)) {
+        _fail(file, line);
+    }
+}
+
+void _assert_not_in_set(const LargestIntegralType value,
+                        const LargestIntegralType values[],
+                        const size_t number_of_values, const char* const file,
+                        const int line) {
+    CheckIntegerSet check_integer_set;
+    check_integer_set.set = values;
+    check_integer_set.size_of_set = number_of_values;
+    if (!value_in_set_display_error(value, &check_integer_set, 1)) {
+        _fail(file, line);
+    }
 }
 
 
-/* Add an event to check whether a value is in a set. */
-void _expect_in_set(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType values[], const size_t number_of_values,
-        const int count) {
-    expect_set(function, parameter, file, line, values, number_of_values,
-               check_in_set, count);
+/*
+ * Get the heap shards tracking the allocated blocks, the heap of the thread
+ * or all shards of the shared heap.
+ */
+static MallocHeapShard* malloc_heap_shards(size_t * const count) {
+    if (global_shared_heap_active) {
+        *count = MALLOC_HEAP_SHARDS;
+        return global_heap_shards;
+    }
+    *count = 1;
+    return &global_thread_heap;
 }
 
 
-/* Add an event to check whether a value isn't in a set. */
-void _expect_not_in_set(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType values[], const size_t number_of_values,
-        const int count) {
-    expect_set(function, parameter, file, line, values, number_of_values,
-               check_not_in_set, count);
+/* Get the heap shard tracking the block at ptr. */
+static MallocHeapShard* malloc_heap_shard(const void * const ptr) {
+    if (global_shared_heap_active) {
+        return &global_heap_shards[address_hash(ptr) >>
+                                   (32 - MALLOC_HEAP_SHARD_BITS)];
+    }
+    return &global_thread_heap;
 }
 
 
-/* CheckParameterValue callback to check whether a value is within a range. */
-static int check_in_range(const LargestIntegralType value,
-                          const LargestIntegralType check_value_data) {
-    CheckIntegerRange * const check_integer_range =
-        cast_largest_integral_type_to_pointer(CheckIntegerRange*,
-                                              check_value_data);
-    assert_non_null(check_integer_range);
-    return integer_in_range_display_error(value, check_integer_range->minimum,
-                                          check_integer_range->maximum);
+/*
+ * Lock a heap shard if the heap is shared.  A thread holds at most one shard
+ * at a time, which is released by exit_test() if the test fails.
+ */
+static void malloc_heap_lock(MallocHeapShard * const shard) {
+#ifdef CM_SPIN_LOCK_TRY
+    if (global_shared_heap_active) {
+        while (!CM_SPIN_LOCK_TRY(&shard->lock)) {
+        }
+        global_locked_heap_shard = shard;
+    }
+#endif
+    if (shard->blocks.next == NULL) {
+        list_initialize(&shard->blocks);
+    }
 }
 
 
-/* CheckParameterValue callback to check whether a value is not within a range. */
-static int check_not_in_range(const LargestIntegralType value,
-                              const LargestIntegralType check_value_data) {
-    CheckIntegerRange * const check_integer_range =
-        cast_largest_integral_type_to_pointer(CheckIntegerRange*,
-                                              check_value_data);
-    assert_non_null(check_integer_range);
-    return integer_not_in_range_display_error(
-        value, check_integer_range->minimum, check_integer_range->maximum);
+/* Unlock a heap shard, unless the test failure already unlocked it. */
+static void malloc_heap_unlock(MallocHeapShard * const shard) {
+#ifdef CM_SPIN_LOCK_TRY
+    if (global_locked_heap_shard == shard) {
+        global_locked_heap_shard = NULL;
+        CM_SPIN_LOCK_RELEASE(&shard->lock);
+    }
+#else
+    (void)shard;
+#endif
 }
 
 
-/* Create the callback data for check_in_range() or check_not_in_range() and
- * register a check event. */
-static void expect_range(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType minimum, const LargestIntegralType maximum,
-        const CheckParameterValue check_function, const int count) {
-    CheckIntegerRange * const check_integer_range =
-        (CheckIntegerRange*)malloc(sizeof(*check_integer_range));
-    declare_initialize_value_pointer_pointer(check_data, check_integer_range);
-    check_integer_range->minimum = minimum;
-    check_integer_range->maximum = maximum;
-    _expect_check(function, parameter, file, line, check_function,
-                  check_data.value, &check_integer_range->event, count);
+/* Assign the serial of a block added to a locked heap shard. */
+static size_t malloc_heap_next_serial(MallocHeapShard * const shard) {
+#ifdef CM_ATOMIC_INCREMENT
+    if (global_shared_heap_active) {
+        return CM_ATOMIC_INCREMENT(&global_shared_heap_serial);
+    }
+#endif
+    return ++shard->serial;
 }
 
 
-/* Add an event to determine whether a parameter is within a range. */
-void _expect_in_range(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType minimum, const LargestIntegralType maximum,
-        const int count) {
-    expect_range(function, parameter, file, line, minimum, maximum,
-                 check_in_range, count);
+/*
+ * Lock the allocation counters, the quarantine and the stack depot if the
+ * heap is shared.  The lock isn't recursive.
+ */
+static void malloc_state_lock(void) {
+#ifdef CM_SPIN_LOCK_TRY
+    if (global_shared_heap_active) {
+        while (!CM_SPIN_LOCK_TRY(&global_shared_malloc_lock)) {
+        }
+        global_shared_malloc_locked = 1;
+    }
+#endif
 }
 
 
-/* Add an event to determine whether a parameter is not within a range. */
-void _expect_not_in_range(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType minimum, const LargestIntegralType maximum,
-        const int count) {
-    expect_range(function, parameter, file, line, minimum, maximum,
-                 check_not_in_range, count);
+/* Unlock the allocation counters, the quarantine and the stack depot. */
+static void malloc_state_unlock(void) {
+#ifdef CM_SPIN_LOCK_TRY
+    if (global_shared_malloc_locked) {
+        global_shared_malloc_locked = 0;
+        CM_SPIN_LOCK_RELEASE(&global_shared_malloc_lock);
+    }
+#endif
+}
+
+
+/*
+ * Release the heap locks of the thread and leave the wrapped allocation
+ * functions before jumping out of a test.
+ */
+static void malloc_state_unlock_all(void) {
+    if (global_locked_heap_shard != NULL) {
+        malloc_heap_unlock(global_locked_heap_shard);
+    }
+    malloc_state_unlock();
+    global_malloc_wrapper_active = 0;
+}
+
+
+/* Get the allocation counters of the running test. */
+static MallocStats* get_malloc_stats(void) {
+    return global_shared_heap_active ? &global_shared_malloc_stats :
+                                       &global_malloc_stats;
+}
+
+
+/* Get the memory budget region of the running test. */
+static MallocBudget* get_malloc_budget(void) {
+    return global_shared_heap_active ? &global_shared_malloc_budget :
+                                       &global_malloc_budget;
+}
+
+static void *libc_calloc(size_t nmemb, size_t size)
+{
+#ifdef CM_HAVE_MALLOC_WRAP
+    if (__real_calloc != NULL) {
+        return __real_calloc(nmemb, size);
+    }
+#endif
+#undef calloc
+    return calloc(nmemb, size);
+#define calloc test_calloc
+}
+
+static void *libc_malloc(size_t size)
+{
+#ifdef CM_HAVE_MALLOC_WRAP
+    if (__real_malloc != NULL) {
+        return __real_malloc(size);
+    }
+#endif
+#undef malloc
+    return malloc(size);
+#define malloc test_malloc
+}
+
+static void libc_free(void *ptr)
+{
+#ifdef CM_HAVE_MALLOC_WRAP
+    if (__real_free != NULL) {
+        __real_free(ptr);
+        return;
+    }
+#endif
+#undef free
+    free(ptr);
+#define free test_free
+}
+
+static void *libc_realloc(void *ptr, size_t size)
+{
+#ifdef CM_HAVE_MALLOC_WRAP
+    if (__real_realloc != NULL) {
+        return __real_realloc(ptr, size);
+    }
+#endif
+#undef realloc
+    return realloc(ptr, size);
+#define realloc test_realloc
+}
+
+static void vcm_print_error(const char* const format,
+                            va_list args) CMOCKA_PRINTF_ATTRIBUTE(1, 0);
+
+/* It's important to use the libc malloc and free here otherwise
+ * the automatic free of leaked blocks can reap the error messages
+ */
+static void vcm_print_error(const char* const format, va_list args)
+{
+    char buffer[1024];
+    size_t msg_len = 0;
+    va_list ap;
+    int len;
+    va_copy(ap, args);
+
+    len = vsnprintf(buffer, sizeof(buffer), format, args);
+    if (len < 0) {
+        /* TODO */
+        goto end;
+    }
+
+    if (cm_error_message == NULL) {
+        /* CREATE MESSAGE */
+
+        cm_error_message = libc_calloc(1, len + 1);
+        if (cm_error_message == NULL) {
+            /* TODO */
+            goto end;
+        }
+    } else {
+        /* APPEND MESSAGE */
+        char *tmp;
+
+        msg_len = strlen(cm_error_message);
+        tmp = libc_realloc(cm_error_message, msg_len + len + 1);
+        if (tmp == NULL) {
+            goto end;
+        }
+        cm_error_message = tmp;
+    }
+
+    if (((size_t)len) < sizeof(buffer)) {
+        /* Use len + 1 to also copy '\0' */
+        memcpy(cm_error_message + msg_len, buffer, len + 1);
+    } else {
+        vsnprintf(cm_error_message + msg_len, len, format, ap);
+    }
+end:
+    va_end(ap);
+
+}
+
+static void vcm_free_error(char *err_msg)
+{
+    libc_free(err_msg);
+}
+
+/*
+ * Hand a failure raised by a thread spawned by the code under test over to
+ * the test thread, with the error messages the thread printed so far.
+ */
+static void defer_failure(void)
+{
+    if (cm_error_message != NULL) {
+        const size_t len = strlen(cm_error_message);
+        /* Terminate the message of each failure with a new line. */
+        if (len == 0 || cm_error_message[len - 1] != '\n') {
+            cm_print_error("\n");
+        }
+    }
+
+    mock_state_lock();
+    global_deferred_failures++;
+    if (global_deferred_error_message == NULL) {
+        global_deferred_error_message = cm_error_message;
+    } else if (cm_error_message != NULL) {
+        const size_t deferred_len = strlen(global_deferred_error_message);
+        const size_t len = strlen(cm_error_message);
+        char * const tmp = libc_realloc(global_deferred_error_message,
+                                        deferred_len + len + 1);
+        if (tmp != NULL) {
+            memcpy(tmp + deferred_len, cm_error_message, len + 1);
+            global_deferred_error_message = tmp;
+        }
+        vcm_free_error(cm_error_message);
+    }
+    cm_error_message = NULL;
+    mock_state_unlock();
+}
+
+/* Fail the test if another thread raised a failure while it was running. */
+static void fail_if_deferred_failures(void)
+{
+    char *error_message;
+    int failures;
+
+    mock_state_lock();
+    failures = global_deferred_failures;
+    error_message = global_deferred_error_message;
+    global_deferred_failures = 0;
+    global_deferred_error_message = NULL;
+    mock_state_unlock();
+
+    if (failures == 0) {
+        return;
+    }
+    if (error_message != NULL) {
+        cm_print_error("%s", error_message);
+        vcm_free_error(error_message);
+    }
+    cm_print_error("%d failure(s) raised by other threads of the test\n",
+                   failures);
+    exit_test(1);
+}
+
+/* Discard the failures of other threads once the test is torn down. */
+static void clear_deferred_failures(void)
+{
+    mock_state_lock();
+    vcm_free_error(global_deferred_error_message);
+    global_deferred_error_message = NULL;
+    global_deferred_failures = 0;
+    mock_state_unlock();
+}
+
+/* Add the mock trace of a failed test to its error message. */
+static void print_mock_trace_on_failure(void)
+{
+    if (global_skip_test) {
+        return;
+    }
+    mock_state_lock();
+    mock_trace_print(mock_state(), cm_print_error);
+    mock_state_unlock();
+}
+
+/*
+ * Find the entry of an address in a table of the block registry, or the
+ * unused entry where it would be added.
+ */
+static MallocBlockEntry* block_registry_slot(MallocBlockEntry * const entries,
+                                             const size_t size,
+                                             const void * const ptr) {
+    const size_t mask = size - 1;
+    size_t i;
+    for (i = address_hash(ptr) & mask;
+         entries[i].ptr != NULL && entries[i].ptr != ptr;
+         i = (i + 1) & mask) {
+    }
+    return &entries[i];
+}
+
+
+/*
+ * Rehash the block registry, dropping the tombstones.  The table grows so it
+ * stays at most a quarter full of allocated blocks.
+ */
+static void block_registry_rehash(MallocBlockRegistry * const registry) {
+    size_t size = registry->size ? registry->size :
+                                   MALLOC_BLOCK_REGISTRY_INITIAL_SIZE;
+    MallocBlockEntry *entries;
+    size_t i;
+
+    while ((registry->count + 1) * 4 > size) {
+        size *= 2;
+    }
+    entries = (MallocBlockEntry*)libc_calloc(size, sizeof(*entries));
+    assert_non_null(entries);
+    for (i = 0; i < registry->size; i++) {
+        if (registry->entries[i].block != NULL) {
+            *block_registry_slot(entries, size, registry->entries[i].ptr) =
+                registry->entries[i];
+        }
+    }
+    libc_free(registry->entries);
+    registry->entries = entries;
+    registry->size = size;
+    registry->used = registry->count;
+}
+
+
+/* Add a block allocated by test_malloc() to the registry of its shard. */
+static void block_registry_add(MallocHeapShard * const shard,
+                               const void * const ptr,
+                               struct MallocBlockInfoData * const block) {
+    MallocBlockRegistry * const registry = &shard->registry;
+    MallocBlockEntry *entry;
+
+    /* Keep the load factor including the tombstones below 1/2. */
+    if ((registry->used + 1) * 2 > registry->size) {
+        block_registry_rehash(registry);
+    }
+    entry = block_registry_slot(registry->entries, registry->size, ptr);
+    if (entry->ptr == NULL) {
+        registry->used++;
+    }
+    entry->ptr = ptr;
+    entry->block = block;
+    registry->count++;
+}
+
+
+/*
+ * Find the entry of a block allocated by test_malloc() which is released by
+ * test_free() or test_realloc().  The test fails if ptr isn't the address of
+ * an allocated block.  Unless the heap is shared, the blocks allocated by
+ * other threads aren't in the registry and can't be freed.
+ */
+static MallocBlockEntry* block_registry_find(MallocHeapShard * const shard,
+                                             const void * const ptr,
+                                             const char * const file,
+                                             const int line) {
+    MallocBlockRegistry * const registry = &shard->registry;
+    MallocBlockEntry *entry = NULL;
+
+    if (registry->size > 0) {
+        entry = block_registry_slot(registry->entries, registry->size, ptr);
+    }
+    if (entry == NULL || entry->ptr == NULL) {
+        cm_print_error(SOURCE_LOCATION_FORMAT
+                       ": error: %p wasn't allocated by test_malloc()\n",
+                       file, line, ptr);
+        if (!global_shared_heap_active) {
+            cm_print_error("note: blocks allocated by other threads can "
+                           "only be freed with cmocka_set_shared_heap()\n");
+        }
+        global_memory_errors++;
+        _fail(file, line);
+        return NULL;
+    }
+    if (entry->block == NULL) {
+        cm_print_error(SOURCE_LOCATION_FORMAT
+                       ": error: %p was already freed\n"
+                       SOURCE_LOCATION_FORMAT ": note: freed here\n"
+                       SOURCE_LOCATION_FORMAT ": note: allocated here\n",
+                       file, line, ptr,
+                       entry->free_location.file, entry->free_location.line,
+                       entry->location.file, entry->location.line);
+        global_memory_errors++;
+        _fail(file, line);
+        return NULL;
+    }
+    return entry;
 }
 
 
-/* CheckParameterValue callback to check whether a value is equal to an
- * expected value. */
-static int check_value(const LargestIntegralType value,
-                       const LargestIntegralType check_value_data) {
-    return values_equal_display_error(value, check_value_data);
+/*
+ * Drop the tombstones of the registries, so the blocks freed by a test aren't
+ * reported as freed twice when libc reuses their address later.
+ */
+static void block_registry_drop_tombstones(void) {
+    size_t count;
+    MallocHeapShard * const shards = malloc_heap_shards(&count);
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        malloc_heap_lock(&shards[i]);
+        if (shards[i].registry.used > shards[i].registry.count) {
+            block_registry_rehash(&shards[i].registry);
+        }
+        malloc_heap_unlock(&shards[i]);
+    }
 }
 
 
-/* Add an event to check a parameter equals an expected value. */
-void _expect_value(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType value, const int count) {
-    _expect_check(function, parameter, file, line, check_value, value, NULL,
-                  count);
+/*
+ * Leave a tombstone for a block freed by test_free().  The registry of a
+ * thread spawned by the code under test is released along with its last
+ * block, so it doesn't outlive the thread.
+ */
+static void block_registry_remove(MallocHeapShard * const shard,
+                                  MallocBlockEntry * const entry,
+                                  const char * const file,
+                                  const int line) {
+    MallocBlockRegistry * const registry = &shard->registry;
+
+    entry->location = entry->block->location;
+    set_source_location(&entry->free_location, file, line);
+    entry->block = NULL;
+    registry->count--;
+    if (registry->count == 0 && !global_running_test &&
+        shard == &global_thread_heap) {
+        libc_free(registry->entries);
+        memset(registry, 0, sizeof(*registry));
+    }
 }
 
-
-/* CheckParameterValue callback to check whether a value is not equal to an
- * expected value. */
-static int check_not_value(const LargestIntegralType value,
-                           const LargestIntegralType check_value_data) {
-    return values_not_equal_display_error(value, check_value_data);
+/*
+ * Determine the size class plus one of a block with allocate_size bytes, 0
+ * if it's too large for the block pool.
+ */
+static size_t malloc_pool_class(const size_t allocate_size) {
+    const size_t pool_class =
+        (allocate_size + MALLOC_POOL_CLASS_SIZE - 1) / MALLOC_POOL_CLASS_SIZE;
+    return pool_class <= MALLOC_POOL_CLASSES ? pool_class : 0;
 }
 
 
-/* Add an event to check a parameter is not equal to an expected value. */
-void _expect_not_value(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const LargestIntegralType value, const int count) {
-    _expect_check(function, parameter, file, line, check_not_value, value,
-                  NULL, count);
+/* Allocate a cell of a size class from the block pool of the thread. */
+static void* malloc_pool_alloc(const size_t pool_class) {
+    MallocPool * const pool = &global_malloc_pool;
+    const size_t cell_size = pool_class * MALLOC_POOL_CLASS_SIZE;
+    void * const cell = pool->free_cells[pool_class - 1];
+    MallocPoolSlab *slab;
+
+    if (cell != NULL) {
+        pool->free_cells[pool_class - 1] = *(void **)cell;
+        return cell;
+    }
+    if (pool->slab_remaining < cell_size) {
+        /* The rest of the current slab is wasted. */
+        slab = (MallocPoolSlab*)libc_malloc(MALLOC_POOL_SLAB_SIZE);
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_next = (char *)slab + MALLOC_POOL_CLASS_SIZE;
+        pool->slab_remaining = MALLOC_POOL_SLAB_SIZE - MALLOC_POOL_CLASS_SIZE;
+    }
+    pool->slab_remaining -= cell_size;
+    pool->slab_next += cell_size;
+    return pool->slab_next - cell_size;
 }
 
 
-/* CheckParameterValue callback to check whether a parameter equals a string. */
-static int check_string(const LargestIntegralType value,
-                        const LargestIntegralType check_value_data) {
-    return string_equal_display_error(
-        cast_largest_integral_type_to_pointer(char*, value),
-        cast_largest_integral_type_to_pointer(char*, check_value_data));
+/* Put a cell back on the free list of its size class. */
+static void malloc_pool_free(void * const cell, const size_t pool_class) {
+    MallocPool * const pool = &global_malloc_pool;
+    *(void **)cell = pool->free_cells[pool_class - 1];
+    pool->free_cells[pool_class - 1] = cell;
 }
 
 
-/* Add an event to check whether a parameter is equal to a string. */
-void _expect_string(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line, const char* string,
-        const int count) {
-    declare_initialize_value_pointer_pointer(string_pointer,
-                                             discard_const(string));
-    _expect_check(function, parameter, file, line, check_string,
-                  string_pointer.value, NULL, count);
-}
+#ifdef CM_HAVE_BACKTRACE
+/*
+ * Find the entry of a backtrace in a stack depot, or add it.  Returns NULL
+ * once the depot is full.
+ */
+static const StackDepotEntry* stack_depot_add(StackDepot * const depot,
+                                              void * const * const frames,
+                                              const size_t depth) {
+    StackDepotEntry *entry;
+    size_t hash = depth;
+    size_t i;
 
+    for (i = 0; i < depth; i++) {
+        hash = hash * 31 + address_hash(frames[i]);
+    }
 
-/* CheckParameterValue callback to check whether a parameter is not equals to
- * a string. */
-static int check_not_string(const LargestIntegralType value,
-                            const LargestIntegralType check_value_data) {
-    return string_not_equal_display_error(
-        cast_largest_integral_type_to_pointer(char*, value),
-        cast_largest_integral_type_to_pointer(char*, check_value_data));
-}
+    if (depot->size > 0) {
+        for (entry = depot->buckets[hash & (depot->size - 1)];
+             entry != NULL; entry = entry->next) {
+            if (entry->hash == hash && entry->depth == depth &&
+                memcmp(entry->frames, frames, depth * sizeof(*frames)) == 0) {
+                return entry;
+            }
+        }
+    }
+    if (depot->count >= STACK_DEPOT_MAX_STACKS) {
+        return NULL;
+    }
 
+    /* Keep at most one entry per bucket on average. */
+    if (depot->count >= depot->size) {
+        const size_t size = depot->size > 0 ? depot->size * 2 :
+                                              STACK_DEPOT_INITIAL_SIZE;
+        StackDepotEntry ** const buckets =
+            (StackDepotEntry**)libc_calloc(size, sizeof(*buckets));
+        assert_non_null(buckets);
+        for (i = 0; i < depot->size; i++) {
+            entry = depot->buckets[i];
+            while (entry != NULL) {
+                StackDepotEntry * const next = entry->next;
+                entry->next = buckets[entry->hash & (size - 1)];
+                buckets[entry->hash & (size - 1)] = entry;
+                entry = next;
+            }
+        }
+        libc_free(depot->buckets);
+        depot->buckets = buckets;
+        depot->size = size;
+    }
 
-/* Add an event to check whether a parameter is not equal to a string. */
-void _expect_not_string(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line, const char* string,
-        const int count) {
-    declare_initialize_value_pointer_pointer(string_pointer,
-                                             discard_const(string));
-    _expect_check(function, parameter, file, line, check_not_string,
-                  string_pointer.value, NULL, count);
+    entry = (StackDepotEntry*)arena_alloc(&depot->arena, sizeof(*entry));
+    entry->frames = (void**)arena_alloc(&depot->arena,
+                                        depth * sizeof(*frames));
+    memcpy(entry->frames, frames, depth * sizeof(*frames));
+    entry->hash = hash;
+    entry->depth = depth;
+    entry->next = depot->buckets[hash & (depot->size - 1)];
+    depot->buckets[hash & (depot->size - 1)] = entry;
+    depot->count++;
+    return entry;
 }
 
-/* CheckParameterValue callback to check whether a parameter equals an area of
- * memory. */
-static int check_memory(const LargestIntegralType value,
-                        const LargestIntegralType check_value_data) {
-    CheckMemoryData * const check = cast_largest_integral_type_to_pointer(
-        CheckMemoryData*, check_value_data);
-    assert_non_null(check);
-    return memory_equal_display_error(
-        cast_largest_integral_type_to_pointer(const char*, value),
-        (const char*)check->memory, check->size);
-}
 
+/*
+ * Record the backtrace of the caller of the test_malloc() function which
+ * calls this one.  This must not be inlined to skip the right frames.
+ */
+static CM_NOINLINE const StackDepotEntry* capture_malloc_stack(void) {
+    void *frames[MALLOC_BACKTRACE_MAX_DEPTH + 2];
+    const StackDepotEntry *stack;
+    int depth;
 
-/* Create the callback data for check_memory() or check_not_memory() and
- * register a check event. */
-static void expect_memory_setup(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line,
-        const void * const memory, const size_t size,
-        const CheckParameterValue check_function, const int count) {
-    CheckMemoryData * const check_data =
-        (CheckMemoryData*)malloc(sizeof(*check_data) + size);
-    void * const mem = (void*)(check_data + 1);
-    declare_initialize_value_pointer_pointer(check_data_pointer, check_data);
-    assert_non_null(memory);
-    assert_true(size);
-    memcpy(mem, memory, size);
-    check_data->memory = mem;
-    check_data->size = size;
-    _expect_check(function, parameter, file, line, check_function,
-                  check_data_pointer.value, &check_data->event, count);
+    if (global_malloc_backtrace_depth == 0) {
+        return NULL;
+    }
+    depth = backtrace(frames, (int)global_malloc_backtrace_depth + 2);
+    if (depth <= 2) {
+        return NULL;
+    }
+    malloc_state_lock();
+    stack = stack_depot_add(global_shared_heap_active ?
+                            &global_shared_stack_depot : &global_stack_depot,
+                            frames + 2, (size_t)depth - 2);
+    malloc_state_unlock();
+    return stack;
 }
 
 
-/* Add an event to check whether a parameter matches an area of memory. */
-void _expect_memory(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line, const void* const memory,
-        const size_t size, const int count) {
-    expect_memory_setup(function, parameter, file, line, memory, size,
-                        check_memory, count);
-}
-
+/* Print the backtrace of an allocation. */
+static void print_malloc_stack(const StackDepotEntry * const stack) {
+    char ** const symbols = backtrace_symbols(stack->frames, (int)stack->depth);
+    size_t i;
 
-/* CheckParameterValue callback to check whether a parameter is not equal to
- * an area of memory. */
-static int check_not_memory(const LargestIntegralType value,
-                            const LargestIntegralType check_value_data) {
-    CheckMemoryData * const check = cast_largest_integral_type_to_pointer(
-        CheckMemoryData*, check_value_data);
-    assert_non_null(check);
-    return memory_not_equal_display_error(
-        cast_largest_integral_type_to_pointer(const char*, value),
-        (const char*)check->memory,
-        check->size);
+    for (i = 0; i < stack->depth; i++) {
+        if (symbols != NULL) {
+            cm_print_error("    #%lu %s\n", (unsigned long)i, symbols[i]);
+        } else {
+            cm_print_error("    #%lu %p\n", (unsigned long)i, stack->frames[i]);
+        }
+    }
+    libc_free(symbols);
 }
-
-
-/* Add an event to check whether a parameter doesn't match an area of memory. */
-void _expect_not_memory(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line, const void* const memory,
-        const size_t size, const int count) {
-    expect_memory_setup(function, parameter, file, line, memory, size,
-                        check_not_memory, count);
+#else /* CM_HAVE_BACKTRACE */
+static const StackDepotEntry* capture_malloc_stack(void) {
+    return NULL;
 }
 
 
-/* CheckParameterValue callback that always returns 1. */
-static int check_any(const LargestIntegralType value,
-                     const LargestIntegralType check_value_data) {
-    (void)value;
-    (void)check_value_data;
-    return 1;
+static void print_malloc_stack(const StackDepotEntry * const stack) {
+    (void)stack;
 }
+#endif /* CM_HAVE_BACKTRACE */
 
 
-/* Add an event to allow any value for a parameter. */
-void _expect_any(
-        const char* const function, const char* const parameter,
-        const char* const file, const int line, const int count) {
-    _expect_check(function, parameter, file, line, check_any, 0, NULL,
-                  count);
+/* Release the backtraces recorded in a stack depot. */
+static void release_stack_depot(StackDepot * const depot) {
+    libc_free(depot->buckets);
+    arena_release(&depot->arena);
+    memset(depot, 0, sizeof(*depot));
 }
 
 
-void _check_expected(
-        const char * const function_name, const char * const parameter_name,
-        const char* file, const int line, const LargestIntegralType value) {
-    void *result = NULL;
-    const char* symbols[] = {function_name, parameter_name};
-    const int rc = get_symbol_value(&global_function_parameter_map_head,
-                                    symbols, 2, &result);
-    if (rc) {
-        CheckParameterEvent * const check = (CheckParameterEvent*)result;
-        int check_succeeded;
-        global_last_parameter_location = check->location;
-        check_succeeded = check->check_value(value, check->check_value_data);
-        if (rc == 1) {
-            free(check);
-        }
-        if (!check_succeeded) {
-            cm_print_error(SOURCE_LOCATION_FORMAT
-                           ": error: Check of parameter %s, function %s failed\n"
-                           SOURCE_LOCATION_FORMAT
-                           ": note: Expected parameter declared here\n",
-                           file, line,
-                           parameter_name, function_name,
-                           global_last_parameter_location.file,
-                           global_last_parameter_location.line);
-            _fail(file, line);
-        }
-    } else {
-        cm_print_error(SOURCE_LOCATION_FORMAT ": error: Could not get value "
-                    "to check parameter %s of function %s\n", file, line,
-                    parameter_name, function_name);
-        if (source_location_is_set(&global_last_parameter_location)) {
-            cm_print_error(SOURCE_LOCATION_FORMAT
-                        ": note: Previously declared parameter value was declared here\n",
-                        global_last_parameter_location.file,
-                        global_last_parameter_location.line);
-        } else {
-            cm_print_error("There were no previously declared parameter values "
-                        "for this test.\n");
+/*
+ * Return the slabs of the block pool and the recorded backtraces to the
+ * system once all tests have been run, unless blocks allocated by the thread
+ * are still in use.  The backtraces of the shared heap are released once all
+ * of its blocks are freed.  The cached guard page mappings are unused and
+ * always released.
+ */
+static void release_malloc_pool(void) {
+    MallocPool * const pool = &global_malloc_pool;
+    MallocPoolSlab *slab = pool->slabs;
+    size_t i;
+
+    release_guard_page_cache();
+    for (i = 0; i < MALLOC_HEAP_SHARDS; i++) {
+        if (global_heap_shards[i].registry.count > 0) {
+            break;
         }
-        exit_test(1);
     }
+    if (i == MALLOC_HEAP_SHARDS) {
+        release_stack_depot(&global_shared_stack_depot);
+    }
+    if (global_thread_heap.registry.count > 0) {
+        return;
+    }
+    release_stack_depot(&global_stack_depot);
+    while (slab != NULL) {
+        MallocPoolSlab * const next = slab->next;
+        libc_free(slab);
+        slab = next;
+    }
+    memset(pool, 0, sizeof(*pool));
 }
 
-
-/* Replacement for assert. */
-void mock_assert(const int result, const char* const expression,
-                 const char* const file, const int line) {
-    if (!result) {
-        if (global_expecting_assert) {
-            global_last_failed_assert = expression;
-            longjmp(global_expect_assert_env, result);
-        } else {
-            cm_print_error("ASSERT: %s\n", expression);
-            _fail(file, line);
-        }
+/*
+ * Reset the allocation counters when a test starts.  Blocks which are still
+ * allocated, e.g. by a setup function, count towards the peaks.
+ */
+static void malloc_stats_start(void) {
+    MallocStats * const stats = get_malloc_stats();
+
+    malloc_state_lock();
+    stats->allocations = 0;
+    stats->frees = 0;
+    stats->allocated_bytes = 0;
+    stats->peak_bytes = stats->live_bytes;
+    stats->peak_blocks = stats->live_blocks;
+    memset(stats->size_histogram, 0, sizeof(stats->size_histogram));
+    malloc_state_unlock();
+    cmocka_memory_budget_begin();
+}
+
+
+/* Count an allocated block. */
+static void malloc_stats_add(const size_t size) {
+    MallocStats * const stats = get_malloc_stats();
+    MallocBudget * const budget = get_malloc_budget();
+    size_t bucket = 0;
+    size_t bits;
+
+    for (bits = size; bits != 0 && bucket < MALLOC_STATS_SIZE_BUCKETS - 1;
+         bits >>= 1) {
+        bucket++;
     }
+    malloc_state_lock();
+    stats->size_histogram[bucket]++;
+    stats->allocations++;
+    stats->allocated_bytes += size;
+    stats->live_bytes += size;
+    stats->live_blocks++;
+    if (stats->live_bytes > stats->peak_bytes) {
+        stats->peak_bytes = stats->live_bytes;
+    }
+    if (stats->live_blocks > stats->peak_blocks) {
+        stats->peak_blocks = stats->live_blocks;
+    }
+    if (!budget->closed && stats->live_bytes > budget->peak_bytes) {
+        budget->peak_bytes = stats->live_bytes;
+    }
+    malloc_state_unlock();
 }
 
 
-void _assert_true(const LargestIntegralType result,
-                  const char * const expression,
-                  const char * const file, const int line) {
-    if (!result) {
-        cm_print_error("%s\n", expression);
-        _fail(file, line);
-    }
+/* Count a freed block. */
+static void malloc_stats_remove(const size_t size) {
+    MallocStats * const stats = get_malloc_stats();
+
+    malloc_state_lock();
+    stats->frees++;
+    stats->live_bytes -= size;
+    stats->live_blocks--;
+    malloc_state_unlock();
 }
 
-void _assert_return_code(const LargestIntegralType result,
-                         size_t rlen,
-                         const LargestIntegralType error,
-                         const char * const expression,
-                         const char * const file,
-                         const int line)
+
+void cmocka_memory_budget_begin(void)
 {
-    LargestIntegralType valmax;
+    const MallocStats * const stats = get_malloc_stats();
+    MallocBudget * const budget = get_malloc_budget();
 
+    malloc_state_lock();
+    budget->closed = 0;
+    budget->allocations = stats->allocations;
+    budget->end_allocations = 0;
+    budget->base_bytes = stats->live_bytes;
+    budget->peak_bytes = stats->live_bytes;
+    malloc_state_unlock();
+}
 
-    switch (rlen) {
-    case 1:
-        valmax = 255;
-        break;
-    case 2:
-        valmax = 32767;
-        break;
-    case 4:
-        valmax = 2147483647;
-        break;
-    case 8:
-    default:
-        if (rlen > sizeof(valmax)) {
-            valmax = 2147483647;
-        } else {
-            valmax = 9223372036854775807L;
-        }
-        break;
+
+void cmocka_memory_budget_end(void)
+{
+    const MallocStats * const stats = get_malloc_stats();
+    MallocBudget * const budget = get_malloc_budget();
+
+    malloc_state_lock();
+    if (!budget->closed) {
+        budget->closed = 1;
+        budget->end_allocations = stats->allocations;
     }
+    malloc_state_unlock();
+}
 
-    if (result > valmax - 1) {
-        if (error > 0) {
-            cm_print_error("%s < 0, errno("
-                           LargestIntegralTypePrintfFormatDecimal "): %s\n",
-                           expression, error, strerror((int)error));
-        } else {
-            cm_print_error("%s < 0\n", expression);
-        }
+
+void _assert_max_allocations(const size_t maximum,
+                             const char * const file, const int line)
+{
+    const MallocStats * const stats = get_malloc_stats();
+    const MallocBudget * const budget = get_malloc_budget();
+    size_t allocations;
+
+    malloc_state_lock();
+    allocations = (budget->closed ? budget->end_allocations :
+                                    stats->allocations) -
+                  budget->allocations;
+    malloc_state_unlock();
+
+    if (allocations > maximum) {
+        cm_print_error("%lu allocation(s) exceed the budget of %lu\n",
+                       (unsigned long)allocations, (unsigned long)maximum);
         _fail(file, line);
     }
 }
 
-void _assert_float_equal(const float a,
-                         const float b,
-                         const float epsilon,
-                         const char * const file,
-                         const int line) {
-    if (!float_values_equal_display_error(a, b, epsilon)) {
+
+void _assert_max_peak_bytes(const size_t maximum,
+                            const char * const file, const int line)
+{
+    const MallocBudget * const budget = get_malloc_budget();
+    size_t peak_bytes;
+
+    malloc_state_lock();
+    peak_bytes = budget->peak_bytes - budget->base_bytes;
+    malloc_state_unlock();
+
+    if (peak_bytes > maximum) {
+        cm_print_error("Peak of %lu allocated bytes exceeds the budget of "
+                       "%lu\n",
+                       (unsigned long)peak_bytes, (unsigned long)maximum);
         _fail(file, line);
     }
 }
 
-void _assert_float_not_equal(const float a,
-                             const float b,
-                             const float epsilon,
-                             const char * const file,
-                             const int line) {
-    if (!float_values_not_equal_display_error(a, b, epsilon)) {
-        _fail(file, line);
+/*
+ * Determine the number of bytes a block can grow to without moving, up to
+ * its trailing guard block at the end of the underlying allocation.  A guard
+ * page block has to stay flush against its guard page and can't be resized.
+ */
+static size_t malloc_block_capacity(const struct MallocBlockInfoData * const data,
+                                    const char * const ptr) {
+    if (data->guard_pages != CM_MALLOC_GUARD_PAGES_NONE) {
+        return 0;
     }
+    return data->allocated_size - (size_t)(ptr - (const char *)data->block) -
+           data->trailing_guard_size;
 }
 
-void _assert_int_equal(
-        const LargestIntegralType a, const LargestIntegralType b,
-        const char * const file, const int line) {
-    if (!values_equal_display_error(a, b)) {
-        _fail(file, line);
+#ifdef CM_HAVE_GUARD_PAGES
+/* Get the size of a memory page. */
+static size_t guard_page_size(void) {
+    if (global_page_size == 0) {
+        const long page_size = sysconf(_SC_PAGESIZE);
+        global_page_size = page_size > 0 ? (size_t)page_size : 4096;
     }
+    return global_page_size;
 }
 
 
-void _assert_int_not_equal(
-        const LargestIntegralType a, const LargestIntegralType b,
-        const char * const file, const int line) {
-    if (!values_not_equal_display_error(a, b)) {
-        _fail(file, line);
+/*
+ * Map mapping_size bytes whose first and last pages are inaccessible, or
+ * reuse a cached mapping of the same size.
+ */
+static char* guard_page_mapping_alloc(const size_t mapping_size) {
+    MallocGuardPageCache * const cache = &global_guard_page_cache;
+    const size_t page_size = guard_page_size();
+    char *mapping;
+    size_t i;
+
+    for (i = cache->count; i > 0; i--) {
+        if (cache->sizes[i - 1] == mapping_size) {
+            mapping = cache->mappings[i - 1];
+            cache->count--;
+            cache->mappings[i - 1] = cache->mappings[cache->count];
+            cache->sizes[i - 1] = cache->sizes[cache->count];
+            return mapping;
+        }
+    }
+
+    mapping = (char *)mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == (char *)MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(mapping, page_size, PROT_NONE) != 0 ||
+        mprotect(mapping + mapping_size - page_size, page_size,
+                 PROT_NONE) != 0) {
+        munmap(mapping, mapping_size);
+        return NULL;
     }
+    return mapping;
 }
 
 
-void _assert_string_equal(const char * const a, const char * const b,
-                          const char * const file, const int line) {
-    if (!string_equal_display_error(a, b)) {
-        _fail(file, line);
+/*
+ * Keep the mapping of a freed guard page block for reuse.  The cache belongs
+ * to the thread, so it isn't used while the heap is shared.
+ */
+static void guard_page_mapping_free(char * const mapping,
+                                    const size_t mapping_size) {
+    MallocGuardPageCache * const cache = &global_guard_page_cache;
+    const size_t page_size = guard_page_size();
+
+    memset(mapping + page_size, MALLOC_FREE_PATTERN,
+           mapping_size - page_size * 2);
+    if (!global_shared_heap_active &&
+        cache->count < MALLOC_GUARD_PAGE_CACHE_SIZE) {
+        cache->mappings[cache->count] = mapping;
+        cache->sizes[cache->count] = mapping_size;
+        cache->count++;
+        return;
     }
+    munmap(mapping, mapping_size);
 }
 
 
-void _assert_string_not_equal(const char * const a, const char * const b,
-                              const char *file, const int line) {
-    if (!string_not_equal_display_error(a, b)) {
-        _fail(file, line);
+/* Unmap the cached guard page mappings of the thread. */
+static void release_guard_page_cache(void) {
+    MallocGuardPageCache * const cache = &global_guard_page_cache;
+    size_t i;
+
+    for (i = 0; i < cache->count; i++) {
+        munmap(cache->mappings[i], cache->sizes[i]);
     }
+    cache->count = 0;
 }
 
 
-void _assert_memory_equal(const void * const a, const void * const b,
-                          const size_t size, const char* const file,
-                          const int line) {
-    if (!memory_equal_display_error((const char*)a, (const char*)b, size)) {
-        _fail(file, line);
+/*
+ * Map a block of size bytes which ends right before the trailing guard page
+ * of its mapping, or starts right after the leading one in underflow mode.
+ * The header and the guard block are placed on the other side of the block.
+ * The block is aligned to alignment, which may leave a gap to the guard page.
+ * Returns the header of the block, NULL if the block can't be mapped.
+ */
+static struct MallocBlockInfoData* guard_page_block_alloc(
+    const size_t size, const size_t alignment, const size_t guard_size,
+    const enum cm_malloc_guard_pages mode) {
+    const size_t page_size = guard_page_size();
+    const size_t header_size = sizeof(struct MallocBlockInfoData);
+    size_t data_size = size + guard_size + header_size + alignment +
+                       MALLOC_ALIGNMENT;
+    size_t mapping_size;
+    MallocBlockInfo block_info;
+    char *mapping;
+    char *data;
+    char *ptr;
+
+    if (data_size < size) {
+        return NULL;
     }
+    data_size = (data_size + page_size - 1) & ~(page_size - 1);
+    mapping_size = data_size + page_size * 2;
+    mapping = guard_page_mapping_alloc(mapping_size);
+    if (mapping == NULL) {
+        return NULL;
+    }
+    data = mapping + page_size;
+
+    if (mode == CM_MALLOC_GUARD_PAGES_UNDERFLOW) {
+        ptr = (char *)(((size_t)data + alignment - 1) & ~(alignment - 1));
+        block_info.ptr = (char *)(((size_t)ptr + size + guard_size +
+                                   MALLOC_ALIGNMENT - 1) &
+                                  ~(MALLOC_ALIGNMENT - 1));
+        block_info.data->leading_guard_size = (size_t)(ptr - data);
+        block_info.data->trailing_guard_size =
+            (size_t)(block_info.ptr - (ptr + size));
+    } else {
+        /* The end of the block is only flush if size is aligned. */
+        ptr = (char *)(((size_t)data + data_size - size) &
+                       ~(alignment - 1));
+        block_info.ptr = (char *)(((size_t)ptr - guard_size - header_size) &
+                                  ~(MALLOC_ALIGNMENT - 1));
+        block_info.data->leading_guard_size =
+            (size_t)(ptr - (block_info.ptr + header_size));
+        block_info.data->trailing_guard_size =
+            (size_t)(data + data_size - (ptr + size));
+    }
+    block_info.data->block = mapping;
+    block_info.data->allocated_size = mapping_size;
+    block_info.data->pool_class = 0;
+    block_info.data->guard_pages = mode;
+    block_info.data->ptr = ptr;
+    return block_info.data;
 }
 
 
-void _assert_memory_not_equal(const void * const a, const void * const b,
-                              const size_t size, const char* const file,
-                              const int line) {
-    if (!memory_not_equal_display_error((const char*)a, (const char*)b,
-                                        size)) {
-        _fail(file, line);
+/*
+ * Print the allocated block whose guard page contains address, if any, when
+ * a test crashes.
+ */
+static void print_guard_page_access(const void * const address) {
+    size_t number_of_shards;
+    MallocHeapShard * const shards = malloc_heap_shards(&number_of_shards);
+    size_t i;
+
+    /* The shards aren't locked, the crashed thread may hold one. */
+    for (i = 0; i < number_of_shards; i++) {
+        const ListNode * const head = &shards[i].blocks;
+        const ListNode *node;
+
+        if (head->next == NULL) {
+            continue;
+        }
+        for (node = head->next; node != head; node = node->next) {
+            const MallocBlockInfo block_info = {
+                .ptr = discard_const(node->value),
+            };
+            const char * const mapping = (const char *)block_info.data->block;
+
+            if (block_info.data->guard_pages != CM_MALLOC_GUARD_PAGES_NONE &&
+                (const char *)address >= mapping &&
+                (const char *)address <
+                    mapping + block_info.data->allocated_size) {
+                cm_print_error("error: Guard page of %p size=%lu was "
+                               "accessed at %p\n"
+                               SOURCE_LOCATION_FORMAT
+                               ": note: allocated here\n",
+                               (void *)block_info.data->ptr,
+                               (unsigned long)block_info.data->size,
+                               address,
+                               block_info.data->location.file,
+                               block_info.data->location.line);
+                return;
+            }
+        }
     }
 }
+#else /* CM_HAVE_GUARD_PAGES */
+static void release_guard_page_cache(void) {
+}
+#endif /* CM_HAVE_GUARD_PAGES */
 
 
-void _assert_in_range(
-        const LargestIntegralType value, const LargestIntegralType minimum,
-        const LargestIntegralType maximum, const char* const file,
-        const int line) {
-    if (!integer_in_range_display_error(value, minimum, maximum)) {
-        _fail(file, line);
+/*
+ * Find the first byte of a guard block or a freed block which doesn't match
+ * its fill pattern, NULL if the memory is intact.  The memory is compared a
+ * word at a time, bytes are only compared to locate the corrupt one.
+ */
+static const char* find_corrupt_byte(const char * const memory,
+                                     const size_t size,
+                                     const unsigned char fill) {
+    const uint64_t pattern = UINT64_C(0x0101010101010101) * fill;
+    size_t i;
+
+    for (i = 0; i + sizeof(pattern) <= size; i += sizeof(pattern)) {
+        uint64_t word;
+        memcpy(&word, memory + i, sizeof(word));
+        if (word != pattern) {
+            break;
+        }
+    }
+    for (; i < size; i++) {
+        if ((unsigned char)memory[i] != fill) {
+            return memory + i;
+        }
     }
+    return NULL;
 }
 
-void _assert_not_in_range(
-        const LargestIntegralType value, const LargestIntegralType minimum,
-        const LargestIntegralType maximum, const char* const file,
-        const int line) {
-    if (!integer_not_in_range_display_error(value, minimum, maximum)) {
-        _fail(file, line);
+
+/* Fail the test if the guard blocks around an allocated block are corrupt. */
+static void check_guard_blocks(const MallocBlockInfo block_info,
+                               char * const ptr,
+                               const char * const file, const int line) {
+    char *guards[2] = {ptr - block_info.data->leading_guard_size,
+                       ptr + block_info.data->size};
+    const size_t guard_sizes[2] = {block_info.data->leading_guard_size,
+                                   block_info.data->trailing_guard_size};
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(guards); i++) {
+        const char * const corrupt = find_corrupt_byte(guards[i],
+                                                       guard_sizes[i],
+                                                       MALLOC_GUARD_PATTERN);
+        if (corrupt != NULL) {
+            cm_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Guard block of %p size=%lu is corrupt\n"
+                           SOURCE_LOCATION_FORMAT ": note: allocated here at %p\n",
+                           file,
+                           line,
+                           (void *)ptr,
+                           (unsigned long)block_info.data->size,
+                           block_info.data->location.file,
+                           block_info.data->location.line,
+                           (const void *)corrupt);
+            global_memory_errors++;
+            _fail(file, line);
+        }
     }
 }
 
-void _assert_in_set(const LargestIntegralType value,
-                    const LargestIntegralType values[],
-                    const size_t number_of_values, const char* const file,
-                    const int line) {
-    CheckIntegerSet check_integer_set;
-    check_integer_set.set = values;
-    check_integer_set.size_of_set = number_of_values;
-    if (!value_in_set_display_error(value, &check_integer_set, 0)) {
-        _fail(file, line);
+/*
+ * Count an allocation of the test function during an allocation failure
+ * sweep.  Returns 1 if it's the allocation which has to fail.
+ */
+static int malloc_fail_injected(const char * const file, const int line) {
+    if (!global_malloc_fail_counting) {
+        return 0;
+    }
+    if (++global_malloc_fail_count != global_malloc_fail_at) {
+        return 0;
     }
+    set_source_location(&global_malloc_fail_location, file, line);
+    return 1;
 }
 
-void _assert_not_in_set(const LargestIntegralType value,
-                        const LargestIntegralType values[],
-                        const size_t number_of_values, const char* const file,
-                        const int line) {
-    CheckIntegerSet check_integer_set;
-    check_integer_set.set = values;
-    check_integer_set.size_of_set = number_of_values;
-    if (!value_in_set_display_error(value, &check_integer_set, 1)) {
-        _fail(file, line);
+/* Use the real malloc in this function. */
+#undef malloc
+/*
+ * Allocate a block of size bytes which can be resized in place up to
+ * capacity bytes by test_realloc().  The block is aligned to alignment, a
+ * power of two of at least MALLOC_ALIGNMENT.  stack is the backtrace of the
+ * allocation, if it's recorded.
+ */
+static void* test_malloc_block(const size_t size, const size_t capacity,
+                               const size_t alignment,
+                               const StackDepotEntry * const stack,
+                               const char* file, const int line) {
+    char *ptr = NULL;
+    MallocBlockInfo block_info;
+    MallocHeapShard *shard;
+    size_t allocate_size;
+    size_t pool_class = 0;
+    const size_t guard_size = global_malloc_guard_size;
+    char *block = NULL;
+
+    allocate_size = capacity + (guard_size * 2) +
+                    sizeof(struct MallocBlockInfoData) + alignment;
+    assert_true(capacity >= size && allocate_size > capacity);
+
+#ifdef CM_HAVE_GUARD_PAGES
+    if (global_malloc_guard_pages_active != CM_MALLOC_GUARD_PAGES_NONE) {
+        block_info.data = guard_page_block_alloc(
+            size, alignment, guard_size, global_malloc_guard_pages_active);
+        assert_non_null(block_info.data);
+        ptr = block_info.data->ptr;
+    } else
+#endif
+    {
+        if (global_malloc_pool_active) {
+            pool_class = malloc_pool_class(allocate_size);
+        }
+        if (pool_class > 0) {
+            allocate_size = pool_class * MALLOC_POOL_CLASS_SIZE;
+            block = (char *)malloc_pool_alloc(pool_class);
+        } else {
+            block = (char *)libc_malloc(allocate_size);
+        }
+        assert_non_null(block);
+
+        /* Calculate the returned address. */
+        ptr = (char*)(((size_t)block + guard_size +
+                      sizeof(struct MallocBlockInfoData) +
+                      alignment) & ~(alignment - 1));
+
+        block_info.ptr = ptr - (guard_size +
+                                sizeof(struct MallocBlockInfoData));
+        block_info.data->allocated_size = allocate_size;
+        block_info.data->pool_class = pool_class;
+        block_info.data->guard_pages = CM_MALLOC_GUARD_PAGES_NONE;
+        block_info.data->ptr = ptr;
+        block_info.data->leading_guard_size = guard_size;
+        block_info.data->trailing_guard_size = guard_size;
+        block_info.data->block = block;
     }
+
+    /* Initialize the guard blocks. */
+    memset(ptr - block_info.data->leading_guard_size, MALLOC_GUARD_PATTERN,
+           block_info.data->leading_guard_size);
+    memset(ptr + size, MALLOC_GUARD_PATTERN,
+           block_info.data->trailing_guard_size);
+    memset(ptr, MALLOC_ALLOC_PATTERN, size);
+
+    set_source_location(&block_info.data->location, file, line);
+    block_info.data->stack = stack;
+    block_info.data->size = size;
+    block_info.data->node.value = block_info.ptr;
+
+    shard = malloc_heap_shard(ptr);
+    malloc_heap_lock(shard);
+    block_info.data->serial = malloc_heap_next_serial(shard);
+    list_add(&shard->blocks, &block_info.data->node);
+    block_registry_add(shard, ptr, block_info.data);
+    malloc_heap_unlock(shard);
+
+    malloc_stats_add(size);
+    return ptr;
 }
+#define malloc test_malloc
 
 
-/* Get the list of allocated blocks. */
-static ListNode* get_allocated_blocks_list(void) {
-    /* If it initialized, initialize the list of allocated blocks. */
-    if (!global_allocated_blocks.value) {
-        list_initialize(&global_allocated_blocks);
-        global_allocated_blocks.value = (void*)1;
+void* _test_malloc(const size_t size, const char* file, const int line) {
+    if (malloc_fail_injected(file, line)) {
+        return NULL;
     }
-    return &global_allocated_blocks;
+    return test_malloc_block(size, size, MALLOC_ALIGNMENT,
+                             capture_malloc_stack(), file, line);
 }
 
-static void *libc_calloc(size_t nmemb, size_t size)
-{
-#undef calloc
-    return calloc(nmemb, size);
+
+void* _test_calloc(const size_t number_of_elements, const size_t size,
+                   const char* file, const int line) {
+    void* ptr;
+
+    if (malloc_fail_injected(file, line)) {
+        return NULL;
+    }
+    ptr = test_malloc_block(number_of_elements * size,
+                            number_of_elements * size,
+                            MALLOC_ALIGNMENT,
+                            capture_malloc_stack(), file, line);
+    if (ptr) {
+        memset(ptr, 0, number_of_elements * size);
+    }
+    return ptr;
+}
 #define calloc test_calloc
+
+
+/*
+ * Allocate a block aligned to alignment, which must be a power of two.
+ * Returns NULL and sets errno to EINVAL if it isn't.
+ */
+static void* test_aligned_block(const size_t alignment, const size_t size,
+                                const StackDepotEntry * const stack,
+                                const char* file, const int line) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (malloc_fail_injected(file, line)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return test_malloc_block(size, size,
+                             alignment > MALLOC_ALIGNMENT ? alignment :
+                                                            MALLOC_ALIGNMENT,
+                             stack, file, line);
 }
 
-static void libc_free(void *ptr)
-{
-#undef free
-    free(ptr);
-#define free test_free
+
+void* _test_aligned_alloc(const size_t alignment, const size_t size,
+                          const char* file, const int line) {
+    return test_aligned_block(alignment, size, capture_malloc_stack(),
+                              file, line);
 }
 
-static void *libc_realloc(void *ptr, size_t size)
-{
-#undef realloc
-    return realloc(ptr, size);
-#define realloc test_realloc
+
+void* _test_memalign(const size_t alignment, const size_t size,
+                     const char* file, const int line) {
+    return test_aligned_block(alignment, size, capture_malloc_stack(),
+                              file, line);
 }
 
-static void vcm_print_error(const char* const format,
-                            va_list args) CMOCKA_PRINTF_ATTRIBUTE(1, 0);
 
-/* It's important to use the libc malloc and free here otherwise
- * the automatic free of leaked blocks can reap the error messages
- */
-static void vcm_print_error(const char* const format, va_list args)
-{
-    char buffer[1024];
-    size_t msg_len = 0;
-    va_list ap;
-    int len;
-    va_copy(ap, args);
+int _test_posix_memalign(void** memptr, const size_t alignment,
+                         const size_t size, const char* file, const int line) {
+    const StackDepotEntry * const stack = capture_malloc_stack();
+    void *ptr;
 
-    len = vsnprintf(buffer, sizeof(buffer), format, args);
-    if (len < 0) {
-        /* TODO */
-        goto end;
+    if (alignment % sizeof(void*) != 0) {
+        return EINVAL;
     }
+    ptr = test_aligned_block(alignment, size, stack, file, line);
+    if (ptr == NULL) {
+        return errno;
+    }
+    *memptr = ptr;
+    return 0;
+}
 
-    if (cm_error_message == NULL) {
-        /* CREATE MESSAGE */
-
-        cm_error_message = libc_calloc(1, len + 1);
-        if (cm_error_message == NULL) {
-            /* TODO */
-            goto end;
-        }
-    } else {
-        /* APPEND MESSAGE */
-        char *tmp;
 
-        msg_len = strlen(cm_error_message);
-        tmp = libc_realloc(cm_error_message, msg_len + len + 1);
-        if (tmp == NULL) {
-            goto end;
-        }
-        cm_error_message = tmp;
+/* Use the real free in these functions. */
+#undef free
+/* Return the memory of a freed block to where it was allocated from. */
+static void release_malloc_block(struct MallocBlockInfoData * const data) {
+    char * const block = (char *)data->block;
+    const size_t pool_class = data->pool_class;
+
+#ifdef CM_HAVE_GUARD_PAGES
+    if (data->guard_pages != CM_MALLOC_GUARD_PAGES_NONE) {
+        guard_page_mapping_free(block, data->allocated_size);
+        return;
     }
-
-    if (((size_t)len) < sizeof(buffer)) {
-        /* Use len + 1 to also copy '\0' */
-        memcpy(cm_error_message + msg_len, buffer, len + 1);
+#endif
+    memset(block, MALLOC_FREE_PATTERN, data->allocated_size);
+    if (pool_class > 0) {
+        malloc_pool_free(block, pool_class);
     } else {
-        vsnprintf(cm_error_message + msg_len, len, format, ap);
+        libc_free(block);
     }
-end:
-    va_end(ap);
-
 }
 
-static void vcm_free_error(char *err_msg)
-{
-    libc_free(err_msg);
+
+/*
+ * Get the quarantine of freed blocks of the thread, or the one of the shared
+ * heap which is protected by malloc_state_lock().
+ */
+static MallocQuarantine* get_malloc_quarantine(void) {
+    MallocQuarantine * const quarantine =
+        global_shared_heap_active ? &global_shared_malloc_quarantine :
+                                    &global_malloc_quarantine;
+    if (quarantine->blocks.next == NULL) {
+        list_initialize(&quarantine->blocks);
+    }
+    return quarantine;
 }
 
-/* Use the real malloc in this function. */
-#undef malloc
-void* _test_malloc(const size_t size, const char* file, const int line) {
-    char *ptr = NULL;
-    MallocBlockInfo block_info;
-    ListNode * const block_list = get_allocated_blocks_list();
-    size_t allocate_size;
-    char *block = NULL;
 
-    allocate_size = size + (MALLOC_GUARD_SIZE * 2) +
-                    sizeof(struct MallocBlockInfoData) + MALLOC_ALIGNMENT;
-    assert_true(allocate_size > size);
+/*
+ * Check that a quarantined block still holds the free pattern from the start
+ * of its leading guard block to the end of its trailing one.  Returns 1 and
+ * reports the range which was written to if it doesn't.
+ */
+static int check_quarantined_block(const struct MallocBlockInfoData * const data) {
+    const char * const start = data->ptr - data->leading_guard_size;
+    const size_t size = data->leading_guard_size + data->size +
+                        data->trailing_guard_size;
+    const char * const first = find_corrupt_byte(start, size,
+                                                 MALLOC_FREE_PATTERN);
+    const char *last = start + size - 1;
+
+    if (first == NULL) {
+        return 0;
+    }
+    while ((unsigned char)*last == MALLOC_FREE_PATTERN) {
+        last--;
+    }
+    cm_print_error("error: Freed block %p size=%lu was written to from offset "
+                   "%ld to %ld\n"
+                   SOURCE_LOCATION_FORMAT ": note: freed here\n"
+                   SOURCE_LOCATION_FORMAT ": note: allocated here\n",
+                   (void *)data->ptr,
+                   (unsigned long)data->size,
+                   (long)(first - data->ptr),
+                   (long)(last - data->ptr),
+                   data->free_location.file,
+                   data->free_location.line,
+                   data->location.file,
+                   data->location.line);
+    return 1;
+}
+
 
-    block = (char *)malloc(allocate_size);
-    assert_non_null(block);
+/*
+ * Release the oldest quarantined block.  Returns 1 if it was written to
+ * after it was freed.
+ */
+static int malloc_quarantine_evict(MallocQuarantine * const quarantine) {
+    ListNode * const node = quarantine->blocks.next;
+    struct MallocBlockInfoData * const data =
+        (struct MallocBlockInfoData *)discard_const(node->value);
+    int corrupt;
 
-    /* Calculate the returned address. */
-    ptr = (char*)(((size_t)block + MALLOC_GUARD_SIZE +
-                  sizeof(struct MallocBlockInfoData) +
-                  MALLOC_ALIGNMENT) & ~(MALLOC_ALIGNMENT - 1));
+    list_remove(node, NULL, NULL);
+    quarantine->size -= data->allocated_size;
+    corrupt = check_quarantined_block(data);
+    release_malloc_block(data);
+    return corrupt;
+}
 
-    /* Initialize the guard blocks. */
-    memset(ptr - MALLOC_GUARD_SIZE, MALLOC_GUARD_PATTERN, MALLOC_GUARD_SIZE);
-    memset(ptr + size, MALLOC_GUARD_PATTERN, MALLOC_GUARD_SIZE);
-    memset(ptr, MALLOC_ALLOC_PATTERN, size);
 
-    block_info.ptr = ptr - (MALLOC_GUARD_SIZE +
-                            sizeof(struct MallocBlockInfoData));
-    set_source_location(&block_info.data->location, file, line);
-    block_info.data->allocated_size = allocate_size;
-    block_info.data->size = size;
-    block_info.data->block = block;
-    block_info.data->node.value = block_info.ptr;
-    list_add(block_list, &block_info.data->node);
-    return ptr;
+/*
+ * Quarantine a freed block, evicting the oldest blocks once the quarantine
+ * exceeds its size.  Fails the test if an evicted block was written to.
+ */
+static void malloc_quarantine_add(struct MallocBlockInfoData * const data,
+                                  const char * const file, const int line) {
+    MallocQuarantine * const quarantine = get_malloc_quarantine();
+    int corrupt = 0;
+
+    memset(data->ptr - data->leading_guard_size, MALLOC_FREE_PATTERN,
+           data->leading_guard_size + data->size + data->trailing_guard_size);
+    set_source_location(&data->free_location, file, line);
+    data->node.value = data;
+
+    malloc_state_lock();
+    list_add(&quarantine->blocks, &data->node);
+    quarantine->size += data->allocated_size;
+
+    while (quarantine->size > global_malloc_quarantine_size) {
+        corrupt |= malloc_quarantine_evict(quarantine);
+    }
+    malloc_state_unlock();
+    if (corrupt) {
+        global_memory_errors++;
+        exit_test(1);
+    }
 }
-#define malloc test_malloc
 
 
-void* _test_calloc(const size_t number_of_elements, const size_t size,
-                   const char* file, const int line) {
-    void* const ptr = _test_malloc(number_of_elements * size, file, line);
-    if (ptr) {
-        memset(ptr, 0, number_of_elements * size);
+/*
+ * Release all quarantined blocks.  Returns the number of blocks which were
+ * written to after they were freed.
+ */
+static size_t drain_malloc_quarantine(void) {
+    MallocQuarantine * const quarantine = get_malloc_quarantine();
+    size_t corrupt_blocks = 0;
+
+    malloc_state_lock();
+    while (!list_empty(&quarantine->blocks)) {
+        corrupt_blocks += (size_t)malloc_quarantine_evict(quarantine);
     }
-    return ptr;
+    malloc_state_unlock();
+    return corrupt_blocks;
 }
-#define calloc test_calloc
 
 
-/* Use the real free in this function. */
-#undef free
 void _test_free(void* const ptr, const char* file, const int line) {
-    unsigned int i;
     char *block = discard_const_p(char, ptr);
     MallocBlockInfo block_info;
+    MallocHeapShard *shard;
+    MallocBlockEntry *entry;
 
     if (ptr == NULL) {
         return;
     }
 
-    _assert_true(cast_ptr_to_largest_integral_type(ptr), "ptr", file, line);
-    block_info.ptr = block - (MALLOC_GUARD_SIZE +
-                              sizeof(struct MallocBlockInfoData));
-    /* Check the guard blocks. */
-    {
-        char *guards[2] = {block - MALLOC_GUARD_SIZE,
-                           block + block_info.data->size};
-        for (i = 0; i < ARRAY_SIZE(guards); i++) {
-            unsigned int j;
-            char * const guard = guards[i];
-            for (j = 0; j < MALLOC_GUARD_SIZE; j++) {
-                const char diff = guard[j] - MALLOC_GUARD_PATTERN;
-                if (diff) {
-                    cm_print_error(SOURCE_LOCATION_FORMAT
-                                   ": error: Guard block of %p size=%lu is corrupt\n"
-                                   SOURCE_LOCATION_FORMAT ": note: allocated here at %p\n",
-                                   file,
-                                   line,
-                                   ptr,
-                                   (unsigned long)block_info.data->size,
-                                   block_info.data->location.file,
-                                   block_info.data->location.line,
-                                   (void *)&guard[j]);
-                    _fail(file, line);
-                }
-            }
-        }
+    shard = malloc_heap_shard(ptr);
+    malloc_heap_lock(shard);
+    entry = block_registry_find(shard, ptr, file, line);
+    if (entry == NULL) {
+        malloc_heap_unlock(shard);
+        return;
     }
+    block_info.data = entry->block;
+    check_guard_blocks(block_info, block, file, line);
     list_remove(&block_info.data->node, NULL, NULL);
+    block_registry_remove(shard, entry, file, line);
+    malloc_heap_unlock(shard);
+    malloc_stats_remove(block_info.data->size);
 
-    block = discard_const_p(char, block_info.data->block);
-    memset(block, MALLOC_FREE_PATTERN, block_info.data->allocated_size);
-    free(block);
+    if (global_malloc_quarantine_size > 0) {
+        malloc_quarantine_add(block_info.data, file, line);
+    } else {
+        release_malloc_block(block_info.data);
+    }
 }
 #define free test_free
 
@@ -2081,13 +5056,21 @@ void *_test_realloc(void *ptr,
                    const char *file,
                    const int line)
 {
+    const StackDepotEntry * const stack = capture_malloc_stack();
     MallocBlockInfo block_info;
-    char *block = ptr;
+    MallocHeapShard *shard;
+    MallocBlockEntry *entry;
+    size_t old_size;
     size_t block_size = size;
+    size_t capacity = size;
     void *new_block;
 
     if (ptr == NULL) {
-        return _test_malloc(size, file, line);
+        if (malloc_fail_injected(file, line)) {
+            return NULL;
+        }
+        return test_malloc_block(size, size, MALLOC_ALIGNMENT, stack,
+                                 file, line);
     }
 
     if (size == 0) {
@@ -2095,16 +5078,54 @@ void *_test_realloc(void *ptr,
         return NULL;
     }
 
-    block_info.ptr = block - (MALLOC_GUARD_SIZE +
-                              sizeof(struct MallocBlockInfoData));
+    shard = malloc_heap_shard(ptr);
+    malloc_heap_lock(shard);
+    entry = block_registry_find(shard, ptr, file, line);
+    if (entry == NULL) {
+        malloc_heap_unlock(shard);
+        return NULL;
+    }
+    if (malloc_fail_injected(file, line)) {
+        malloc_heap_unlock(shard);
+        return NULL;
+    }
+    block_info.data = entry->block;
+    old_size = block_info.data->size;
+
+    if (!global_realloc_move_active &&
+        size <= malloc_block_capacity(block_info.data, (char *)ptr)) {
+        /* Resize in place, only the new bytes and the guard are written. */
+        check_guard_blocks(block_info, (char *)ptr, file, line);
+        if (size > block_info.data->size) {
+            memset((char *)ptr + block_info.data->size, MALLOC_ALLOC_PATTERN,
+                   size - block_info.data->size);
+        }
+        memset((char *)ptr + size, MALLOC_GUARD_PATTERN,
+               block_info.data->trailing_guard_size);
+        block_info.data->size = size;
+        set_source_location(&block_info.data->location, file, line);
+        block_info.data->stack = stack;
+        malloc_heap_unlock(shard);
+        /* Counted like a moved block, as a free and an allocation. */
+        malloc_stats_remove(old_size);
+        malloc_stats_add(size);
+        return ptr;
+    }
+    malloc_heap_unlock(shard);
 
-    new_block = _test_malloc(size, file, line);
+    /* Leave room for growing a block in place the next time. */
+    if (!global_realloc_move_active && size > old_size &&
+        size + size / 2 > size) {
+        capacity = size + size / 2;
+    }
+    new_block = test_malloc_block(size, capacity, MALLOC_ALIGNMENT, stack,
+                                  file, line);
     if (new_block == NULL) {
         return NULL;
     }
 
-    if (block_info.data->size < size) {
-        block_size = block_info.data->size;
+    if (old_size < size) {
+        block_size = old_size;
     }
 
     memcpy(new_block, ptr, block_size);
@@ -2116,69 +5137,333 @@ void *_test_realloc(void *ptr,
 }
 #define realloc test_realloc
 
-/* Crudely checkpoint the current heap state. */
-static const ListNode* check_point_allocated_blocks(void) {
-    return get_allocated_blocks_list()->prev;
+#ifdef CM_HAVE_MALLOC_WRAP
+/*
+ * Determine whether the wrapped allocation functions track the blocks
+ * allocated by this thread: while it runs a test, unless the allocation is
+ * made by a wrapped function already.
+ */
+static int malloc_wrapper_tracking(void) {
+    return global_running_test && !global_malloc_wrapper_active;
+}
+
+
+/*
+ * Determine whether ptr is a block allocated by test_malloc(), including one
+ * freed by the running test so freeing it again is reported.  Outside of a
+ * test libc may have handed out the address of a freed block again.
+ */
+static int malloc_block_tracked(const void * const ptr) {
+    MallocHeapShard * const shard = malloc_heap_shard(ptr);
+    const MallocBlockEntry *entry = NULL;
+    int tracked;
+
+    malloc_heap_lock(shard);
+    if (shard->registry.size > 0) {
+        entry = block_registry_slot(shard->registry.entries,
+                                    shard->registry.size, ptr);
+    }
+    tracked = entry != NULL &&
+              (entry->block != NULL ||
+               (entry->ptr != NULL && global_running_test));
+    malloc_heap_unlock(shard);
+    return tracked;
+}
+
+
+/*
+ * Allocation functions called instead of the ones of libc by code linked
+ * with -Wl,--wrap=malloc and so on.  The blocks allocated while a test runs
+ * are tracked like the ones of test_malloc(), all other calls go straight to
+ * libc.
+ */
+void *__wrap_malloc(size_t size) {
+    void *ptr;
+
+    if (!malloc_wrapper_tracking()) {
+        return libc_malloc(size);
+    }
+    global_malloc_wrapper_active = 1;
+    ptr = _test_malloc(size, "malloc", 0);
+    global_malloc_wrapper_active = 0;
+    return ptr;
+}
+
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    void *ptr;
+
+    if (!malloc_wrapper_tracking()) {
+        return libc_calloc(nmemb, size);
+    }
+    global_malloc_wrapper_active = 1;
+    ptr = _test_calloc(nmemb, size, "calloc", 0);
+    global_malloc_wrapper_active = 0;
+    return ptr;
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    void *new_ptr;
+
+    if (global_malloc_wrapper_active ||
+        (ptr == NULL && !global_running_test) ||
+        (ptr != NULL && !malloc_block_tracked(ptr))) {
+        return libc_realloc(ptr, size);
+    }
+    global_malloc_wrapper_active = 1;
+    new_ptr = _test_realloc(ptr, size, "realloc", 0);
+    global_malloc_wrapper_active = 0;
+    return new_ptr;
+}
+
+
+void __wrap_free(void *ptr) {
+    if (global_malloc_wrapper_active || ptr == NULL ||
+        !malloc_block_tracked(ptr)) {
+        libc_free(ptr);
+        return;
+    }
+    global_malloc_wrapper_active = 1;
+    _test_free(ptr, "free", 0);
+    global_malloc_wrapper_active = 0;
+}
+
+
+char *__wrap_strdup(const char *s) {
+    const size_t size = strlen(s) + 1;
+    char *str;
+
+    if (!malloc_wrapper_tracking()) {
+        str = (char *)libc_malloc(size);
+    } else {
+        global_malloc_wrapper_active = 1;
+        str = (char *)_test_malloc(size, "strdup", 0);
+        global_malloc_wrapper_active = 0;
+    }
+    if (str != NULL) {
+        memcpy(str, s, size);
+    }
+    return str;
+}
+#endif /* CM_HAVE_MALLOC_WRAP */
+
+/*
+ * Checkpoint the current heap state: the serial of the last allocated block.
+ * Blocks which are allocated later have a higher serial.
+ */
+static size_t check_point_allocated_blocks(void) {
+    if (global_shared_heap_active) {
+        return global_shared_heap_serial;
+    }
+    return global_thread_heap.serial;
 }
 
 
-/* Display the blocks allocated after the specified check point.  This
- * function returns the number of blocks displayed. */
-static size_t display_allocated_blocks(const ListNode * const check_point) {
-    const ListNode * const head = get_allocated_blocks_list();
-    const ListNode *node;
+/* Order blocks by their serial. */
+static int compare_block_serials(const void *a, const void *b) {
+    const size_t serial_a = (*(struct MallocBlockInfoData * const *)a)->serial;
+    const size_t serial_b = (*(struct MallocBlockInfoData * const *)b)->serial;
+    return serial_a < serial_b ? -1 : serial_a > serial_b;
+}
+
+
+/*
+ * Collect the blocks allocated after the specified check point in allocation
+ * order.  The blocks of each shard are listed in allocation order, so only
+ * the blocks after the check point are visited.  Returns the number of
+ * blocks, the array is freed with libc_free().
+ */
+static size_t collect_allocated_blocks(const size_t check_point,
+                                       struct MallocBlockInfoData ***blocks) {
+    size_t number_of_shards;
+    MallocHeapShard * const shards = malloc_heap_shards(&number_of_shards);
     size_t allocated_blocks = 0;
-    assert_non_null(check_point);
-    assert_non_null(check_point->next);
+    size_t size = 0;
+    size_t i;
 
-    for (node = check_point->next; node != head; node = node->next) {
-        const MallocBlockInfo block_info = {
-            .ptr = discard_const(node->value),
-        };
-        assert_non_null(block_info.ptr);
+    *blocks = NULL;
+    for (i = 0; i < number_of_shards; i++) {
+        MallocHeapShard * const shard = &shards[i];
+        const ListNode *node;
+
+        malloc_heap_lock(shard);
+        for (node = shard->blocks.prev; node != &shard->blocks;
+             node = node->prev) {
+            const MallocBlockInfo block_info = {
+                .ptr = discard_const(node->value),
+            };
+            assert_non_null(block_info.ptr);
 
-        if (allocated_blocks == 0) {
-            cm_print_error("Blocks allocated...\n");
+            if (block_info.data->serial <= check_point) {
+                break;
+            }
+            if (allocated_blocks == size) {
+                size = size > 0 ? size * 2 : 16;
+                *blocks = (struct MallocBlockInfoData**)libc_realloc(
+                    *blocks, size * sizeof(**blocks));
+                assert_non_null(*blocks);
+            }
+            (*blocks)[allocated_blocks++] = block_info.data;
         }
-        cm_print_error(SOURCE_LOCATION_FORMAT ": note: block %p allocated here\n",
-                       block_info.data->location.file,
-                       block_info.data->location.line,
-                       block_info.data->block);
-        allocated_blocks++;
+        malloc_heap_unlock(shard);
+    }
+    if (allocated_blocks > 1) {
+        qsort(*blocks, allocated_blocks, sizeof(**blocks),
+              compare_block_serials);
     }
     return allocated_blocks;
 }
 
 
-/* Free all blocks allocated after the specified check point. */
-static void free_allocated_blocks(const ListNode * const check_point) {
-    const ListNode * const head = get_allocated_blocks_list();
-    const ListNode *node;
-    assert_non_null(check_point);
+/* Order blocks by their backtrace. */
+static int compare_block_stacks(const void *a, const void *b) {
+    const uintptr_t stack_a = (uintptr_t)
+        (*(struct MallocBlockInfoData * const *)a)->stack;
+    const uintptr_t stack_b = (uintptr_t)
+        (*(struct MallocBlockInfoData * const *)b)->stack;
+    return stack_a < stack_b ? -1 : stack_a > stack_b;
+}
+
+
+/*
+ * Display the blocks allocated with a backtrace, grouped by their backtrace
+ * so blocks leaked by the same call stack are reported once.
+ */
+static void display_allocated_stacks(
+    struct MallocBlockInfoData * const * const allocated_blocks,
+    const size_t number_of_blocks) {
+    struct MallocBlockInfoData **blocks;
+    size_t count = 0;
+    size_t i;
+
+    blocks = (struct MallocBlockInfoData**)libc_malloc(
+        number_of_blocks * sizeof(*blocks));
+    assert_non_null(blocks);
+    for (i = 0; i < number_of_blocks; i++) {
+        if (allocated_blocks[i]->stack != NULL) {
+            blocks[count++] = allocated_blocks[i];
+        }
+    }
+    qsort(blocks, count, sizeof(*blocks), compare_block_stacks);
+
+    for (i = 0; i < count;) {
+        const struct MallocBlockInfoData * const first = blocks[i];
+        size_t group_size = 0;
+        size_t group_bytes = 0;
+
+        for (; i < count && blocks[i]->stack == first->stack; i++) {
+            group_size++;
+            group_bytes += blocks[i]->size;
+        }
+        cm_print_error(SOURCE_LOCATION_FORMAT
+                       ": note: %lu block(s) of %lu bytes allocated here\n",
+                       first->location.file,
+                       first->location.line,
+                       (unsigned long)group_size,
+                       (unsigned long)group_bytes);
+        print_malloc_stack(first->stack);
+    }
+    libc_free(blocks);
+}
+
+
+/*
+ * Determine whether any block allocated after the specified check point is
+ * still allocated.  Blocks are tagged with increasing serials and each shard
+ * lists them in allocation order, so only the newest block of each shard is
+ * looked at.
+ */
+static int blocks_allocated_since(const size_t check_point) {
+    size_t number_of_shards;
+    MallocHeapShard * const shards = malloc_heap_shards(&number_of_shards);
+    int allocated = 0;
+    size_t i;
+
+    for (i = 0; i < number_of_shards && !allocated; i++) {
+        MallocHeapShard * const shard = &shards[i];
+
+        malloc_heap_lock(shard);
+        if (shard->blocks.prev != &shard->blocks) {
+            const MallocBlockInfo block_info = {
+                .ptr = discard_const(shard->blocks.prev->value),
+            };
+            assert_non_null(block_info.ptr);
+            allocated = block_info.data->serial > check_point;
+        }
+        malloc_heap_unlock(shard);
+    }
+    return allocated;
+}
 
-    node = check_point->next;
-    assert_non_null(node);
 
-    while (node != head) {
-        const MallocBlockInfo block_info = {
-            .ptr = discard_const(node->value),
-        };
-        node = node->next;
-        free(discard_const_p(char, block_info.data) +
-             sizeof(struct MallocBlockInfoData) +
-             MALLOC_GUARD_SIZE);
+/* Display the specified allocated blocks. */
+static void display_allocated_blocks(
+    struct MallocBlockInfoData * const * const blocks,
+    const size_t allocated_blocks) {
+    size_t traced_blocks = 0;
+    size_t i;
+
+    cm_print_error("Blocks allocated...\n");
+    for (i = 0; i < allocated_blocks; i++) {
+        if (blocks[i]->stack != NULL) {
+            traced_blocks++;
+            continue;
+        }
+        cm_print_error(SOURCE_LOCATION_FORMAT ": note: block %p allocated here\n",
+                       blocks[i]->location.file,
+                       blocks[i]->location.line,
+                       blocks[i]->block);
+    }
+    if (traced_blocks > 0) {
+        display_allocated_stacks(blocks, allocated_blocks);
+    }
+}
+
+
+/* Free the specified allocated blocks. */
+static void free_allocated_blocks(
+    struct MallocBlockInfoData * const * const blocks,
+    const size_t allocated_blocks) {
+    size_t i;
+
+    for (i = 0; i < allocated_blocks; i++) {
+        free(blocks[i]->ptr);
     }
 }
 
 
 /* Fail if any any blocks are allocated after the specified check point. */
-static void fail_if_blocks_allocated(const ListNode * const check_point,
+static void fail_if_blocks_allocated(const size_t check_point,
                                      const char * const test_name) {
-    const size_t allocated_blocks = display_allocated_blocks(check_point);
+    struct MallocBlockInfoData **blocks;
+    size_t allocated_blocks;
+
+    if (!blocks_allocated_since(check_point)) {
+        return;
+    }
+
+    allocated_blocks = collect_allocated_blocks(check_point, &blocks);
     if (allocated_blocks > 0) {
-        free_allocated_blocks(check_point);
+        display_allocated_blocks(blocks, allocated_blocks);
+        free_allocated_blocks(blocks, allocated_blocks);
+        libc_free(blocks);
         cm_print_error("ERROR: %s leaked %zu block(s)\n", test_name,
                        allocated_blocks);
+        global_memory_errors++;
+        exit_test(1);
+    }
+    libc_free(blocks);
+}
+
+
+/* Fail if any blocks freed by a test were written to after they were freed. */
+static void fail_if_freed_blocks_corrupt(const char * const test_name) {
+    const size_t corrupt_blocks = drain_malloc_quarantine();
+    if (corrupt_blocks > 0) {
+        cm_print_error("ERROR: %s wrote to %zu freed block(s)\n", test_name,
+                       corrupt_blocks);
+        global_memory_errors++;
         exit_test(1);
     }
 }
@@ -2209,9 +5494,62 @@ static void exception_handler(int sig) {
 
     cm_print_error("Test failed with exception: %s(%d)",
                    sig_strerror, sig);
+    global_memory_errors++;
     exit_test(1);
 }
 
+#ifdef HAVE_SIGACTION
+/* Report which guard page was accessed before failing the test. */
+static void exception_action(int sig, siginfo_t *info, void *context) {
+    (void)context;
+#ifdef CM_HAVE_GUARD_PAGES
+    if (sig == SIGSEGV
+#ifdef SIGBUS
+        || sig == SIGBUS
+#endif
+        ) {
+        print_guard_page_access(info->si_addr);
+    }
+#else
+    (void)info;
+#endif
+    exception_handler(sig);
+}
+#endif /* HAVE_SIGACTION */
+
+/* Catch the signals of a crashing test with exception_handler(). */
+static void install_exception_handlers(void) {
+    unsigned int i;
+#ifdef HAVE_SIGACTION
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = exception_action;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
+        sigaction(exception_signals[i], &action, &default_signal_actions[i]);
+    }
+#else
+    for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
+        default_signal_functions[i] = signal(
+                exception_signals[i], exception_handler);
+    }
+#endif
+}
+
+/* Restore the signal handlers replaced by install_exception_handlers(). */
+static void restore_exception_handlers(void) {
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
+#ifdef HAVE_SIGACTION
+        sigaction(exception_signals[i], &default_signal_actions[i], NULL);
+#else
+        signal(exception_signals[i], default_signal_functions[i]);
+#endif
+    }
+}
+
 #else /* _WIN32 */
 
 static LONG WINAPI exception_filter(EXCEPTION_POINTERS *exception_pointers) {
@@ -2332,6 +5670,53 @@ enum cm_printf_type {
 static int xml_printed;
 static int file_append;
 
+/*
+ * Format the allocation counters of a test, or the non-empty buckets of its
+ * size histogram as "min-max:count" pairs.
+ */
+static void cm_format_malloc_stats(const MallocStats * const stats,
+                                   char * const buf, const size_t size)
+{
+    snprintf(buf, size,
+             "%lu allocation(s) of %lu bytes, %lu free(s), "
+             "peak %lu bytes in %lu block(s)",
+             (unsigned long)stats->allocations,
+             (unsigned long)stats->allocated_bytes,
+             (unsigned long)stats->frees,
+             (unsigned long)stats->peak_bytes,
+             (unsigned long)stats->peak_blocks);
+}
+
+static void cm_format_malloc_histogram(const MallocStats * const stats,
+                                       char * const buf, const size_t size)
+{
+    size_t len = 0;
+    size_t i;
+
+    buf[0] = '\0';
+    for (i = 0; i < MALLOC_STATS_SIZE_BUCKETS && len < size; i++) {
+        const unsigned long min = i == 0 ? 0 : 1UL << (i - 1);
+        const unsigned long count = (unsigned long)stats->size_histogram[i];
+        int rc;
+
+        if (count == 0) {
+            continue;
+        }
+        if (i == MALLOC_STATS_SIZE_BUCKETS - 1) {
+            rc = snprintf(buf + len, size - len, "%s%lu+:%lu",
+                          len > 0 ? " " : "", min, count);
+        } else {
+            rc = snprintf(buf + len, size - len, "%s%lu-%lu:%lu",
+                          len > 0 ? " " : "", min,
+                          i == 0 ? 0 : (1UL << i) - 1, count);
+        }
+        if (rc < 0) {
+            break;
+        }
+        len += (size_t)rc;
+    }
+}
+
 static void cmprintf_group_finish_xml(const char *group_name,
                                       size_t total_executed,
                                       size_t total_failed,
@@ -2406,6 +5791,35 @@ static void cmprintf_group_finish_xml(const char *group_name,
         fprintf(fp, "    <testcase name=\"%s\" time=\"%.3f\" >\n",
                 cmtest->test->name, cmtest->runtime);
 
+        if (cm_get_malloc_stats() &&
+            (cmtest->status == CM_TEST_PASSED ||
+             cmtest->status == CM_TEST_FAILED)) {
+            const MallocStats *stats = &cmtest->malloc_stats;
+            char histogram[2048];
+
+            cm_format_malloc_histogram(stats, histogram, sizeof(histogram));
+            fprintf(fp, "      <properties>\n");
+            fprintf(fp, "        <property name=\"malloc.allocations\" "
+                        "value=\"%lu\" />\n",
+                    (unsigned long)stats->allocations);
+            fprintf(fp, "        <property name=\"malloc.frees\" "
+                        "value=\"%lu\" />\n",
+                    (unsigned long)stats->frees);
+            fprintf(fp, "        <property name=\"malloc.allocated_bytes\" "
+                        "value=\"%lu\" />\n",
+                    (unsigned long)stats->allocated_bytes);
+            fprintf(fp, "        <property name=\"malloc.peak_bytes\" "
+                        "value=\"%lu\" />\n",
+                    (unsigned long)stats->peak_bytes);
+            fprintf(fp, "        <property name=\"malloc.peak_blocks\" "
+                        "value=\"%lu\" />\n",
+                    (unsigned long)stats->peak_blocks);
+            fprintf(fp, "        <property name=\"malloc.size_histogram\" "
+                        "value=\"%s\" />\n",
+                    histogram);
+            fprintf(fp, "      </properties>\n");
+        }
+
         switch (cmtest->status) {
         case CM_TEST_ERROR:
         case CM_TEST_FAILED:
@@ -2544,10 +5958,11 @@ static void cmprintf_tap(enum cm_printf_type type,
             char *msg;
             char *p;
 
-            msg = strdup(error_message);
+            msg = (char *)libc_malloc(strlen(error_message) + 1);
             if (msg == NULL) {
                 return;
             }
+            strcpy(msg, error_message);
             p = msg;
 
             while (p[0] != '\0') {
@@ -2687,14 +6102,178 @@ static void cmprintf(enum cm_printf_type type,
     }
 }
 
-void cmocka_set_message_output(enum cm_message_output output)
+/* Print the allocation counters of a test which has run. */
+static void cmprintf_malloc_stats(const struct CMUnitTestState *cmtest)
+{
+    enum cm_message_output output;
+    const char *prefix = NULL;
+    char line[256];
+    char histogram[2048];
+
+    if (!cm_get_malloc_stats()) {
+        return;
+    }
+
+    output = cm_get_output();
+
+    switch (output) {
+    case CM_OUTPUT_STDOUT:
+        prefix = "[  MALLOC  ] ";
+        break;
+    case CM_OUTPUT_SUBUNIT:
+        prefix = "malloc: ";
+        break;
+    case CM_OUTPUT_TAP:
+        prefix = "# malloc: ";
+        break;
+    case CM_OUTPUT_XML:
+        /* Printed with the test cases of the group. */
+        return;
+    }
+
+    cm_format_malloc_stats(&cmtest->malloc_stats, line, sizeof(line));
+    cm_format_malloc_histogram(&cmtest->malloc_stats,
+                               histogram, sizeof(histogram));
+    print_message("%s%s: %s\n", prefix, cmtest->test->name, line);
+    if (histogram[0] != '\0') {
+        print_message("%s%s: sizes %s\n",
+                      prefix, cmtest->test->name, histogram);
+    }
+}
+
+void cmocka_set_message_output(enum cm_message_output output)
+{
+    global_msg_output = output;
+}
+
+void cmocka_set_test_filter(const char *pattern)
+{
+    global_test_filter_pattern = pattern;
+}
+
+void cmocka_set_shared_mocks(int enabled)
+{
+    global_shared_mocks = enabled;
+}
+
+void cmocka_set_shared_heap(int enabled)
+{
+    global_shared_heap = enabled;
+}
+
+void cmocka_set_malloc_pool(int enabled)
+{
+    global_malloc_pool_enabled = enabled;
+}
+
+void cmocka_set_malloc_guard_size(size_t size)
+{
+    global_requested_malloc_guard_size = size;
+}
+
+void cmocka_set_malloc_guard_pages(enum cm_malloc_guard_pages mode)
+{
+    global_malloc_guard_pages = mode;
+    /* Applies to the blocks allocated by the running test from now on. */
+    global_malloc_guard_pages_active = cm_get_malloc_guard_pages();
+}
+
+void cmocka_set_malloc_backtrace(size_t depth)
+{
+    global_requested_malloc_backtrace_depth = depth;
+}
+
+void cmocka_set_malloc_fail_sweep(int enabled)
+{
+    global_malloc_fail_sweep = enabled;
+}
+
+void cmocka_set_jobs(size_t jobs)
+{
+    global_jobs = jobs;
+}
+
+void cmocka_set_malloc_stats(int enabled)
+{
+    global_malloc_stats_enabled = enabled;
+}
+
+void cmocka_set_malloc_quarantine_size(size_t size)
+{
+    global_requested_malloc_quarantine_size = size;
+}
+
+void cmocka_set_realloc_move(int enabled)
+{
+    global_realloc_move = enabled;
+}
+
+void cmocka_set_mock_trace(size_t number_of_records)
+{
+    global_mock_trace_records = number_of_records;
+}
+
+void cmocka_print_mock_trace(void)
 {
-    global_msg_output = output;
+    mock_state_lock();
+    mock_trace_print(mock_state(), print_message);
+    mock_state_unlock();
 }
 
-void cmocka_set_test_filter(const char *pattern)
+struct CMExpectationPlan *cmocka_expectation_plan_begin(void)
 {
-    global_test_filter_pattern = pattern;
+    struct CMExpectationPlan *plan;
+
+    assert_null(global_recording_plan);
+    plan = (struct CMExpectationPlan *)libc_calloc(1, sizeof(*plan));
+    assert_non_null(plan);
+
+    global_recording_plan = plan;
+    symbol_table_initialize(&plan->state.symbol_table);
+    symbol_map_initialize(&plan->state.function_result_map);
+    initialize_source_location(&plan->state.last_mock_value_location);
+    symbol_map_initialize(&plan->state.function_parameter_map);
+    initialize_source_location(&plan->state.last_parameter_location);
+    call_ordering_initialize(&plan->state.call_ordering);
+    initialize_source_location(&plan->state.last_call_ordering_location);
+    list_initialize(&plan->state.check_event_heap_list);
+    return plan;
+}
+
+void cmocka_expectation_plan_end(struct CMExpectationPlan *plan)
+{
+    assert_true(plan != NULL && plan == global_recording_plan);
+    global_recording_plan = NULL;
+}
+
+void cmocka_expectation_plan_apply(const struct CMExpectationPlan *plan)
+{
+    MockState *state;
+
+    assert_non_null(plan);
+    mock_state_lock();
+    state = mock_state();
+    assert_true(state != &plan->state);
+    expectation_plan_apply_map(&state->function_result_map,
+                               &plan->state.function_result_map, 1);
+    expectation_plan_apply_map(&state->function_parameter_map,
+                               &plan->state.function_parameter_map, 2);
+    expectation_plan_apply_calls(&state->call_ordering,
+                                 &plan->state.call_ordering);
+    mock_state_unlock();
+}
+
+void cmocka_expectation_plan_free(struct CMExpectationPlan *plan)
+{
+    if (plan == NULL) {
+        return;
+    }
+    if (global_recording_plan == plan) {
+        global_recording_plan = NULL;
+    }
+    list_free(&plan->state.check_event_heap_list, free_value, NULL);
+    arena_release(&plan->state.arena);
+    libc_free(plan);
 }
 
 void cmocka_set_skip_filter(const char *pattern)
@@ -2762,9 +6341,9 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
                                           void ** const volatile state,
                                           const void *const heap_check_point)
 {
-    const ListNode * const volatile check_point = (const ListNode*)
-        (heap_check_point != NULL ?
-         heap_check_point : check_point_allocated_blocks());
+    const volatile size_t check_point =
+        heap_check_point != NULL ? *(const size_t *)heap_check_point :
+                                   check_point_allocated_blocks();
     int handle_exceptions = 1;
     void *current_state = NULL;
     int rc = 0;
@@ -2782,11 +6361,7 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
 
     if (handle_exceptions) {
 #ifndef _WIN32
-        unsigned int i;
-        for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
-            default_signal_functions[i] = signal(
-                    exception_signals[i], exception_handler);
-        }
+        install_exception_handlers();
 #else /* _WIN32 */
         previous_exception_filter = SetUnhandledExceptionFilter(
                 exception_filter);
@@ -2818,21 +6393,21 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
         } else {
             /* ERROR */
         }
+        fail_if_deferred_failures();
+        fail_if_freed_blocks_corrupt(function_name);
         fail_if_leftover_values(function_name);
         global_running_test = 0;
     } else {
         /* TEST FAILED */
         global_running_test = 0;
+        print_mock_trace_on_failure();
         rc = -1;
     }
     teardown_testing(function_name);
 
     if (handle_exceptions) {
 #ifndef _WIN32
-        unsigned int i;
-        for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
-            signal(exception_signals[i], default_signal_functions[i]);
-        }
+        restore_exception_handlers();
 #else /* _WIN32 */
         if (previous_exception_filter) {
             SetUnhandledExceptionFilter(previous_exception_filter);
@@ -2871,6 +6446,222 @@ static int cmocka_run_group_fixture(const char *function_name,
     return rc;
 }
 
+#ifdef CM_HAVE_FORK
+/* Write size bytes to a file descriptor.  Returns 0 on success, -1 if not. */
+static int cm_write_full(const int fd, const void *buf, size_t size)
+{
+    const char *data = (const char *)buf;
+
+    while (size > 0) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+/*
+ * Read size bytes from a file descriptor.  Returns 0 on success, -1 at its
+ * end or on error.
+ */
+static int cm_read_full(const int fd, void *buf, size_t size)
+{
+    char *data = (char *)buf;
+
+    while (size > 0) {
+        const ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Write a string to a pipe, a parent which went away is ignored. */
+static void cm_write_pipe(const int fd, const char *str)
+{
+    (void)cm_write_full(fd, str, strlen(str));
+}
+
+/* Read a pipe to its end into a string, which is freed with libc_free(). */
+static char *cm_read_pipe(const int fd)
+{
+    size_t size = 256;
+    size_t len = 0;
+    char *str = (char *)libc_malloc(size);
+
+    assert_non_null(str);
+    for (;;) {
+        ssize_t n;
+
+        if (size - len < 2) {
+            size *= 2;
+            str = (char *)libc_realloc(str, size);
+            assert_non_null(str);
+        }
+        n = read(fd, str + len, size - len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+/*
+ * Run the test function in a child process forked from the state after the
+ * setup function, with the allocation number fail_at returning NULL or none
+ * if it's 0.  The child writes the number of allocations of the test function
+ * if fail_at is 0 and the test passed, or the memory errors caused by the
+ * failed allocation to output.  Returns the wait status of the child, -1 if
+ * it couldn't be run.
+ */
+static int cm_run_malloc_fail_child(const struct CMUnitTestState *test_state,
+                                    const size_t fail_at, char **output)
+{
+    int fds[2];
+    int status = -1;
+    pid_t pid;
+
+    *output = NULL;
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        void *state = test_state->state;
+        char buf[64];
+        int rc;
+
+        close(fds[0]);
+        cm_error_message = NULL;
+        global_memory_errors = 0;
+        global_malloc_fail_count = 0;
+        global_malloc_fail_at = fail_at;
+        global_malloc_fail_counting = 1;
+        rc = cmocka_run_one_test_or_fixture(test_state->test->name,
+                                            test_state->test->test_func,
+                                            NULL,
+                                            NULL,
+                                            &state,
+                                            NULL);
+        global_malloc_fail_counting = 0;
+
+        if (fail_at == 0) {
+            if (rc == 0) {
+                snprintf(buf, sizeof(buf), "%lu",
+                         (unsigned long)global_malloc_fail_count);
+                cm_write_pipe(fds[1], buf);
+            }
+        } else if (global_memory_errors > 0) {
+            snprintf(buf, sizeof(buf), SOURCE_LOCATION_FORMAT,
+                     global_malloc_fail_location.file != NULL ?
+                     global_malloc_fail_location.file : "?",
+                     global_malloc_fail_location.line);
+            cm_write_pipe(fds[1], buf);
+            cm_write_pipe(fds[1], ": note: allocation returned NULL here\n");
+            if (cm_error_message != NULL) {
+                cm_write_pipe(fds[1], cm_error_message);
+            }
+        }
+        fflush(stdout);
+        fflush(stderr);
+        close(fds[1]);
+        _exit(global_memory_errors > 0 ? 1 : 0);
+    }
+
+    close(fds[1]);
+    *output = cm_read_pipe(fds[0]);
+    close(fds[0]);
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+/*
+ * Rerun the test function once for every allocation it makes, with that
+ * allocation returning NULL.  Each run is forked from the state after the
+ * setup function, so the setup isn't repeated.  The crashes, leaks and other
+ * memory errors of each failed allocation are added to the error message of
+ * the test.  Returns the number of failed allocations which weren't handled.
+ */
+static size_t cm_run_malloc_fail_sweep(const struct CMUnitTestState *test_state)
+{
+    char *output;
+    unsigned long count;
+    unsigned long i;
+    size_t failures = 0;
+    int status;
+
+    status = cm_run_malloc_fail_child(test_state, 0, &output);
+    if (status != 0 || output == NULL || output[0] == '\0') {
+        /* The test itself fails, the normal run reports why. */
+        libc_free(output);
+        return 0;
+    }
+    count = strtoul(output, NULL, 10);
+    libc_free(output);
+
+    for (i = 1; i <= count; i++) {
+        status = cm_run_malloc_fail_child(test_state, i, &output);
+        if (status == -1) {
+            cm_print_error("Could not fork the test to fail allocation %lu\n",
+                           i);
+            failures++;
+            break;
+        }
+        if (WIFSIGNALED(status)) {
+            cm_print_error("Allocation %lu of %lu returned NULL: "
+                           "killed by signal %d\n%s",
+                           i, count, WTERMSIG(status), output);
+            failures++;
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            cm_print_error("Allocation %lu of %lu returned NULL:\n%s",
+                           i, count, output);
+            failures++;
+        }
+        libc_free(output);
+    }
+    if (failures > 0) {
+        cm_print_error("%lu of %lu failed allocations weren't handled\n",
+                       (unsigned long)failures, count);
+    }
+    return failures;
+}
+#else /* CM_HAVE_FORK */
+static size_t cm_run_malloc_fail_sweep(const struct CMUnitTestState *test_state)
+{
+    (void)test_state;
+    return 0;
+}
+#endif /* CM_HAVE_FORK */
+
 static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
 {
 #ifdef HAVE_STRUCT_TIMESPEC
@@ -2883,6 +6674,7 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
         .tv_nsec = 0,
     };
 #endif
+    size_t malloc_fail_failures = 0;
     int rc = 0;
 
     /* Run setup */
@@ -2895,26 +6687,36 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
                                             test_state->test->setup_func,
                                             NULL,
                                             &test_state->state,
-                                            test_state->check_point);
+                                            &test_state->check_point);
         if (rc != 0) {
             test_state->status = CM_TEST_ERROR;
             cm_print_error("Test setup failed");
         }
     }
 
+    /* Fail the allocations of the test one by one */
+    if (rc == 0 && test_state->test->test_func != NULL &&
+        cm_get_malloc_fail_sweep()) {
+        malloc_fail_failures = cm_run_malloc_fail_sweep(test_state);
+    }
+
     /* Run test */
 #ifdef HAVE_STRUCT_TIMESPEC
     CMOCKA_CLOCK_GETTIME(CLOCK_REALTIME, &start);
 #endif
 
     if (rc == 0) {
+        malloc_stats_start();
         rc = cmocka_run_one_test_or_fixture(test_state->test->name,
                                             test_state->test->test_func,
                                             NULL,
                                             NULL,
                                             &test_state->state,
                                             NULL);
-        if (rc == 0) {
+        test_state->malloc_stats = *get_malloc_stats();
+        if (rc == 0 && malloc_fail_failures > 0) {
+            test_state->status = CM_TEST_FAILED;
+        } else if (rc == 0) {
             test_state->status = CM_TEST_PASSED;
         } else {
             if (global_skip_test) {
@@ -2941,7 +6743,7 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
                                             NULL,
                                             test_state->test->teardown_func,
                                             &test_state->state,
-                                            test_state->check_point);
+                                            &test_state->check_point);
         if (rc != 0) {
             test_state->status = CM_TEST_ERROR;
             cm_print_error("Test teardown failed");
@@ -2954,6 +6756,389 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
     return rc;
 }
 
+#ifdef CM_HAVE_FORK
+/*
+ * Read what was written to a file descriptor which captures the output of a
+ * test, and start over.  Returns the output, freed with libc_free(), or NULL
+ * if there's none.
+ */
+static char *cm_take_output(const int fd, size_t *size)
+{
+    const off_t end = lseek(fd, 0, SEEK_END);
+    char *output = NULL;
+
+    *size = 0;
+    if (end > 0 && lseek(fd, 0, SEEK_SET) == 0) {
+        output = (char *)libc_malloc((size_t)end + 1);
+        assert_non_null(output);
+        if (cm_read_full(fd, output, (size_t)end) == 0) {
+            output[end] = '\0';
+            *size = (size_t)end + 1;
+        } else {
+            libc_free(output);
+            output = NULL;
+        }
+    }
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        _exit(1);
+    }
+    return output;
+}
+
+/*
+ * Main loop of a worker process: run the tests whose indices are read from
+ * task_fd and write their results to result_fd until the parent closes
+ * task_fd.  stdout and stderr are captured in temporary files, so the parent
+ * can print the output of each test in order.
+ */
+static void cm_test_worker_run(CMTestPool * const pool,
+                               const int task_fd,
+                               const int result_fd)
+{
+    FILE * const out = tmpfile();
+    FILE * const err = tmpfile();
+    size_t test;
+
+    if (out == NULL || err == NULL ||
+        dup2(fileno(out), STDOUT_FILENO) < 0 ||
+        dup2(fileno(err), STDERR_FILENO) < 0) {
+        _exit(1);
+    }
+
+    while (cm_read_full(task_fd, &test, sizeof(test)) == 0) {
+        struct CMUnitTestState * const cmtest = &pool->tests[test];
+        CMTestResult result;
+        char *stdout_output;
+        char *stderr_output;
+        int failed;
+
+        memset(&result, 0, sizeof(result));
+        result.test = test;
+        result.rc = cmocka_run_one_tests(cmtest);
+        result.status = cmtest->status;
+        result.runtime = cmtest->runtime;
+        result.malloc_stats = cmtest->malloc_stats;
+        if (cmtest->error_message != NULL) {
+            result.error_message_size = strlen(cmtest->error_message) + 1;
+        }
+        fflush(stdout);
+        fflush(stderr);
+        stdout_output = cm_take_output(STDOUT_FILENO, &result.stdout_size);
+        stderr_output = cm_take_output(STDERR_FILENO, &result.stderr_size);
+
+        failed = cm_write_full(result_fd, &result, sizeof(result)) != 0 ||
+                 cm_write_full(result_fd, cmtest->error_message,
+                               result.error_message_size) != 0 ||
+                 cm_write_full(result_fd, stdout_output,
+                               result.stdout_size) != 0 ||
+                 cm_write_full(result_fd, stderr_output,
+                               result.stderr_size) != 0;
+        vcm_free_error(discard_const_p(char, cmtest->error_message));
+        cmtest->error_message = NULL;
+        libc_free(stdout_output);
+        libc_free(stderr_output);
+        if (failed) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+/* Hand the next test to an idle worker, or let it exit if there's none. */
+static void cm_test_pool_dispatch(CMTestPool * const pool,
+                                  CMTestWorker * const worker)
+{
+    if (pool->next_test == pool->number_of_tests) {
+        if (worker->task_fd >= 0) {
+            close(worker->task_fd);
+            worker->task_fd = -1;
+        }
+        return;
+    }
+    /* A worker which died is noticed when its results end. */
+    if (cm_write_full(worker->task_fd, &pool->next_test,
+                      sizeof(pool->next_test)) == 0) {
+        worker->test = pool->next_test;
+        pool->next_test++;
+    }
+}
+
+/* Fork a worker process and hand it the next test. */
+static int cm_test_pool_spawn(CMTestPool * const pool,
+                              CMTestWorker * const worker)
+{
+    int task_fds[2];
+    int result_fds[2];
+    pid_t pid;
+    size_t i;
+
+    if (pipe(task_fds) != 0) {
+        return -1;
+    }
+    if (pipe(result_fds) != 0) {
+        close(task_fds[0]);
+        close(task_fds[1]);
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) {
+        close(task_fds[0]);
+        close(task_fds[1]);
+        close(result_fds[0]);
+        close(result_fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        /* Other workers have to see the end of their tasks. */
+        for (i = 0; i < pool->number_of_workers; i++) {
+            if (pool->workers[i].pid != 0) {
+                if (pool->workers[i].task_fd >= 0) {
+                    close(pool->workers[i].task_fd);
+                }
+                close(pool->workers[i].result_fd);
+            }
+        }
+        close(task_fds[1]);
+        close(result_fds[0]);
+        cm_test_worker_run(pool, task_fds[0], result_fds[1]);
+    }
+
+    close(task_fds[0]);
+    close(result_fds[1]);
+    worker->pid = pid;
+    worker->task_fd = task_fds[1];
+    worker->result_fd = result_fds[0];
+    worker->test = SIZE_MAX;
+    cm_test_pool_dispatch(pool, worker);
+    return 0;
+}
+
+/*
+ * Reap a worker whose results ended.  If it died while running a test, that
+ * test fails and a new worker takes over the remaining tests.
+ */
+static void cm_test_pool_reap(CMTestPool * const pool,
+                              CMTestWorker * const worker)
+{
+    int status = 0;
+
+    if (worker->task_fd >= 0) {
+        close(worker->task_fd);
+    }
+    close(worker->result_fd);
+    while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    worker->pid = 0;
+
+    if (worker->test != SIZE_MAX) {
+        struct CMUnitTestState * const cmtest = &pool->tests[worker->test];
+        char *err_msg = (char *)libc_malloc(128);
+
+        assert_non_null(err_msg);
+        if (WIFSIGNALED(status)) {
+            snprintf(err_msg, 128, "Test process killed by signal %d",
+                     WTERMSIG(status));
+        } else {
+            snprintf(err_msg, 128, "Test process exited with status %d",
+                     WIFEXITED(status) ? WEXITSTATUS(status) : status);
+        }
+        cmtest->status = CM_TEST_FAILED;
+        cmtest->error_message = err_msg;
+        pool->jobs[worker->test].done = 1;
+        worker->test = SIZE_MAX;
+    }
+    if (pool->next_test < pool->number_of_tests &&
+        cm_test_pool_spawn(pool, worker) != 0) {
+        cm_print_error("Could not fork a test process\n");
+    }
+}
+
+/* Read the result of a test from a worker and hand it the next test. */
+static void cm_test_pool_receive(CMTestPool * const pool,
+                                 CMTestWorker * const worker)
+{
+    struct CMUnitTestState *cmtest;
+    CMTestResult result;
+    CMTestJob *job;
+    char *error_message = NULL;
+
+    if (cm_read_full(worker->result_fd, &result, sizeof(result)) != 0 ||
+        result.test != worker->test) {
+        cm_test_pool_reap(pool, worker);
+        return;
+    }
+    cmtest = &pool->tests[result.test];
+    job = &pool->jobs[result.test];
+
+    if (result.error_message_size > 0) {
+        error_message = (char *)libc_malloc(result.error_message_size);
+        assert_non_null(error_message);
+    }
+    if (result.stdout_size > 0) {
+        job->stdout_output = (char *)libc_malloc(result.stdout_size);
+        assert_non_null(job->stdout_output);
+    }
+    if (result.stderr_size > 0) {
+        job->stderr_output = (char *)libc_malloc(result.stderr_size);
+        assert_non_null(job->stderr_output);
+    }
+    if (cm_read_full(worker->result_fd, error_message,
+                     result.error_message_size) != 0 ||
+        cm_read_full(worker->result_fd, job->stdout_output,
+                     result.stdout_size) != 0 ||
+        cm_read_full(worker->result_fd, job->stderr_output,
+                     result.stderr_size) != 0) {
+        vcm_free_error(error_message);
+        cm_test_pool_reap(pool, worker);
+        return;
+    }
+
+    cmtest->status = result.status;
+    cmtest->runtime = result.runtime;
+    cmtest->malloc_stats = result.malloc_stats;
+    cmtest->error_message = error_message;
+    job->rc = result.rc;
+    job->done = 1;
+    worker->test = SIZE_MAX;
+    cm_test_pool_dispatch(pool, worker);
+}
+
+/* Let the workers exit and release the pool. */
+static void cm_test_pool_stop(CMTestPool * const pool)
+{
+    size_t i;
+
+    pool->next_test = pool->number_of_tests;
+    for (i = 0; i < pool->number_of_workers; i++) {
+        CMTestWorker * const worker = &pool->workers[i];
+
+        if (worker->pid != 0) {
+            worker->test = SIZE_MAX;
+            cm_test_pool_reap(pool, worker);
+        }
+    }
+    for (i = 0; i < pool->number_of_tests; i++) {
+        libc_free(pool->jobs[i].stdout_output);
+        libc_free(pool->jobs[i].stderr_output);
+    }
+#ifdef SIGPIPE
+    signal(SIGPIPE, pool->sigpipe_handler);
+#endif
+    libc_free(pool->poll_fds);
+    libc_free(pool->workers);
+    libc_free(pool->jobs);
+    libc_free(pool);
+}
+/*
+ * Start a pool of worker processes running the tests of a group, forked after
+ * the group setup.  Returns NULL if not a single worker could be forked.
+ */
+static CMTestPool *cm_test_pool_start(struct CMUnitTestState * const tests,
+                                      const size_t number_of_tests,
+                                      size_t number_of_workers)
+{
+    CMTestPool *pool;
+    size_t i;
+
+    if (number_of_workers > number_of_tests) {
+        number_of_workers = number_of_tests;
+    }
+    pool = (CMTestPool *)libc_calloc(1, sizeof(*pool));
+    assert_non_null(pool);
+    pool->tests = tests;
+    pool->number_of_tests = number_of_tests;
+    pool->number_of_workers = number_of_workers;
+    pool->jobs = (CMTestJob *)libc_calloc(number_of_tests,
+                                          sizeof(*pool->jobs));
+    pool->workers = (CMTestWorker *)libc_calloc(number_of_workers,
+                                                sizeof(*pool->workers));
+    pool->poll_fds = (struct pollfd *)libc_calloc(number_of_workers,
+                                                  sizeof(*pool->poll_fds));
+    assert_non_null(pool->jobs);
+    assert_non_null(pool->workers);
+    assert_non_null(pool->poll_fds);
+#ifdef SIGPIPE
+    /* Handing a test to a worker which just died mustn't kill the runner. */
+    pool->sigpipe_handler = signal(SIGPIPE, SIG_IGN);
+#endif
+
+    for (i = 0; i < number_of_workers; i++) {
+        if (cm_test_pool_spawn(pool, &pool->workers[i]) != 0) {
+            break;
+        }
+    }
+    if (i == 0) {
+        cm_test_pool_stop(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+ * Wait for the result of a test and print its output.  Returns what
+ * cmocka_run_one_tests() returned for the test.
+ */
+static int cm_test_pool_wait(CMTestPool * const pool, const size_t test)
+{
+    CMTestJob * const job = &pool->jobs[test];
+
+    while (!job->done) {
+        nfds_t number_of_fds = 0;
+        size_t i;
+        int n;
+
+        for (i = 0; i < pool->number_of_workers; i++) {
+            if (pool->workers[i].pid != 0) {
+                pool->poll_fds[number_of_fds].fd = pool->workers[i].result_fd;
+                pool->poll_fds[number_of_fds].events = POLLIN;
+                pool->poll_fds[number_of_fds].revents = 0;
+                number_of_fds++;
+            }
+        }
+        if (number_of_fds == 0) {
+            /* No worker could be forked to run the test. */
+            pool->tests[test].status = CM_TEST_ERROR;
+            return -1;
+        }
+
+        n = poll(pool->poll_fds, number_of_fds, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            pool->tests[test].status = CM_TEST_ERROR;
+            return -1;
+        }
+
+        number_of_fds = 0;
+        for (i = 0; i < pool->number_of_workers; i++) {
+            CMTestWorker * const worker = &pool->workers[i];
+
+            if (worker->pid == 0) {
+                continue;
+            }
+            if (pool->poll_fds[number_of_fds++].revents != 0) {
+                cm_test_pool_receive(pool, worker);
+            }
+        }
+    }
+
+    if (job->stdout_output != NULL) {
+        fputs(job->stdout_output, stdout);
+        fflush(stdout);
+    }
+    if (job->stderr_output != NULL) {
+        fputs(job->stderr_output, stderr);
+        fflush(stderr);
+    }
+    return job->rc;
+}
+
+#endif /* CM_HAVE_FORK */
+
 int _cmocka_run_group_tests(const char *group_name,
                             const struct CMUnitTest * const tests,
                             const size_t num_tests,
@@ -2961,7 +7146,10 @@ int _cmocka_run_group_tests(const char *group_name,
                             CMFixtureFunction group_teardown)
 {
     struct CMUnitTestState *cm_tests;
-    const ListNode *group_check_point = check_point_allocated_blocks();
+    const size_t group_check_point = check_point_allocated_blocks();
+#ifdef CM_HAVE_FORK
+    CMTestPool *pool = NULL;
+#endif
     void *group_state = NULL;
     size_t total_tests = 0;
     size_t total_failed = 0;
@@ -3022,24 +7210,43 @@ int _cmocka_run_group_tests(const char *group_name,
                                       group_setup,
                                       NULL,
                                       &group_state,
-                                      group_check_point);
+                                      &group_check_point);
     }
 
     if (rc == 0) {
-        /* Execute tests */
         for (i = 0; i < total_tests; i++) {
             struct CMUnitTestState *cmtest = &cm_tests[i];
-            size_t test_number = i + 1;
-
-            cmprintf(PRINTF_TEST_START, test_number, cmtest->test->name, NULL);
 
             if (group_state != NULL) {
                 cmtest->state = group_state;
             } else if (cmtest->test->initial_state  != NULL) {
                 cmtest->state = cmtest->test->initial_state;
             }
+        }
+
+#ifdef CM_HAVE_FORK
+        /* Run the tests in worker processes, the results are printed here in
+         * order. */
+        if (cm_get_jobs() > 1 && total_tests > 1) {
+            pool = cm_test_pool_start(cm_tests, total_tests, cm_get_jobs());
+        }
+#endif
+
+        /* Execute tests */
+        for (i = 0; i < total_tests; i++) {
+            struct CMUnitTestState *cmtest = &cm_tests[i];
+            size_t test_number = i + 1;
+
+            cmprintf(PRINTF_TEST_START, test_number, cmtest->test->name, NULL);
 
-            rc = cmocka_run_one_tests(cmtest);
+#ifdef CM_HAVE_FORK
+            if (pool != NULL) {
+                rc = cm_test_pool_wait(pool, i);
+            } else
+#endif
+            {
+                rc = cmocka_run_one_tests(cmtest);
+            }
             total_executed++;
             total_runtime += cmtest->runtime;
             if (rc == 0) {
@@ -3049,6 +7256,7 @@ int _cmocka_run_group_tests(const char *group_name,
                                  test_number,
                                  cmtest->test->name,
                                  cmtest->error_message);
+                        cmprintf_malloc_stats(cmtest);
                         total_passed++;
                         break;
                     case CM_TEST_SKIPPED:
@@ -3063,6 +7271,7 @@ int _cmocka_run_group_tests(const char *group_name,
                                  test_number,
                                  cmtest->test->name,
                                  cmtest->error_message);
+                        cmprintf_malloc_stats(cmtest);
                         total_failed++;
                         break;
                     default:
@@ -3087,6 +7296,12 @@ int _cmocka_run_group_tests(const char *group_name,
                 total_errors++;
             }
         }
+
+#ifdef CM_HAVE_FORK
+        if (pool != NULL) {
+            cm_test_pool_stop(pool);
+        }
+#endif
     } else {
         if (cm_error_message != NULL) {
             print_error("[  ERROR   ] --- %s\n", cm_error_message);
@@ -3104,7 +7319,7 @@ int _cmocka_run_group_tests(const char *group_name,
                                       NULL,
                                       group_teardown,
                                       &group_state,
-                                      group_check_point);
+                                      &group_check_point);
         if (rc != 0) {
             if (cm_error_message != NULL) {
                 print_error("[  ERROR   ] --- %s\n", cm_error_message);
@@ -3129,6 +7344,8 @@ int _cmocka_run_group_tests(const char *group_name,
         vcm_free_error(discard_const_p(char, cm_tests[i].error_message));
     }
     libc_free(cm_tests);
+    release_mock_states();
+    release_malloc_pool();
     fail_if_blocks_allocated(group_check_point, "cmocka_group_tests");
 
     return total_failed + total_errors;
@@ -3142,9 +7359,9 @@ int _run_test(
         const char * const function_name,  const UnitTestFunction Function,
         void ** const volatile state, const UnitTestFunctionType function_type,
         const void* const heap_check_point) {
-    const ListNode * const volatile check_point = (const ListNode*)
-        (heap_check_point ?
-         heap_check_point : check_point_allocated_blocks());
+    const volatile size_t check_point =
+        heap_check_point ? *(const size_t *)heap_check_point :
+                           check_point_allocated_blocks();
     void *current_state = NULL;
     volatile int rc = 1;
     int handle_exceptions = 1;
@@ -3159,11 +7376,7 @@ int _run_test(
 
     if (handle_exceptions) {
 #ifndef _WIN32
-        unsigned int i;
-        for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
-            default_signal_functions[i] = signal(
-                exception_signals[i], exception_handler);
-        }
+        install_exception_handlers();
 #else /* _WIN32 */
         previous_exception_filter = SetUnhandledExceptionFilter(
             exception_filter);
@@ -3177,6 +7390,8 @@ int _run_test(
     global_running_test = 1;
     if (cm_setjmp(global_run_test_env) == 0) {
         Function(state ? state : &current_state);
+        fail_if_deferred_failures();
+        fail_if_freed_blocks_corrupt(function_name);
         fail_if_leftover_values(function_name);
 
         /* If this is a setup function then ignore any allocated blocks
@@ -3193,16 +7408,14 @@ int _run_test(
         rc = 0;
     } else {
         global_running_test = 0;
+        print_mock_trace_on_failure();
         print_message("[  FAILED  ] %s\n", function_name);
     }
     teardown_testing(function_name);
 
     if (handle_exceptions) {
 #ifndef _WIN32
-        unsigned int i;
-        for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
-            signal(exception_signals[i], default_signal_functions[i]);
-        }
+        restore_exception_handlers();
 #else /* _WIN32 */
         if (previous_exception_filter) {
             SetUnhandledExceptionFilter(previous_exception_filter);
@@ -3223,7 +7436,7 @@ int _run_tests(const UnitTest * const tests, const size_t number_of_tests) {
     /* Whether the previous setup failed. */
     int previous_setup_failed = 0;
     /* Check point of the heap state. */
-    const ListNode * const check_point = check_point_allocated_blocks();
+    const size_t check_point = check_point_allocated_blocks();
     /* Current test being executed. */
     size_t current_test = 0;
     /* Number of tests executed. */
@@ -3268,7 +7481,7 @@ int _run_tests(const UnitTest * const tests, const size_t number_of_tests) {
     assert_true(sizeof(LargestIntegralType) >= sizeof(void*));
 
     while (current_test < number_of_tests) {
-        const ListNode *test_check_point = NULL;
+        const size_t *test_check_point = NULL;
         TestState *current_TestState;
         const UnitTest * const test = &tests[current_test++];
         if (!test->function) {
@@ -3285,7 +7498,7 @@ int _run_tests(const UnitTest * const tests, const size_t number_of_tests) {
             /* Checkpoint the heap before the setup. */
             current_TestState = &test_states[number_of_test_states++];
             current_TestState->check_point = check_point_allocated_blocks();
-            test_check_point = current_TestState->check_point;
+            test_check_point = &current_TestState->check_point;
             current_state = &current_TestState->state;
             *current_state = NULL;
             run_next_test = 1;
@@ -3295,7 +7508,7 @@ int _run_tests(const UnitTest * const tests, const size_t number_of_tests) {
             /* Check the heap based on the last setup checkpoint. */
             assert_true(number_of_test_states);
             current_TestState = &test_states[--number_of_test_states];
-            test_check_point = current_TestState->check_point;
+            test_check_point = &current_TestState->check_point;
             current_state = &current_TestState->state;
             break;
         default:
@@ -3365,6 +7578,8 @@ int _run_tests(const UnitTest * const tests, const size_t number_of_tests) {
 
     free(test_states);
     free((void*)failed_names);
+    release_mock_states();
+    release_malloc_pool();
 
     fail_if_blocks_allocated(check_point, "run_tests");
     return (int)total_failed;
@@ -3386,11 +7601,11 @@ int _run_group_tests(const UnitTest * const tests, const size_t number_of_tests)
     /* Number of failed tests. */
     size_t total_failed = 0;
     /* Check point of the heap state. */
-    const ListNode * const check_point = check_point_allocated_blocks();
+    const size_t check_point = check_point_allocated_blocks();
     const char **failed_names = NULL;
     void **current_state = NULL;
     TestState group_state = {
-        .check_point = NULL,
+        .check_point = 0,
     };
 
     if (number_of_tests == 0) {
@@ -3443,7 +7658,7 @@ int _run_group_tests(const UnitTest * const tests, const size_t number_of_tests)
                            setup,
                            current_state,
                            UNIT_TEST_FUNCTION_TYPE_SETUP,
-                           group_state.check_point);
+                           &group_state.check_point);
         if (failed) {
             failed_names[total_failed] = setup_name;
         }
@@ -3498,7 +7713,7 @@ int _run_group_tests(const UnitTest * const tests, const size_t number_of_tests)
                            teardown,
                            current_state,
                            UNIT_TEST_FUNCTION_TYPE_GROUP_TEARDOWN,
-                           group_state.check_point);
+                           &group_state.check_point);
         if (failed) {
             failed_names[total_failed] = teardown_name;
         }
@@ -3520,6 +7735,8 @@ int _run_group_tests(const UnitTest * const tests, const size_t number_of_tests)
     }
 
     free((void*)failed_names);
+    release_mock_states();
+    release_malloc_pool();
     fail_if_blocks_allocated(check_point, "run_group_tests");
 
     return (int)total_failed;
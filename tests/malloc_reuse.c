@@ -0,0 +1,82 @@
+#include "config.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Allocator replacing the one of libc for test_malloc_wrap_reuse.c.  It never
+ * reuses memory on its own, but hands out a given address on request.  It's
+ * kept in its own file so the calls of the test are still wrapped.
+ */
+
+void reuse_malloc_address(void *ptr);
+
+#define HEAP_SIZE (16 * 1024 * 1024)
+#define HEAP_ALIGNMENT 16
+
+static union {
+    char bytes[HEAP_SIZE];
+    long double align;
+} heap;
+static size_t heap_used;
+/* Address returned by the next call of malloc() if it's set. */
+static char *reused_address;
+
+/* Let the next call of malloc() return ptr, whose memory is owned already. */
+void reuse_malloc_address(void *ptr)
+{
+    reused_address = (char *)ptr;
+}
+
+/* The size of a block is stored in front of it for realloc(). */
+void *malloc(size_t size)
+{
+    char *ptr;
+
+    if (reused_address != NULL) {
+        ptr = reused_address;
+        reused_address = NULL;
+        ((size_t *)ptr)[-1] = size;
+        return ptr;
+    }
+    size = (size + HEAP_ALIGNMENT - 1) & ~(size_t)(HEAP_ALIGNMENT - 1);
+    if (size > HEAP_SIZE - heap_used) {
+        return NULL;
+    }
+    ptr = heap.bytes + heap_used + HEAP_ALIGNMENT;
+    ((size_t *)ptr)[-1] = size;
+    heap_used += size + HEAP_ALIGNMENT;
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    (void)ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (size != 0 && nmemb > (size_t)-1 / size) {
+        return NULL;
+    }
+    ptr = malloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *new_ptr = malloc(size);
+
+    if (ptr != NULL && new_ptr != NULL) {
+        const size_t old_size = ((size_t *)ptr)[-1];
+
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    }
+    return new_ptr;
+}
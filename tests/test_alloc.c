@@ -6,6 +6,8 @@
 #include <cmocka.h>
 #include <cmocka_private.h>
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -80,11 +82,135 @@ static void torture_test_realloc_set0(void **state)
     assert_null(str);
 }
 
+static void torture_test_malloc_many(void **state)
+{
+    char *blocks[256];
+    size_t i;
+
+    (void)state; /* unsused */
+
+    for (i = 0; i < 2 * ARRAY_SIZE(blocks); i++) {
+        const size_t j = i % ARRAY_SIZE(blocks);
+        if (i >= ARRAY_SIZE(blocks)) {
+            assert_int_equal(blocks[j][0], (char)j);
+            test_free(blocks[j]);
+        }
+        blocks[j] = (char *)test_malloc(j + 1);
+        assert_non_null(blocks[j]);
+        memset(blocks[j], (int)j, j + 1);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(blocks); i++) {
+        test_free(blocks[i]);
+    }
+}
+
+static void torture_test_realloc_grow(void **state)
+{
+    char *str = NULL;
+    size_t i;
+
+    (void)state; /* unsused */
+
+    for (i = 0; i < 1000; i++) {
+        str = (char *)test_realloc(str, i + 1);
+        assert_non_null(str);
+        str[i] = (char)i;
+    }
+    for (i = 0; i < 1000; i++) {
+        assert_int_equal(str[i], (char)i);
+    }
+
+    str = (char *)test_realloc(str, 10);
+    assert_non_null(str);
+    for (i = 0; i < 10; i++) {
+        assert_int_equal(str[i], (char)i);
+    }
+
+    test_free(str);
+}
+
+static void torture_test_aligned_alloc(void **state)
+{
+    size_t alignment;
+    void *ptr = NULL;
+    char *str;
+
+    (void)state; /* unsused */
+
+    for (alignment = 1; alignment <= 4096; alignment *= 2) {
+        str = (char *)test_aligned_alloc(alignment, 100);
+        assert_non_null(str);
+        assert_int_equal((uintptr_t)str % alignment, 0);
+        memset(str, 0, 100);
+
+        /* Grows in place or moves like any other block. */
+        str = (char *)test_realloc(str, 200);
+        assert_non_null(str);
+        memset(str, 0, 200);
+        test_free(str);
+
+        str = (char *)test_memalign(alignment, 100);
+        assert_non_null(str);
+        assert_int_equal((uintptr_t)str % alignment, 0);
+        memset(str, 0, 100);
+        test_free(str);
+    }
+
+    assert_int_equal(test_posix_memalign(&ptr, 64, 100), 0);
+    assert_non_null(ptr);
+    assert_int_equal((uintptr_t)ptr % 64, 0);
+    test_free(ptr);
+
+    assert_int_equal(test_posix_memalign(&ptr, 2, 100), EINVAL);
+    assert_int_equal(test_posix_memalign(&ptr, 48, 100), EINVAL);
+    errno = 0;
+    assert_null(test_aligned_alloc(24, 100));
+    assert_int_equal(errno, EINVAL);
+}
+
+static void torture_test_memory_budget(void **state)
+{
+    char *buffer;
+    char *str;
+
+    (void)state; /* unsused */
+
+    buffer = (char *)test_malloc(1024);
+    assert_non_null(buffer);
+
+    cmocka_memory_budget_begin();
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+    test_free(str);
+    str = (char *)test_malloc(32);
+    assert_non_null(str);
+    test_free(str);
+    test_free(buffer);
+    cmocka_memory_budget_end();
+
+    /* Allocations after the end of the region don't count. */
+    str = (char *)test_malloc(4096);
+    assert_non_null(str);
+    test_free(str);
+
+    assert_max_allocations(2);
+    assert_max_peak_bytes(32);
+
+    cmocka_memory_budget_begin();
+    assert_max_allocations(0);
+    assert_max_peak_bytes(0);
+}
+
 int main(void) {
     const struct CMUnitTest alloc_tests[] = {
         cmocka_unit_test(torture_test_malloc),
         cmocka_unit_test(torture_test_realloc),
         cmocka_unit_test(torture_test_realloc_set0),
+        cmocka_unit_test(torture_test_malloc_many),
+        cmocka_unit_test(torture_test_realloc_grow),
+        cmocka_unit_test(torture_test_aligned_alloc),
+        cmocka_unit_test(torture_test_memory_budget),
     };
 
     return cmocka_run_group_tests(alloc_tests, NULL, NULL);
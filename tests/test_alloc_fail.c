@@ -0,0 +1,172 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <stdlib.h>
+
+static void test_free_fails_for_double_free(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str);
+    test_free(str);
+}
+
+static void test_free_fails_for_foreign_pointer(void **state)
+{
+    char buffer[16];
+
+    (void)state; /* unused */
+
+    test_free(buffer + 1);
+}
+
+static void test_realloc_fails_for_freed_pointer(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str);
+    str = (char *)test_realloc(str, 32);
+    test_free(str);
+}
+
+static void test_realloc_fails_for_corrupt_guard(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    str[16] = '\0';
+    str = (char *)test_realloc(str, 8);
+    test_free(str);
+}
+
+static void test_free_fails_for_aligned_overrun(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_aligned_alloc(64, 100);
+    assert_non_null(str);
+
+    str[100] = '\0';
+    test_free(str);
+}
+
+static void test_free_fails_for_overrun_past_default_guard(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    /* Only caught with guard blocks larger than the default 16 bytes. */
+    str[16 + 40] = '\0';
+    test_free(str);
+}
+
+static void test_fails_for_write_after_free(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str);
+    str[4] = '\0';
+}
+
+static void test_free_fails_for_evicted_write_after_free(void **state)
+{
+    char *str;
+    char *large;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+    test_free(str);
+    str[0] = '\0';
+
+    /* Freeing a block larger than the quarantine evicts the first block. */
+    large = (char *)test_malloc(8192);
+    assert_non_null(large);
+    test_free(large);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *ptr = test_malloc(size);
+    assert_non_null(ptr);
+    return ptr;
+}
+
+static void test_fails_for_leaks_from_same_stack(void **state)
+{
+    size_t i;
+
+    (void)state; /* unused */
+
+    for (i = 0; i < 3; i++) {
+        (void)xmalloc(8);
+    }
+}
+
+static void test_fails_for_exceeded_memory_budget(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    cmocka_memory_budget_begin();
+    str = (char *)test_malloc(64);
+    assert_non_null(str);
+    test_free(str);
+    cmocka_memory_budget_end();
+
+    assert_max_peak_bytes(64);
+    assert_max_allocations(0);
+}
+
+int main(void) {
+    const struct CMUnitTest alloc_tests[] = {
+        cmocka_unit_test(test_free_fails_for_double_free),
+        cmocka_unit_test(test_free_fails_for_foreign_pointer),
+        cmocka_unit_test(test_realloc_fails_for_freed_pointer),
+        cmocka_unit_test(test_realloc_fails_for_corrupt_guard),
+        cmocka_unit_test(test_free_fails_for_aligned_overrun),
+        cmocka_unit_test(test_free_fails_for_overrun_past_default_guard),
+        cmocka_unit_test(test_fails_for_write_after_free),
+        cmocka_unit_test(test_free_fails_for_evicted_write_after_free),
+        cmocka_unit_test(test_fails_for_leaks_from_same_stack),
+        cmocka_unit_test(test_fails_for_exceeded_memory_budget),
+    };
+
+    cmocka_set_malloc_guard_size(64);
+    cmocka_set_malloc_quarantine_size(4096);
+    cmocka_set_malloc_backtrace(8);
+
+    return cmocka_run_group_tests(alloc_tests, NULL, NULL);
+}
@@ -0,0 +1,110 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+struct pair {
+    char *first;
+    char *second;
+};
+
+static struct pair *pair_new(int free_on_error)
+{
+    struct pair *pair;
+
+    pair = (struct pair *)test_calloc(1, sizeof(struct pair));
+    if (pair == NULL) {
+        return NULL;
+    }
+
+    pair->first = (char *)test_malloc(16);
+    if (pair->first == NULL) {
+        test_free(pair);
+        return NULL;
+    }
+
+    pair->second = (char *)test_malloc(16);
+    if (pair->second == NULL) {
+        if (free_on_error) {
+            test_free(pair->first);
+            test_free(pair);
+        }
+        return NULL;
+    }
+
+    return pair;
+}
+
+static void pair_free(struct pair *pair)
+{
+    test_free(pair->first);
+    test_free(pair->second);
+    test_free(pair);
+}
+
+static int setup(void **state)
+{
+    *state = test_malloc(32);
+    assert_non_null(*state);
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    test_free(*state);
+
+    return 0;
+}
+
+static void test_sweep_handled(void **state)
+{
+    struct pair *pair;
+
+    memset(*state, 0, 32);
+
+    pair = pair_new(1);
+    assert_non_null(pair);
+    pair_free(pair);
+}
+
+static void test_sweep_fails_for_leak(void **state)
+{
+    struct pair *pair;
+
+    (void)state; /* unused */
+
+    pair = pair_new(0);
+    if (pair != NULL) {
+        pair_free(pair);
+    }
+}
+
+static void test_sweep_fails_for_crash(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    str[0] = '\0';
+    test_free(str);
+}
+
+int main(void) {
+    const struct CMUnitTest alloc_tests[] = {
+        cmocka_unit_test_setup_teardown(test_sweep_handled, setup, teardown),
+        cmocka_unit_test(test_sweep_fails_for_leak),
+        cmocka_unit_test(test_sweep_fails_for_crash),
+    };
+
+    cmocka_set_malloc_fail_sweep(1);
+
+    return cmocka_run_group_tests(alloc_tests, NULL, NULL);
+}
@@ -0,0 +1,140 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void realloc_guard_page_block(enum cm_malloc_guard_pages mode)
+{
+    char *str;
+    size_t i;
+
+    cmocka_set_malloc_guard_pages(mode);
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+    for (i = 0; i < 16; i++) {
+        str[i] = (char)i;
+    }
+
+    str = (char *)test_realloc(str, 4096);
+    assert_non_null(str);
+    str[4095] = '\0';
+    for (i = 0; i < 16; i++) {
+        assert_int_equal(str[i], (char)i);
+    }
+
+    test_free(str);
+
+    cmocka_set_malloc_guard_pages(CM_MALLOC_GUARD_PAGES_NONE);
+}
+
+static void test_guard_pages_realloc_overflow(void **state)
+{
+    (void)state; /* unused */
+
+    realloc_guard_page_block(CM_MALLOC_GUARD_PAGES_OVERFLOW);
+}
+
+static void test_guard_pages_realloc_underflow(void **state)
+{
+    (void)state; /* unused */
+
+    realloc_guard_page_block(CM_MALLOC_GUARD_PAGES_UNDERFLOW);
+}
+
+static void aligned_guard_page_block(enum cm_malloc_guard_pages mode)
+{
+    size_t alignment;
+    char *str;
+
+    cmocka_set_malloc_guard_pages(mode);
+
+    for (alignment = 16; alignment <= 8192; alignment *= 2) {
+        str = (char *)test_aligned_alloc(alignment, 100);
+        assert_non_null(str);
+        assert_int_equal((uintptr_t)str % alignment, 0);
+        memset(str, 0, 100);
+        test_free(str);
+    }
+
+    cmocka_set_malloc_guard_pages(CM_MALLOC_GUARD_PAGES_NONE);
+}
+
+static void test_guard_pages_aligned_overflow(void **state)
+{
+    (void)state; /* unused */
+
+    aligned_guard_page_block(CM_MALLOC_GUARD_PAGES_OVERFLOW);
+}
+
+static void test_guard_pages_aligned_underflow(void **state)
+{
+    (void)state; /* unused */
+
+    aligned_guard_page_block(CM_MALLOC_GUARD_PAGES_UNDERFLOW);
+}
+
+static void test_guard_pages_fail_for_overflow(void **state)
+{
+    volatile char *str;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_guard_pages(CM_MALLOC_GUARD_PAGES_OVERFLOW);
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    str[16] = '\0';
+    test_free(discard_const(str));
+}
+
+static void test_guard_pages_fail_for_underflow(void **state)
+{
+    volatile char *str;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_guard_pages(CM_MALLOC_GUARD_PAGES_UNDERFLOW);
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    str[-1] = '\0';
+    test_free(discard_const(str));
+}
+
+static void test_guard_pages_fail_for_shrunk_overflow(void **state)
+{
+    volatile char *str;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_guard_pages(CM_MALLOC_GUARD_PAGES_OVERFLOW);
+    str = (char *)test_malloc(64);
+    assert_non_null(str);
+    str = (char *)test_realloc(discard_const(str), 16);
+    assert_non_null(str);
+
+    str[20] = '\0';
+    test_free(discard_const(str));
+}
+
+int main(void) {
+    const struct CMUnitTest alloc_tests[] = {
+        cmocka_unit_test(test_guard_pages_realloc_overflow),
+        cmocka_unit_test(test_guard_pages_realloc_underflow),
+        cmocka_unit_test(test_guard_pages_aligned_overflow),
+        cmocka_unit_test(test_guard_pages_aligned_underflow),
+        cmocka_unit_test(test_guard_pages_fail_for_overflow),
+        cmocka_unit_test(test_guard_pages_fail_for_underflow),
+        cmocka_unit_test(test_guard_pages_fail_for_shrunk_overflow),
+    };
+
+    return cmocka_run_group_tests(alloc_tests, NULL, NULL);
+}
@@ -0,0 +1,75 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <pthread.h>
+#include <string.h>
+
+/*
+ * The heap isn't shared, each thread tracks the blocks it allocated and only
+ * it may free them.
+ */
+
+static void *allocate_block(void *arg)
+{
+    char **block = (char **)arg;
+
+    *block = (char *)test_malloc(32);
+    if (*block != NULL) {
+        memset(*block, 'x', 32);
+    }
+
+    return NULL;
+}
+
+static void *allocate_and_free_block(void *arg)
+{
+    char *block;
+
+    (void)arg; /* unused */
+
+    block = (char *)test_malloc(32);
+    block = (char *)test_realloc(block, 4096);
+    test_free(block);
+
+    return NULL;
+}
+
+static void test_thread_frees_own_block(void **state)
+{
+    pthread_t thread;
+
+    (void)state; /* unused */
+
+    assert_int_equal(pthread_create(&thread, NULL, allocate_and_free_block,
+                                    NULL),
+                     0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+}
+
+static void test_fails_for_block_of_other_thread(void **state)
+{
+    pthread_t thread;
+    char *block = NULL;
+
+    (void)state; /* unused */
+
+    assert_int_equal(pthread_create(&thread, NULL, allocate_block, &block), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    assert_non_null(block);
+
+    test_free(block);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_thread_frees_own_block),
+        cmocka_unit_test(test_fails_for_block_of_other_thread),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
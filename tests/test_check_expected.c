@@ -0,0 +1,68 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+void mock_function(int value, const char *string, const void *memory);
+
+void mock_function(int value, const char *string, const void *memory)
+{
+    check_expected(value);
+    check_expected_ptr(string);
+    check_expected_ptr(memory);
+}
+
+static int check_value_is_even(const LargestIntegralType value,
+                               const LargestIntegralType check_value_data)
+{
+    (void)check_value_data;
+    return (value % 2) == 0;
+}
+
+static void test_check_expected_values(void **state)
+{
+    LargestIntegralType set[] = { 3, 5, 7 };
+    LargestIntegralType array[] = { 11, 13 };
+    const char memory[] = { 1, 2, 3, 4 };
+    const char other_memory[] = { 4, 3, 2, 1 };
+
+    (void)state;
+
+    expect_value(mock_function, value, 1);
+    expect_not_value(mock_function, value, 1);
+    expect_in_set(mock_function, value, set);
+    expect_not_in_set(mock_function, value, set);
+    expect_in_range(mock_function, value, 10, 20);
+    expect_not_in_range(mock_function, value, 10, 20);
+    expect_value_array(mock_function, value, array, 2);
+    expect_check(mock_function, value, check_value_is_even, 0);
+    expect_any(mock_function, value);
+    expect_any_count(mock_function, string, 8);
+    expect_string(mock_function, string, "cmocka");
+    expect_not_string(mock_function, string, "cmocka");
+    expect_any_count(mock_function, memory, 8);
+    expect_memory(mock_function, memory, memory, sizeof(memory));
+    expect_not_memory(mock_function, memory, memory, sizeof(memory));
+
+    mock_function(1, "a", NULL);
+    mock_function(2, "b", NULL);
+    mock_function(5, "c", NULL);
+    mock_function(4, "d", NULL);
+    mock_function(15, "e", NULL);
+    mock_function(25, "f", NULL);
+    mock_function(11, "g", NULL);
+    mock_function(13, "h", NULL);
+    mock_function(42, "cmocka", memory);
+    mock_function(42, "mock", other_memory);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_check_expected_values)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
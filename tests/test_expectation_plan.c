@@ -0,0 +1,105 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+static struct CMExpectationPlan *plan;
+
+int mock_read(int fd, const char *path);
+void mock_log(void);
+
+int mock_read(int fd, const char *path)
+{
+    function_called();
+    check_expected(fd);
+    check_expected_ptr(path);
+    return (int)mock();
+}
+
+void mock_log(void)
+{
+    function_called();
+}
+
+static int group_setup(void **state)
+{
+    LargestIntegralType sizes[] = { 4, 8 };
+    LargestIntegralType fds[] = { 3, 5 };
+
+    (void)state;
+
+    plan = cmocka_expectation_plan_begin();
+    will_return_array(mock_read, sizes, 2);
+    will_return(mock_read, 0);
+    expect_value_array(mock_read, fd, fds, 2);
+    expect_value(mock_read, fd, 7);
+    expect_string_count(mock_read, path, "/etc/config", 3);
+    ignore_function_calls(mock_log);
+    expect_function_calls(mock_read, 3);
+    cmocka_expectation_plan_end(plan);
+
+    return 0;
+}
+
+static int group_teardown(void **state)
+{
+    (void)state;
+
+    cmocka_expectation_plan_free(plan);
+
+    return 0;
+}
+
+static void read_config(void)
+{
+    mock_log();
+    assert_int_equal(mock_read(3, "/etc/config"), 4);
+    assert_int_equal(mock_read(5, "/etc/config"), 8);
+    mock_log();
+    assert_int_equal(mock_read(7, "/etc/config"), 0);
+}
+
+static void test_expectation_plan_apply(void **state)
+{
+    (void)state;
+
+    cmocka_expectation_plan_apply(plan);
+    read_config();
+}
+
+static void test_expectation_plan_apply_twice(void **state)
+{
+    (void)state;
+
+    cmocka_expectation_plan_apply(plan);
+    cmocka_expectation_plan_apply(plan);
+    read_config();
+    read_config();
+}
+
+static void test_expectation_plan_with_test_expectations(void **state)
+{
+    (void)state;
+
+    will_return(mock_read, 1);
+    expect_any(mock_read, fd);
+    expect_any(mock_read, path);
+    expect_function_call(mock_read);
+    cmocka_expectation_plan_apply(plan);
+
+    assert_int_equal(mock_read(0, "/tmp"), 1);
+    read_config();
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_expectation_plan_apply),
+        cmocka_unit_test(test_expectation_plan_apply_twice),
+        cmocka_unit_test(test_expectation_plan_with_test_expectations),
+    };
+
+    return cmocka_run_group_tests(tests, group_setup, group_teardown);
+}
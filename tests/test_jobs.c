@@ -0,0 +1,82 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+static pid_t runner_pid;
+
+static int group_setup(void **state)
+{
+    int *answer = malloc(sizeof(int));
+
+    assert_non_null(answer);
+    *answer = 42;
+    *state = answer;
+
+    return 0;
+}
+
+static int group_teardown(void **state)
+{
+    free(*state);
+
+    return 0;
+}
+
+static void test_runs_in_worker(void **state)
+{
+    (void)state; /* unused */
+
+    assert_int_not_equal(getpid(), runner_pid);
+}
+
+static void test_sees_group_state(void **state)
+{
+    assert_int_equal(*(int *)*state, 42);
+}
+
+static void test_prints_output(void **state)
+{
+    (void)state; /* unused */
+
+    print_message("output of test_prints_output\n");
+}
+
+static void test_fails_for_leak(void **state)
+{
+    void *leak;
+
+    (void)state; /* unused */
+
+    leak = test_malloc(16);
+    assert_non_null(leak);
+}
+
+static void test_fails_for_exit(void **state)
+{
+    (void)state; /* unused */
+
+    exit(1);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_runs_in_worker),
+        cmocka_unit_test(test_sees_group_state),
+        cmocka_unit_test(test_prints_output),
+        cmocka_unit_test(test_fails_for_leak),
+        cmocka_unit_test(test_fails_for_exit),
+        cmocka_unit_test(test_runs_in_worker),
+    };
+
+    runner_pid = getpid();
+    cmocka_set_jobs(3);
+
+    return cmocka_run_group_tests(tests, group_setup, group_teardown);
+}
@@ -0,0 +1,130 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * This file is linked with -Wl,--wrap=malloc,--wrap=calloc,... and isn't
+ * compiled with UNIT_TESTING, like a library which doesn't know about cmocka.
+ */
+
+struct list {
+    char **items;
+    size_t count;
+};
+
+static char *untracked_block;
+
+static struct list *list_new(void)
+{
+    return (struct list *)calloc(1, sizeof(struct list));
+}
+
+static int list_append(struct list *list, const char *item)
+{
+    char **items;
+
+    items = (char **)realloc(list->items,
+                             (list->count + 1) * sizeof(*list->items));
+    if (items == NULL) {
+        return -1;
+    }
+    list->items = items;
+    list->items[list->count] = strdup(item);
+    if (list->items[list->count] == NULL) {
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+static void list_free(struct list *list)
+{
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    free(list);
+}
+
+static void test_wrap_tracks_allocations(void **state)
+{
+    struct list *list;
+    int i;
+
+    (void)state; /* unused */
+
+    list = list_new();
+    assert_non_null(list);
+    for (i = 0; i < 16; i++) {
+        assert_int_equal(list_append(list, "cmocka"), 0);
+    }
+    assert_string_equal(list->items[15], "cmocka");
+    list_free(list);
+}
+
+static void test_wrap_frees_untracked_block(void **state)
+{
+    (void)state; /* unused */
+
+    /* Allocated before the tests ran, it goes back to libc. */
+    free(untracked_block);
+    untracked_block = NULL;
+}
+
+static void test_wrap_fails_for_leak(void **state)
+{
+    struct list *list;
+
+    (void)state; /* unused */
+
+    list = list_new();
+    assert_non_null(list);
+}
+
+static void test_wrap_fails_for_overrun(void **state)
+{
+    volatile char *str;
+
+    (void)state; /* unused */
+
+    str = strdup("cmocka");
+    assert_non_null(str);
+    str[7] = '!';
+    free(discard_const(str));
+}
+
+static void test_wrap_fails_for_double_free(void **state)
+{
+    char * volatile str;
+
+    (void)state; /* unused */
+
+    str = (char *)malloc(16);
+    assert_non_null(str);
+    free(str);
+    free(str);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_wrap_tracks_allocations),
+        cmocka_unit_test(test_wrap_frees_untracked_block),
+        cmocka_unit_test(test_wrap_fails_for_leak),
+        cmocka_unit_test(test_wrap_fails_for_overrun),
+        cmocka_unit_test(test_wrap_fails_for_double_free),
+    };
+
+    untracked_block = (char *)malloc(64);
+    assert_non_null(untracked_block);
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
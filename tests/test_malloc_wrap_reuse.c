@@ -0,0 +1,70 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * This file is linked with -Wl,--wrap=malloc,--wrap=calloc,... like
+ * test_malloc_wrap.c.  Once the tests ended libc may hand out the address of
+ * a block freed by a test again, which must then go straight to libc.
+ *
+ * To reuse an address at will, libc's allocator is replaced by the one of
+ * malloc_reuse.c.
+ */
+
+void reuse_malloc_address(void *ptr);
+
+static char *freed_block;
+
+static void test_wrap_frees_block(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = strdup("cmocka");
+    assert_non_null(str);
+    free(str);
+}
+
+static void test_wrap_forgets_freed_block(void **state)
+{
+    (void)state; /* unused */
+
+    freed_block = (char *)malloc(64);
+    assert_non_null(freed_block);
+    free(freed_block);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_wrap_frees_block),
+        cmocka_unit_test(test_wrap_forgets_freed_block),
+    };
+    char *block;
+    int rc;
+
+    rc = cmocka_run_group_tests(tests, NULL, NULL);
+
+    /* Neither of these may be reported as freed twice. */
+    reuse_malloc_address(freed_block);
+    block = (char *)malloc(64);
+    if (block != freed_block) {
+        return -1;
+    }
+    block = (char *)realloc(block, 128);
+    if (block == NULL) {
+        return -1;
+    }
+    reuse_malloc_address(freed_block);
+    block = (char *)malloc(64);
+    free(block);
+
+    return rc;
+}
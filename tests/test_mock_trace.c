@@ -0,0 +1,45 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+int mock_function(int value);
+
+int mock_function(int value)
+{
+    function_called();
+    check_expected(value);
+    return (int)mock();
+}
+
+static void test_mock_trace(void **state)
+{
+    int i;
+
+    (void)state;
+
+    for (i = 0; i < 6; i++) {
+        expect_function_call(mock_function);
+        expect_value(mock_function, value, i);
+        will_return(mock_function, 42 + i);
+    }
+    for (i = 0; i < 6; i++) {
+        assert_int_equal(mock_function(i), 42 + i);
+    }
+
+    /* The trace only keeps the latest 8 of the 18 interactions. */
+    cmocka_print_mock_trace();
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_mock_trace)
+    };
+
+    cmocka_set_mock_trace(8);
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -6,6 +6,8 @@
 #include <cmocka.h>
 #include <cmocka_private.h>
 
+#include <stdio.h>
+
 static void mock_test_a_called(void)
 {
     function_called();
@@ -97,6 +99,30 @@ static void test_ordering_ignores_out_of_order_properly(void **state)
     mock_test_c_called();
 }
 
+static void test_ordering_many_ignored_calls(void **state)
+{
+    char names[1000][32];
+    size_t i;
+
+    (void)state;
+
+    for (i = 0; i < 1000; i++) {
+        snprintf(names[i], sizeof(names[i]), "mock_function_%u", (unsigned)i);
+        _expect_function_call(names[i], __FILE__, __LINE__, -2);
+    }
+    expect_function_call_any(mock_test_a_called);
+    expect_function_call(mock_test_b_called);
+
+    for (i = 1000; i > 0; i--) {
+        _function_called(names[i - 1], __FILE__, __LINE__);
+    }
+    mock_test_a_called();
+    _function_called(names[0], __FILE__, __LINE__);
+    mock_test_a_called();
+    mock_test_b_called();
+    mock_test_a_called();
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_does_succeed_for_expected)
@@ -106,6 +132,7 @@ int main(void) {
         ,cmocka_unit_test(test_ordering_does_expect_at_least_one_call)
         ,cmocka_unit_test(test_ordering_does_work_across_different_functions)
         ,cmocka_unit_test(test_ordering_ignores_out_of_order_properly)
+        ,cmocka_unit_test(test_ordering_many_ignored_calls)
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
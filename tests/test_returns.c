@@ -7,9 +7,11 @@
 #include <cmocka_private.h>
 
 #include <stdlib.h>
+#include <stdio.h>
 
 int mock_function(void);
 void mock_function_call_times(size_t times, int expectedValue);
+void mock_function_with_param(int value);
 
 int mock_function(void)
 {
@@ -25,6 +27,11 @@ void mock_function_call_times(size_t times, int expectedValue)
     }
 }
 
+void mock_function_with_param(int value)
+{
+    check_expected(value);
+}
+
 static void test_will_return_maybe_for_no_calls(void **state)
 {
     (void) state;
@@ -55,11 +62,108 @@ static void test_will_return_maybe_for_more_than_one_call(void **state)
     mock_function_call_times(numberOfCalls, value);
 }
 
+static void test_will_return_many_functions(void **state)
+{
+    char names[200][32];
+    size_t i;
+
+    (void)state;
+
+    for (i = 0; i < 200; i++) {
+        snprintf(names[i], sizeof(names[i]), "mock_function_%u", (unsigned)i);
+        _will_return(names[i], __FILE__, __LINE__,
+                     cast_to_largest_integral_type(i), 1);
+    }
+
+    /* Consume the values in reverse order of declaration */
+    for (i = 200; i > 0; i--) {
+        assert_int_equal(_mock(names[i - 1], __FILE__, __LINE__), i - 1);
+    }
+}
+
+static void test_will_return_interleaved(void **state)
+{
+    int i;
+    int next = 0;
+
+    (void)state;
+
+    /* Keep the queue of the function partially consumed while it grows */
+    for (i = 0; i < 100; i++) {
+        will_return(mock_function, i);
+        if (i % 3 == 0) {
+            assert_int_equal(mock_function(), next++);
+        }
+    }
+    while (next < 100) {
+        assert_int_equal(mock_function(), next++);
+    }
+}
+
+static void test_will_return_array(void **state)
+{
+    LargestIntegralType values[64];
+    size_t i;
+
+    (void)state;
+
+    for (i = 0; i < 64; i++) {
+        values[i] = i * 3;
+    }
+
+    will_return(mock_function, 7);
+    will_return_array(mock_function, values, 64);
+    will_return(mock_function, 11);
+
+    assert_int_equal(mock_function(), 7);
+    for (i = 0; i < 64; i++) {
+        assert_int_equal(mock_function(), i * 3);
+    }
+    assert_int_equal(mock_function(), 11);
+}
+
+static void test_expect_value_array(void **state)
+{
+    LargestIntegralType values[] = { 4, 8, 15, 16, 23, 42 };
+    size_t i;
+
+    (void)state;
+
+    expect_value_array(mock_function_with_param, value, values, 6);
+    expect_value(mock_function_with_param, value, 108);
+
+    for (i = 0; i < 6; i++) {
+        mock_function_with_param((int)values[i]);
+    }
+    mock_function_with_param(108);
+}
+
+static void test_will_return_name_in_reused_buffer(void **state)
+{
+    char name[32];
+
+    (void)state;
+
+    snprintf(name, sizeof(name), "%s", "first_function");
+    _will_return(name, __FILE__, __LINE__, 1, 1);
+    /* The same address holds the name of another function now. */
+    snprintf(name, sizeof(name), "%s", "second_function");
+    _will_return(name, __FILE__, __LINE__, 2, 1);
+
+    assert_int_equal(_mock("second_function", __FILE__, __LINE__), 2);
+    assert_int_equal(_mock("first_function", __FILE__, __LINE__), 1);
+}
+
 int main(int argc, char **argv) {
     const struct CMUnitTest alloc_tests[] = {
         cmocka_unit_test(test_will_return_maybe_for_no_calls)
         ,cmocka_unit_test(test_will_return_maybe_for_one_mock_call)
         ,cmocka_unit_test(test_will_return_maybe_for_more_than_one_call)
+        ,cmocka_unit_test(test_will_return_many_functions)
+        ,cmocka_unit_test(test_will_return_interleaved)
+        ,cmocka_unit_test(test_will_return_array)
+        ,cmocka_unit_test(test_expect_value_array)
+        ,cmocka_unit_test(test_will_return_name_in_reused_buffer)
     };
 
     (void)argc;
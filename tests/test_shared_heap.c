@@ -0,0 +1,150 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <pthread.h>
+#include <string.h>
+
+#define NUM_WORKERS 8
+#define BLOCKS_PER_WORKER 1000
+
+static void *allocate_blocks(void *arg)
+{
+    char **blocks = (char **)arg;
+    int i;
+
+    for (i = 0; i < BLOCKS_PER_WORKER; i++) {
+        blocks[i] = (char *)test_malloc((size_t)(i % 64) + 1);
+        if (blocks[i] != NULL) {
+            blocks[i][0] = (char)i;
+        }
+    }
+
+    return NULL;
+}
+
+static void *free_blocks(void *arg)
+{
+    char **blocks = (char **)arg;
+    int i;
+
+    for (i = 0; i < BLOCKS_PER_WORKER; i++) {
+        test_free(blocks[i]);
+    }
+
+    return NULL;
+}
+
+static void *churn_blocks(void *arg)
+{
+    char *blocks[16] = {0};
+    int i;
+
+    (void)arg;
+
+    for (i = 0; i < BLOCKS_PER_WORKER; i++) {
+        char **block = &blocks[i % 16];
+
+        test_free(*block);
+        *block = (char *)test_malloc((size_t)(i % 128) + 1);
+        if (*block != NULL) {
+            memset(*block, 0, (size_t)(i % 128) + 1);
+        }
+    }
+    for (i = 0; i < 16; i++) {
+        test_free(blocks[i]);
+    }
+
+    return NULL;
+}
+
+static void run_workers(void *(*function)(void *),
+                        char *blocks[][BLOCKS_PER_WORKER])
+{
+    pthread_t threads[NUM_WORKERS];
+    int i;
+
+    for (i = 0; i < NUM_WORKERS; i++) {
+        void *arg = blocks != NULL ? (void *)blocks[i] : NULL;
+        assert_int_equal(pthread_create(&threads[i], NULL, function, arg), 0);
+    }
+    for (i = 0; i < NUM_WORKERS; i++) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+    }
+}
+
+static void test_free_blocks_of_workers(void **state)
+{
+    char *blocks[NUM_WORKERS][BLOCKS_PER_WORKER];
+    int i;
+    int j;
+
+    (void)state;
+
+    run_workers(allocate_blocks, blocks);
+    for (i = 0; i < NUM_WORKERS; i++) {
+        for (j = 0; j < BLOCKS_PER_WORKER; j++) {
+            assert_non_null(blocks[i][j]);
+            assert_int_equal(blocks[i][j][0], (char)j);
+            test_free(blocks[i][j]);
+        }
+    }
+}
+
+static void test_workers_free_blocks_of_test(void **state)
+{
+    char *blocks[NUM_WORKERS][BLOCKS_PER_WORKER];
+    int i;
+
+    (void)state;
+
+    for (i = 0; i < NUM_WORKERS; i++) {
+        allocate_blocks(blocks[i]);
+    }
+    run_workers(free_blocks, blocks);
+}
+
+static void test_workers_churn_blocks(void **state)
+{
+    (void)state;
+
+    run_workers(churn_blocks, NULL);
+
+    assert_max_allocations(NUM_WORKERS * BLOCKS_PER_WORKER);
+}
+
+static void *leak_block(void *arg)
+{
+    (void)arg;
+
+    return test_malloc(16);
+}
+
+static void test_shared_heap_fails_for_leak_of_worker(void **state)
+{
+    pthread_t thread;
+    void *block;
+
+    (void)state;
+
+    assert_int_equal(pthread_create(&thread, NULL, leak_block, NULL), 0);
+    assert_int_equal(pthread_join(thread, &block), 0);
+    assert_non_null(block);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_free_blocks_of_workers),
+        cmocka_unit_test(test_workers_free_blocks_of_test),
+        cmocka_unit_test(test_workers_churn_blocks),
+        cmocka_unit_test(test_shared_heap_fails_for_leak_of_worker),
+    };
+
+    cmocka_set_shared_heap(1);
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
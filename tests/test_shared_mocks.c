@@ -0,0 +1,116 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <pthread.h>
+
+#define NUM_WORKERS 4
+#define CALLS_PER_WORKER 250
+
+static int worker_ran_past_failure;
+
+int mock_read(int fd);
+
+int mock_read(int fd)
+{
+    check_expected(fd);
+    function_called();
+    return (int)mock();
+}
+
+static void *worker(void *arg)
+{
+    long *sum = (long *)arg;
+    int i;
+
+    for (i = 0; i < CALLS_PER_WORKER; i++) {
+        *sum += mock_read(3);
+    }
+
+    return NULL;
+}
+
+static void test_mocks_shared_with_workers(void **state)
+{
+    pthread_t threads[NUM_WORKERS];
+    long sums[NUM_WORKERS] = {0};
+    long sum = 0;
+    int i;
+
+    (void)state;
+
+    for (i = 0; i < NUM_WORKERS * CALLS_PER_WORKER; i++) {
+        will_return(mock_read, i);
+    }
+    expect_value_count(mock_read, fd, 3, NUM_WORKERS * CALLS_PER_WORKER);
+    ignore_function_calls(mock_read);
+
+    for (i = 0; i < NUM_WORKERS; i++) {
+        assert_int_equal(pthread_create(&threads[i], NULL, worker, &sums[i]),
+                         0);
+    }
+    for (i = 0; i < NUM_WORKERS; i++) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+        sum += sums[i];
+    }
+
+    assert_int_equal(sum, (NUM_WORKERS * CALLS_PER_WORKER) *
+                          (NUM_WORKERS * CALLS_PER_WORKER - 1) / 2);
+}
+
+static void *failing_worker(void *arg)
+{
+    (void)arg;
+
+    mock_read(4);
+    worker_ran_past_failure = 1;
+
+    return NULL;
+}
+
+static void test_mocks_fail_on_worker(void **state)
+{
+    pthread_t thread;
+
+    (void)state;
+
+    expect_value(mock_read, fd, 3);
+
+    assert_int_equal(pthread_create(&thread, NULL, failing_worker, NULL), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+}
+
+static void test_worker_runs_past_failure(void **state)
+{
+    (void)state;
+
+    assert_true(worker_ran_past_failure);
+}
+
+static void test_mocks_shared_with_test_thread(void **state)
+{
+    (void)state;
+
+    will_return(mock_read, 42);
+    expect_value(mock_read, fd, 3);
+    expect_function_call(mock_read);
+
+    assert_int_equal(mock_read(3), 42);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_mocks_shared_with_workers),
+        cmocka_unit_test(test_mocks_fail_on_worker),
+        cmocka_unit_test(test_worker_runs_past_failure),
+        cmocka_unit_test(test_mocks_shared_with_test_thread),
+    };
+
+    cmocka_set_shared_mocks(1);
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}